@@ -0,0 +1,141 @@
+#include "AllocationCounter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+thread_local size_t t_allocations = 0;
+
+}
+
+size_t ThreadAllocationCount() {
+    return t_allocations;
+}
+
+void AddThreadAllocations(size_t count) {
+    t_allocations += count;
+}
+
+#if defined(GRAPHER_COUNT_ALLOCATIONS)
+
+namespace {
+
+void* CountedAlloc(size_t size) {
+    ++t_allocations;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void* CountedAlignedAlloc(size_t size, std::align_val_t alignment) {
+    ++t_allocations;
+    size_t align = (size_t)alignment;
+    // aligned_alloc wants a multiple of the alignment; a zero-size request
+    // still takes one aligned block.
+    size = (std::max<size_t>(size, 1) + align - 1) / align * align;
+#if defined(_WIN32)
+    return _aligned_malloc(size, align);
+#else
+    return std::aligned_alloc(align, size);
+#endif
+}
+
+void AlignedFree(void* p) {
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+}
+
+void* operator new(size_t size) {
+    void* p = CountedAlloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    void* p = CountedAlloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return CountedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return CountedAlloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* p = CountedAlignedAlloc(size, alignment);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    void* p = CountedAlignedAlloc(size, alignment);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return CountedAlignedAlloc(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return CountedAlignedAlloc(size, alignment);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    AlignedFree(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    AlignedFree(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    AlignedFree(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    AlignedFree(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    AlignedFree(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    AlignedFree(p);
+}
+
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+
+// Counting replaces the global operator new and delete, which is a
+// diagnostics build option: it is compiled only when GRAPHER_COUNT_ALLOCATIONS
+// is defined. Otherwise the counts stay at zero and are not shown.
+#if defined(GRAPHER_COUNT_ALLOCATIONS)
+const bool kCountAllocations = true;
+#else
+const bool kCountAllocations = false;
+#endif
+
+// Number of heap allocations made so far by the calling thread. Builders read
+// it before and after a build, so the difference is what that build allocated.
+size_t ThreadAllocationCount();
+
+// Adds allocations another thread made for the caller, such as a worker pool
+// running the caller's job.
+void AddThreadAllocations(size_t count);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cmath>
+
+// Forward-mode dual number: a value together with its partial derivatives
+// with respect to up to three inputs. A zero partial or a zero slope stays
+// zero through the chain rule, so a singular derivative of an unrelated
+// input (sqrt at 0, log at 0) does not poison the others with NaN.
+struct Dual
+{
+    static const int kPartials = 3;
+
+    double v;
+    double d[kPartials];
+    Dual() : v(0.0), d{ 0.0, 0.0, 0.0 } {}
+    Dual(double v) : v(v), d{ 0.0, 0.0, 0.0 } {}
+
+    static Dual Variable(double v, int index) {
+        Dual r(v);
+        if (index >= 0 && index < kPartials) r.d[index] = 1.0;
+        return r;
+    }
+};
+
+namespace dual {
+
+inline double Scale(double factor, double partial) {
+    return (partial == 0.0 || factor == 0.0) ? 0.0 : factor * partial;
+}
+
+inline Dual Chain(const Dual& a, double value, double slope) {
+    Dual r(value);
+    for (int k = 0; k < Dual::kPartials; ++k) r.d[k] = Scale(slope, a.d[k]);
+    return r;
+}
+
+inline Dual Chain(const Dual& a, const Dual& b, double value, double slopeA, double slopeB) {
+    Dual r(value);
+    for (int k = 0; k < Dual::kPartials; ++k) r.d[k] = Scale(slopeA, a.d[k]) + Scale(slopeB, b.d[k]);
+    return r;
+}
+
+inline bool Constant(const Dual& a) {
+    for (int k = 0; k < Dual::kPartials; ++k) if (a.d[k] != 0.0) return false;
+    return true;
+}
+
+inline Dual Neg(const Dual& a) { return Chain(a, -a.v, -1.0); }
+inline Dual Add(const Dual& a, const Dual& b) { return Chain(a, b, a.v + b.v, 1.0, 1.0); }
+inline Dual Sub(const Dual& a, const Dual& b) { return Chain(a, b, a.v - b.v, 1.0, -1.0); }
+inline Dual Mul(const Dual& a, const Dual& b) { return Chain(a, b, a.v * b.v, b.v, a.v); }
+
+inline Dual Div(const Dual& a, const Dual& b) {
+    double q = a.v / b.v;
+    return Chain(a, b, q, 1.0 / b.v, -q / b.v);
+}
+
+inline Dual Mod(const Dual& a, const Dual& b) {
+    return Chain(a, b, std::fmod(a.v, b.v), 1.0, -std::trunc(a.v / b.v));
+}
+
+inline Dual PowInt(const Dual& a, int n, double value) {
+    if (n == 0) return Dual(value);
+    return Chain(a, value, (double)n * std::pow(a.v, (double)(n - 1)));
+}
+
+inline Dual Pow(const Dual& a, const Dual& b) {
+    double value = std::pow(a.v, b.v);
+    double slopeA = (b.v == 0.0) ? 0.0 : b.v * std::pow(a.v, b.v - 1.0);
+    double slopeB = (Constant(b) || value == 0.0) ? 0.0 : value * std::log(a.v);
+    return Chain(a, b, value, slopeA, slopeB);
+}
+
+inline Dual Min(const Dual& a, const Dual& b) { return (b.v < a.v) ? b : a; }
+inline Dual Max(const Dual& a, const Dual& b) { return (a.v < b.v) ? b : a; }
+
+inline Dual Atan2(const Dual& a, const Dual& b) {
+    double r2 = a.v * a.v + b.v * b.v;
+    return Chain(a, b, std::atan2(a.v, b.v), b.v / r2, -a.v / r2);
+}
+
+inline Dual Hypot(const Dual& a, const Dual& b) {
+    double h = std::hypot(a.v, b.v);
+    return Chain(a, b, h, a.v / h, b.v / h);
+}
+
+inline Dual Sin(const Dual& a) { return Chain(a, std::sin(a.v), std::cos(a.v)); }
+inline Dual Cos(const Dual& a) { return Chain(a, std::cos(a.v), -std::sin(a.v)); }
+
+inline Dual Tan(const Dual& a) {
+    double c = std::cos(a.v);
+    return Chain(a, std::tan(a.v), 1.0 / (c * c));
+}
+
+inline Dual Asin(const Dual& a) { return Chain(a, std::asin(a.v), 1.0 / std::sqrt(1.0 - a.v * a.v)); }
+inline Dual Acos(const Dual& a) { return Chain(a, std::acos(a.v), -1.0 / std::sqrt(1.0 - a.v * a.v)); }
+inline Dual Atan(const Dual& a) { return Chain(a, std::atan(a.v), 1.0 / (1.0 + a.v * a.v)); }
+inline Dual Sinh(const Dual& a) { return Chain(a, std::sinh(a.v), std::cosh(a.v)); }
+inline Dual Cosh(const Dual& a) { return Chain(a, std::cosh(a.v), std::sinh(a.v)); }
+
+inline Dual Tanh(const Dual& a) {
+    double t = std::tanh(a.v);
+    return Chain(a, t, 1.0 - t * t);
+}
+
+inline Dual Exp(const Dual& a) {
+    double e = std::exp(a.v);
+    return Chain(a, e, e);
+}
+
+inline Dual Log(const Dual& a) { return Chain(a, std::log(a.v), 1.0 / a.v); }
+inline Dual Log10(const Dual& a) { return Chain(a, std::log10(a.v), 1.0 / (a.v * 2.30258509299404568402)); }
+inline Dual Log2(const Dual& a) { return Chain(a, std::log2(a.v), 1.0 / (a.v * 0.69314718055994530942)); }
+
+inline Dual Sqrt(const Dual& a) {
+    double s = std::sqrt(a.v);
+    return Chain(a, s, 0.5 / s);
+}
+
+inline Dual Abs(const Dual& a) {
+    return Chain(a, std::fabs(a.v), (a.v > 0.0) ? 1.0 : ((a.v < 0.0) ? -1.0 : 0.0));
+}
+
+}
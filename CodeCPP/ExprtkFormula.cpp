@@ -0,0 +1,77 @@
+#include "ExprtkFormula.h"
+
+// Case-insensitive identifiers are left on: the bytecode backend lowercases
+// names, so SIN(x) has to parse the same way here.
+#define exprtk_disable_string_capabilities
+#define exprtk_disable_return_statement
+#define exprtk_disable_break_continue
+#define exprtk_disable_comments
+#define exprtk_disable_sc_andor
+#define exprtk_disable_superscalar_unroll
+#define exprtk_disable_rtl_io
+#define exprtk_disable_rtl_io_file
+#define exprtk_disable_rtl_vecops
+#include "exprtk.hpp"
+
+#include <limits>
+#include <mutex>
+
+struct ExprtkExpression::Tree {
+    exprtk::expression<double> expression;
+};
+
+struct ExprtkContext::Symbols {
+    exprtk::symbol_table<double> table;
+};
+
+namespace {
+
+std::mutex& ParserMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+exprtk::parser<double>& SharedParser() {
+    static exprtk::parser<double> parser;
+    return parser;
+}
+
+}
+
+double ExprtkExpression::value() const {
+    if (!tree) return std::numeric_limits<double>::quiet_NaN();
+    return tree->expression.value();
+}
+
+double ExprtkExpression::derivative(double& variable) const {
+    if (!tree) return std::numeric_limits<double>::quiet_NaN();
+    return exprtk::derivative(tree->expression, variable);
+}
+
+ExprtkContext::ExprtkContext(bool controlStructures)
+    : symbols(new Symbols()), controlStructures(controlStructures) {
+    symbols->table.add_constants();
+}
+
+ExprtkContext::~ExprtkContext() {
+}
+
+bool ExprtkContext::addVariable(const std::string& name, double& value) {
+    return symbols->table.add_variable(name, value);
+}
+
+bool ExprtkContext::compile(const std::string& text, ExprtkExpression& out) {
+    std::shared_ptr<ExprtkExpression::Tree> tree = std::make_shared<ExprtkExpression::Tree>();
+    tree->expression.register_symbol_table(symbols->table);
+    bool ok;
+    {
+        std::lock_guard<std::mutex> lock(ParserMutex());
+        exprtk::parser<double>& parser = SharedParser();
+        if (controlStructures) parser.settings().enable_all_control_structures();
+        else parser.settings().disable_all_control_structures();
+        ok = parser.compile(text, tree->expression);
+    }
+    if (ok) out.tree = tree;
+    else out.tree.reset();
+    return ok;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+// Thin front end over exprtk so that only ExprtkFormula.cpp instantiates the
+// library. An expression is a shared handle: copies share one compiled tree,
+// and recompiling the original leaves earlier copies untouched.
+class ExprtkExpression {
+public:
+    bool valid() const { return (bool)tree; }
+    double value() const;
+    double derivative(double& variable) const;
+
+private:
+    friend class ExprtkContext;
+    struct Tree;
+    std::shared_ptr<Tree> tree;
+};
+
+// Symbol table of one evaluator. Parsing goes through a single parser shared
+// by every context, so creating evaluators and worker clones stays cheap.
+class ExprtkContext {
+public:
+    explicit ExprtkContext(bool controlStructures = true);
+    ~ExprtkContext();
+
+    bool addVariable(const std::string& name, double& value);
+    bool compile(const std::string& text, ExprtkExpression& out);
+
+    ExprtkContext(const ExprtkContext&) = delete;
+    ExprtkContext& operator=(const ExprtkContext&) = delete;
+
+private:
+    struct Symbols;
+    std::unique_ptr<Symbols> symbols;
+    bool controlStructures;
+};
@@ -0,0 +1,1040 @@
+#include "FormulaProgram.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FORMULA_SIMD_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FORMULA_SIMD_SSE2 1
+#endif
+
+namespace {
+
+struct FunctionInfo {
+    const char* name;
+    FormulaOp op;
+    int arity;
+};
+
+const FunctionInfo kFunctions[] = {
+    { "sin",   FormulaOp::Sin,   1 },
+    { "cos",   FormulaOp::Cos,   1 },
+    { "tan",   FormulaOp::Tan,   1 },
+    { "asin",  FormulaOp::Asin,  1 },
+    { "acos",  FormulaOp::Acos,  1 },
+    { "atan",  FormulaOp::Atan,  1 },
+    { "sinh",  FormulaOp::Sinh,  1 },
+    { "cosh",  FormulaOp::Cosh,  1 },
+    { "tanh",  FormulaOp::Tanh,  1 },
+    { "exp",   FormulaOp::Exp,   1 },
+    { "log",   FormulaOp::Log,   1 },
+    { "log10", FormulaOp::Log10, 1 },
+    { "log2",  FormulaOp::Log2,  1 },
+    { "sqrt",  FormulaOp::Sqrt,  1 },
+    { "abs",   FormulaOp::Abs,   1 },
+    { "floor", FormulaOp::Floor, 1 },
+    { "ceil",  FormulaOp::Ceil,  1 },
+    { "round", FormulaOp::Round, 1 },
+    { "trunc", FormulaOp::Trunc, 1 },
+    { "sgn",   FormulaOp::Sgn,   1 },
+    { "pow",   FormulaOp::Pow,   2 },
+    { "atan2", FormulaOp::Atan2, 2 },
+    { "hypot", FormulaOp::Hypot, 2 },
+    { "min",   FormulaOp::Min,  -1 },
+    { "max",   FormulaOp::Max,  -1 }
+};
+
+bool IsLeaf(FormulaOp op) {
+    return op == FormulaOp::Const || op == FormulaOp::Input || op == FormulaOp::Var;
+}
+
+bool IsBinary(FormulaOp op) {
+    switch (op) {
+    case FormulaOp::Add: case FormulaOp::Sub: case FormulaOp::Mul: case FormulaOp::Div:
+    case FormulaOp::Mod: case FormulaOp::Pow: case FormulaOp::Min: case FormulaOp::Max:
+    case FormulaOp::Atan2: case FormulaOp::Hypot:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::string ToLower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    return s;
+}
+
+struct NodeKey {
+    FormulaOp op;
+    uint32_t a, b;
+    uint64_t bits;
+    bool operator==(const NodeKey& o) const { return op == o.op && a == o.a && b == o.b && bits == o.bits; }
+};
+
+struct NodeKeyHash {
+    size_t operator()(const NodeKey& k) const {
+        uint64_t h = (uint64_t)k.op * 0x9E3779B97F4A7C15ull;
+        h ^= ((uint64_t)k.a + 0x632BE59BD9B4E019ull + (h << 6) + (h >> 2));
+        h ^= ((uint64_t)k.b + 0x8CB92BA72F3D8DD7ull + (h << 6) + (h >> 2));
+        h ^= (k.bits + 0x52DCE729DA3ED945ull + (h << 6) + (h >> 2));
+        return (size_t)h;
+    }
+};
+
+class FormulaParser {
+public:
+    FormulaParser(const std::string& text,
+                  const std::vector<std::string>& inputNames,
+                  const std::vector<std::pair<std::string, double*>>& variables,
+                  std::vector<FormulaNode>& nodes)
+        : src(text), inputs(inputNames), vars(variables), nodes(nodes) {}
+
+    bool parse(uint32_t& root, std::string& error) {
+        next();
+        bool ok = parseExpr(root) && tokType == TokEnd && errorText.empty();
+        if (!ok && errorText.empty()) errorText = "unexpected token at " + std::to_string(tokStart);
+        error = errorText;
+        return ok;
+    }
+
+private:
+    enum TokenType { TokEnd, TokNumber, TokIdent, TokOp, TokOpen, TokClose, TokComma, TokError };
+
+    void next() {
+        while (pos < src.size() && std::isspace((unsigned char)src[pos])) ++pos;
+        tokStart = pos;
+        if (pos >= src.size()) { tokType = TokEnd; return; }
+        char c = src[pos];
+        if (std::isdigit((unsigned char)c) || (c == '.' && pos + 1 < src.size() && std::isdigit((unsigned char)src[pos + 1]))) {
+            size_t end = pos;
+            while (end < src.size() && std::isdigit((unsigned char)src[end])) ++end;
+            if (end < src.size() && src[end] == '.') {
+                ++end;
+                while (end < src.size() && std::isdigit((unsigned char)src[end])) ++end;
+            }
+            if (end < src.size() && (src[end] == 'e' || src[end] == 'E')) {
+                size_t expEnd = end + 1;
+                if (expEnd < src.size() && (src[expEnd] == '+' || src[expEnd] == '-')) ++expEnd;
+                if (expEnd < src.size() && std::isdigit((unsigned char)src[expEnd])) {
+                    while (expEnd < src.size() && std::isdigit((unsigned char)src[expEnd])) ++expEnd;
+                    end = expEnd;
+                }
+            }
+            if (end < src.size() && src[end] == '.') { tokType = TokError; return; }
+            tokNumber = std::strtod(src.substr(pos, end - pos).c_str(), nullptr);
+            tokType = TokNumber;
+            pos = end;
+        } else if (std::isalpha((unsigned char)c) || c == '_') {
+            size_t end = pos;
+            while (end < src.size() && (std::isalnum((unsigned char)src[end]) || src[end] == '_')) ++end;
+            tokText = ToLower(src.substr(pos, end - pos));
+            tokType = TokIdent;
+            pos = end;
+        } else if (c == '+' || c == '-' || c == '*' || c == '/' || c == '%' || c == '^') {
+            tokChar = c;
+            tokType = TokOp;
+            ++pos;
+        } else if (c == '(' || c == '[' || c == '{') {
+            tokChar = c;
+            tokType = TokOpen;
+            ++pos;
+        } else if (c == ')' || c == ']' || c == '}') {
+            tokChar = c;
+            tokType = TokClose;
+            ++pos;
+        } else if (c == ',') {
+            tokType = TokComma;
+            ++pos;
+        } else {
+            tokType = TokError;
+        }
+    }
+
+    bool isOp(char c) const { return tokType == TokOp && tokChar == c; }
+
+    bool startsOperand() const {
+        return tokType == TokNumber || tokType == TokIdent || tokType == TokOpen;
+    }
+
+    uint32_t emit(FormulaOp op, uint32_t a = 0, uint32_t b = 0, double value = 0.0) {
+        if (op == FormulaOp::Pow && nodes[b].op == FormulaOp::Const) {
+            double n = nodes[b].value;
+            if (n == std::floor(n) && std::fabs(n) <= 16.0) {
+                op = FormulaOp::PowInt;
+                value = n;
+                b = 0;
+            }
+        }
+        if ((op == FormulaOp::Mul || op == FormulaOp::Div || op == FormulaOp::Mod) &&
+            ((nodes[a].op == FormulaOp::Const && nodes[a].value == 0.0) ||
+             (nodes[b].op == FormulaOp::Const && nodes[b].value == 0.0))) {
+            fail("constant zero operand");
+        }
+        if (!IsLeaf(op)) {
+            bool foldable = nodes[a].op == FormulaOp::Const &&
+                            (!IsBinary(op) || nodes[b].op == FormulaOp::Const);
+            if (foldable) {
+                double folded = ApplyFormulaOp(op, nodes[a].value, IsBinary(op) ? nodes[b].value : 0.0, value);
+                return emit(FormulaOp::Const, 0, 0, folded);
+            }
+        }
+        if (!IsBinary(op)) b = 0;
+        if (op == FormulaOp::Const) a = 0;
+        NodeKey key;
+        key.op = op;
+        key.a = a;
+        key.b = b;
+        std::memcpy(&key.bits, &value, sizeof(value));
+        auto it = cse.find(key);
+        if (it != cse.end()) return it->second;
+        FormulaNode node;
+        node.op = op;
+        node.a = a;
+        node.b = b;
+        node.value = value;
+        nodes.push_back(node);
+        uint32_t id = (uint32_t)nodes.size() - 1;
+        cse.emplace(key, id);
+        return id;
+    }
+
+    bool fail(const std::string& message) {
+        if (errorText.empty()) errorText = message;
+        return false;
+    }
+
+    bool parseExpr(uint32_t& out) {
+        if (!parseTerm(out)) return false;
+        while (isOp('+') || isOp('-')) {
+            FormulaOp op = tokChar == '+' ? FormulaOp::Add : FormulaOp::Sub;
+            next();
+            uint32_t rhs;
+            if (!parseTerm(rhs)) return false;
+            out = emit(op, out, rhs);
+        }
+        return true;
+    }
+
+    bool parseTerm(uint32_t& out) {
+        if (!parseUnary(out)) return false;
+        for (;;) {
+            uint32_t rhs;
+            if (isOp('*') || isOp('/') || isOp('%')) {
+                FormulaOp op = tokChar == '*' ? FormulaOp::Mul : (tokChar == '/' ? FormulaOp::Div : FormulaOp::Mod);
+                next();
+                if (!parseUnary(rhs)) return false;
+                out = emit(op, out, rhs);
+            } else if (startsOperand()) {
+                if (!parsePower(rhs)) return false;
+                out = emit(FormulaOp::Mul, out, rhs);
+            } else {
+                return true;
+            }
+        }
+    }
+
+    bool parseUnary(uint32_t& out) {
+        if (isOp('-')) {
+            next();
+            if (!parseUnary(out)) return false;
+            out = emit(FormulaOp::Neg, out);
+            return true;
+        }
+        if (isOp('+')) {
+            next();
+            return parseUnary(out);
+        }
+        return parsePower(out);
+    }
+
+    bool parsePower(uint32_t& out) {
+        if (!parsePrimary(out)) return false;
+        if (isOp('^')) {
+            next();
+            uint32_t exponent;
+            if (!parsePowerOperand(exponent)) return false;
+            out = emit(FormulaOp::Pow, out, exponent);
+        }
+        return true;
+    }
+
+    bool parsePowerOperand(uint32_t& out) {
+        if (isOp('-')) {
+            next();
+            if (!parsePowerOperand(out)) return false;
+            out = emit(FormulaOp::Neg, out);
+            return true;
+        }
+        if (isOp('+')) {
+            next();
+            return parsePowerOperand(out);
+        }
+        return parsePower(out);
+    }
+
+    static char ClosingFor(char open) {
+        return open == '(' ? ')' : (open == '[' ? ']' : '}');
+    }
+
+    bool parsePrimary(uint32_t& out) {
+        if (tokType == TokNumber) {
+            out = emit(FormulaOp::Const, 0, 0, tokNumber);
+            next();
+            return true;
+        }
+        if (tokType == TokOpen) {
+            char close = ClosingFor(tokChar);
+            next();
+            if (!parseExpr(out)) return false;
+            if (tokType != TokClose || tokChar != close) return fail("unbalanced brackets");
+            next();
+            return true;
+        }
+        if (tokType != TokIdent) return fail("expected operand at " + std::to_string(tokStart));
+
+        std::string name = tokText;
+        next();
+        for (const FunctionInfo& fn : kFunctions) {
+            if (name != fn.name) continue;
+            if (tokType != TokOpen || tokChar != '(') return fail("expected '(' after " + name);
+            next();
+            std::vector<uint32_t> args;
+            for (;;) {
+                uint32_t arg;
+                if (!parseExpr(arg)) return false;
+                args.push_back(arg);
+                if (tokType == TokComma) { next(); continue; }
+                break;
+            }
+            if (tokType != TokClose || tokChar != ')') return fail("expected ')' after arguments of " + name);
+            next();
+            if (fn.arity > 0 && (int)args.size() != fn.arity) return fail("wrong argument count for " + name);
+            out = args[0];
+            if (fn.arity == 1) {
+                out = emit(fn.op, args[0]);
+            } else {
+                for (size_t i = 1; i < args.size(); ++i) out = emit(fn.op, out, args[i]);
+            }
+            return true;
+        }
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (name == inputs[i]) {
+                out = emit(FormulaOp::Input, (uint32_t)i);
+                return true;
+            }
+        }
+        for (size_t i = 0; i < vars.size(); ++i) {
+            if (name == ToLower(vars[i].first)) {
+                out = emit(FormulaOp::Var, (uint32_t)i);
+                return true;
+            }
+        }
+        if (name == "pi") {
+            out = emit(FormulaOp::Const, 0, 0, 3.14159265358979323846);
+            return true;
+        }
+        if (name == "inf") {
+            out = emit(FormulaOp::Const, 0, 0, std::numeric_limits<double>::infinity());
+            return true;
+        }
+        return fail("unsupported symbol '" + name + "'");
+    }
+
+    const std::string& src;
+    const std::vector<std::string>& inputs;
+    const std::vector<std::pair<std::string, double*>>& vars;
+    std::vector<FormulaNode>& nodes;
+    std::unordered_map<NodeKey, uint32_t, NodeKeyHash> cse;
+    size_t pos = 0;
+    size_t tokStart = 0;
+    TokenType tokType = TokEnd;
+    double tokNumber = 0.0;
+    std::string tokText;
+    char tokChar = 0;
+    std::string errorText;
+};
+
+double PowInt(double x, int n) {
+    bool invert = n < 0;
+    unsigned e = (unsigned)(invert ? -n : n);
+    double result = 1.0;
+    while (e) {
+        if (e & 1u) result *= x;
+        x *= x;
+        e >>= 1;
+    }
+    return invert ? 1.0 / result : result;
+}
+
+const size_t kLanes = FormulaProgram::kLanes;
+
+inline void LaneFill(double* d, double v) {
+    for (size_t l = 0; l < kLanes; ++l) d[l] = v;
+}
+
+template <typename F>
+inline void LaneMap(double* d, const double* a, F f) {
+    for (size_t l = 0; l < kLanes; ++l) d[l] = f(a[l]);
+}
+
+template <typename F>
+inline void LaneZip(double* d, const double* a, const double* b, F f) {
+    for (size_t l = 0; l < kLanes; ++l) d[l] = f(a[l], b[l]);
+}
+
+#if defined(FORMULA_SIMD_AVX)
+#define FORMULA_LANE_BINARY(name, intrinsic, expr)                               \
+    inline void name(double* d, const double* a, const double* b) {             \
+        for (size_t l = 0; l < kLanes; l += 4)                                  \
+            _mm256_storeu_pd(d + l, intrinsic(_mm256_loadu_pd(a + l), _mm256_loadu_pd(b + l))); \
+    }
+#elif defined(FORMULA_SIMD_SSE2)
+#define FORMULA_LANE_BINARY(name, intrinsic, expr)                               \
+    inline void name(double* d, const double* a, const double* b) {             \
+        for (size_t l = 0; l < kLanes; l += 2)                                  \
+            _mm_storeu_pd(d + l, intrinsic(_mm_loadu_pd(a + l), _mm_loadu_pd(b + l))); \
+    }
+#else
+#define FORMULA_LANE_BINARY(name, intrinsic, expr)                               \
+    inline void name(double* d, const double* a, const double* b) {             \
+        for (size_t l = 0; l < kLanes; ++l) { double x = a[l], y = b[l]; d[l] = (expr); } \
+    }
+#endif
+
+#if defined(FORMULA_SIMD_AVX)
+#define FORMULA_ADD _mm256_add_pd
+#define FORMULA_SUB _mm256_sub_pd
+#define FORMULA_MUL _mm256_mul_pd
+#define FORMULA_DIV _mm256_div_pd
+#define FORMULA_MIN(x, y) _mm256_min_pd(y, x)
+#define FORMULA_MAX(x, y) _mm256_max_pd(y, x)
+#elif defined(FORMULA_SIMD_SSE2)
+#define FORMULA_ADD _mm_add_pd
+#define FORMULA_SUB _mm_sub_pd
+#define FORMULA_MUL _mm_mul_pd
+#define FORMULA_DIV _mm_div_pd
+#define FORMULA_MIN(x, y) _mm_min_pd(y, x)
+#define FORMULA_MAX(x, y) _mm_max_pd(y, x)
+#else
+#define FORMULA_ADD
+#define FORMULA_SUB
+#define FORMULA_MUL
+#define FORMULA_DIV
+#define FORMULA_MIN
+#define FORMULA_MAX
+#endif
+
+FORMULA_LANE_BINARY(LaneAdd, FORMULA_ADD, x + y)
+FORMULA_LANE_BINARY(LaneSub, FORMULA_SUB, x - y)
+FORMULA_LANE_BINARY(LaneMul, FORMULA_MUL, x * y)
+FORMULA_LANE_BINARY(LaneDiv, FORMULA_DIV, x / y)
+FORMULA_LANE_BINARY(LaneMin, FORMULA_MIN, (y < x) ? y : x)
+FORMULA_LANE_BINARY(LaneMax, FORMULA_MAX, (x < y) ? y : x)
+
+inline void LaneSqrt(double* d, const double* a) {
+#if defined(FORMULA_SIMD_AVX)
+    for (size_t l = 0; l < kLanes; l += 4) _mm256_storeu_pd(d + l, _mm256_sqrt_pd(_mm256_loadu_pd(a + l)));
+#elif defined(FORMULA_SIMD_SSE2)
+    for (size_t l = 0; l < kLanes; l += 2) _mm_storeu_pd(d + l, _mm_sqrt_pd(_mm_loadu_pd(a + l)));
+#else
+    LaneMap(d, a, [](double v) { return std::sqrt(v); });
+#endif
+}
+
+inline void LaneNeg(double* d, const double* a) {
+#if defined(FORMULA_SIMD_AVX)
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    for (size_t l = 0; l < kLanes; l += 4) _mm256_storeu_pd(d + l, _mm256_xor_pd(_mm256_loadu_pd(a + l), sign));
+#elif defined(FORMULA_SIMD_SSE2)
+    const __m128d sign = _mm_set1_pd(-0.0);
+    for (size_t l = 0; l < kLanes; l += 2) _mm_storeu_pd(d + l, _mm_xor_pd(_mm_loadu_pd(a + l), sign));
+#else
+    LaneMap(d, a, [](double v) { return -v; });
+#endif
+}
+
+inline void LaneAbs(double* d, const double* a) {
+#if defined(FORMULA_SIMD_AVX)
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    for (size_t l = 0; l < kLanes; l += 4) _mm256_storeu_pd(d + l, _mm256_andnot_pd(sign, _mm256_loadu_pd(a + l)));
+#elif defined(FORMULA_SIMD_SSE2)
+    const __m128d sign = _mm_set1_pd(-0.0);
+    for (size_t l = 0; l < kLanes; l += 2) _mm_storeu_pd(d + l, _mm_andnot_pd(sign, _mm_loadu_pd(a + l)));
+#else
+    LaneMap(d, a, [](double v) { return std::fabs(v); });
+#endif
+}
+
+inline void LanePowInt(double* d, const double* a, int n) {
+    if (n == 2) {
+        LaneMul(d, a, a);
+        return;
+    }
+    if (n == 3) {
+        double square[kLanes];
+        LaneMul(square, a, a);
+        LaneMul(d, square, a);
+        return;
+    }
+    double base[kLanes];
+    double result[kLanes];
+    std::memcpy(base, a, sizeof(base));
+    LaneFill(result, 1.0);
+    unsigned e = (unsigned)(n < 0 ? -n : n);
+    while (e) {
+        if (e & 1u) LaneMul(result, result, base);
+        e >>= 1;
+        if (e) LaneMul(base, base, base);
+    }
+    if (n < 0) {
+        double one[kLanes];
+        LaneFill(one, 1.0);
+        LaneDiv(d, one, result);
+    } else {
+        std::memcpy(d, result, sizeof(result));
+    }
+}
+
+}
+
+double ApplyFormulaOp(FormulaOp op, double a, double b, double value) {
+    switch (op) {
+    case FormulaOp::Const: return value;
+    case FormulaOp::Neg:   return -a;
+    case FormulaOp::Add:   return a + b;
+    case FormulaOp::Sub:   return a - b;
+    case FormulaOp::Mul:   return a * b;
+    case FormulaOp::Div:   return a / b;
+    case FormulaOp::Mod:   return std::fmod(a, b);
+    case FormulaOp::Pow:   return std::pow(a, b);
+    case FormulaOp::PowInt: return PowInt(a, (int)value);
+    case FormulaOp::Min:   return (b < a) ? b : a;
+    case FormulaOp::Max:   return (a < b) ? b : a;
+    case FormulaOp::Atan2: return std::atan2(a, b);
+    case FormulaOp::Hypot: return std::hypot(a, b);
+    case FormulaOp::Sin:   return std::sin(a);
+    case FormulaOp::Cos:   return std::cos(a);
+    case FormulaOp::Tan:   return std::tan(a);
+    case FormulaOp::Asin:  return std::asin(a);
+    case FormulaOp::Acos:  return std::acos(a);
+    case FormulaOp::Atan:  return std::atan(a);
+    case FormulaOp::Sinh:  return std::sinh(a);
+    case FormulaOp::Cosh:  return std::cosh(a);
+    case FormulaOp::Tanh:  return std::tanh(a);
+    case FormulaOp::Exp:   return std::exp(a);
+    case FormulaOp::Log:   return std::log(a);
+    case FormulaOp::Log10: return std::log10(a);
+    case FormulaOp::Log2:  return std::log2(a);
+    case FormulaOp::Sqrt:  return std::sqrt(a);
+    case FormulaOp::Abs:   return std::fabs(a);
+    case FormulaOp::Floor: return std::floor(a);
+    case FormulaOp::Ceil:  return std::ceil(a);
+    case FormulaOp::Round: return std::round(a);
+    case FormulaOp::Trunc: return std::trunc(a);
+    case FormulaOp::Sgn:   return (a > 0.0) ? 1.0 : ((a < 0.0) ? -1.0 : 0.0);
+    default:               return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+void FormulaProgram::clear() {
+    nodes.clear();
+    vars.clear();
+    code = FormulaCode();
+    for (GridStagePlan& stage : gridStages) stage = GridStagePlan();
+    gridPlanned = false;
+    root = 0;
+    numInputs = 0;
+}
+
+bool FormulaProgram::compile(const std::string& text,
+                             const std::vector<std::string>& inputNames,
+                             const std::vector<std::pair<std::string, double*>>& variables) {
+    clear();
+    errorText.clear();
+    std::vector<FormulaNode> parsed;
+    uint32_t parsedRoot = 0;
+    FormulaParser parser(text, inputNames, variables, parsed);
+    if (!parser.parse(parsedRoot, errorText)) return false;
+
+    std::vector<uint32_t> remap(parsed.size(), UINT32_MAX);
+    std::vector<bool> live(parsed.size(), false);
+    live[parsedRoot] = true;
+    for (size_t i = parsed.size(); i-- > 0;) {
+        if (!live[i] || IsLeaf(parsed[i].op)) continue;
+        live[parsed[i].a] = true;
+        if (IsBinary(parsed[i].op)) live[parsed[i].b] = true;
+    }
+    for (size_t i = 0; i < parsed.size(); ++i) {
+        if (!live[i]) continue;
+        FormulaNode node = parsed[i];
+        if (!IsLeaf(node.op)) {
+            node.a = remap[node.a];
+            if (IsBinary(node.op)) node.b = remap[node.b];
+        }
+        remap[i] = (uint32_t)nodes.size();
+        nodes.push_back(node);
+    }
+    root = remap[parsedRoot];
+    numInputs = inputNames.size();
+    for (const auto& v : variables) vars.push_back(v.second);
+    lower(nodes, std::vector<uint32_t>(1, root), code);
+    if (code.numRegisters > 0xFFFF) {
+        errorText = "formula too large";
+        clear();
+        return false;
+    }
+    planGrid();
+    return true;
+}
+
+void FormulaProgram::lower(const std::vector<FormulaNode>& graph, const std::vector<uint32_t>& outputs, FormulaCode& out) {
+    out = FormulaCode();
+    std::vector<uint32_t> lastUse(graph.size(), 0);
+    for (uint32_t i = 0; i < graph.size(); ++i) {
+        const FormulaNode& n = graph[i];
+        if (IsLeaf(n.op)) continue;
+        lastUse[n.a] = i;
+        if (IsBinary(n.op)) lastUse[n.b] = i;
+    }
+    for (uint32_t o : outputs) lastUse[o] = UINT32_MAX;
+
+    std::vector<uint32_t> regOf(graph.size(), 0);
+    std::vector<uint32_t> freeRegs;
+    size_t numRegisters = 0;
+    for (uint32_t i = 0; i < graph.size(); ++i) {
+        const FormulaNode& n = graph[i];
+        if (!IsLeaf(n.op)) {
+            if (lastUse[n.a] == i) freeRegs.push_back(regOf[n.a]);
+            if (IsBinary(n.op) && n.b != n.a && lastUse[n.b] == i) freeRegs.push_back(regOf[n.b]);
+        }
+        uint32_t reg;
+        if (!freeRegs.empty()) {
+            reg = freeRegs.back();
+            freeRegs.pop_back();
+        } else {
+            reg = (uint32_t)numRegisters++;
+        }
+        regOf[i] = reg;
+
+        FormulaInstr instr;
+        instr.op = n.op;
+        instr.dst = (uint16_t)reg;
+        instr.a = (uint16_t)(IsLeaf(n.op) ? n.a : regOf[n.a]);
+        instr.b = (uint16_t)(IsBinary(n.op) ? regOf[n.b] : 0);
+        instr.value = n.value;
+        out.instrs.push_back(instr);
+    }
+    out.numRegisters = numRegisters;
+    for (uint32_t o : outputs) out.outputs.push_back((uint16_t)regOf[o]);
+}
+
+void FormulaProgram::planGrid() {
+    if (numInputs < 2) return;
+
+    std::vector<uint8_t> stageOf(nodes.size(), StageInvariant);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const FormulaNode& n = nodes[i];
+        uint8_t mask = 0;
+        if (n.op == FormulaOp::Input) {
+            mask = (n.a == 0) ? 1 : ((n.a == 1) ? 2 : 0);
+        } else if (!IsLeaf(n.op)) {
+            mask = stageOf[n.a];
+            if (IsBinary(n.op)) mask |= stageOf[n.b];
+        }
+        stageOf[i] = mask;
+    }
+
+    std::vector<bool> exported(nodes.size(), false);
+    exported[root] = true;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const FormulaNode& n = nodes[i];
+        if (IsLeaf(n.op)) continue;
+        if (stageOf[n.a] != stageOf[i]) exported[n.a] = true;
+        if (IsBinary(n.op) && stageOf[n.b] != stageOf[i]) exported[n.b] = true;
+    }
+
+    std::vector<uint32_t> exportIndex(nodes.size(), 0);
+    for (uint8_t s = StageInvariant; s < StageCount; ++s) {
+        GridStagePlan& plan = gridStages[s];
+        std::vector<FormulaNode> graph;
+        std::vector<uint32_t> outputs;
+        std::vector<uint32_t> local(nodes.size(), UINT32_MAX);
+        auto operand = [&](uint32_t src) -> uint32_t {
+            if (local[src] != UINT32_MAX) return local[src];
+            GridSlot slot = { stageOf[src], exportIndex[src] };
+            FormulaNode leaf = { FormulaOp::Input, (uint32_t)plan.slots.size(), 0, 0.0 };
+            plan.slots.push_back(slot);
+            local[src] = (uint32_t)graph.size();
+            graph.push_back(leaf);
+            return local[src];
+        };
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (stageOf[i] != s) continue;
+            FormulaNode n = nodes[i];
+            if (n.op == FormulaOp::Input) {
+                GridSlot slot = { StageInput, n.a };
+                n.a = (uint32_t)plan.slots.size();
+                plan.slots.push_back(slot);
+            } else if (!IsLeaf(n.op)) {
+                n.a = operand(n.a);
+                if (IsBinary(n.op)) n.b = operand(n.b);
+            }
+            local[i] = (uint32_t)graph.size();
+            graph.push_back(n);
+            if (exported[i]) {
+                exportIndex[i] = (uint32_t)outputs.size();
+                outputs.push_back(local[i]);
+            }
+        }
+        if (!graph.empty()) lower(graph, outputs, plan.code);
+        if (plan.code.numRegisters > 0xFFFF) return;
+    }
+    gridResult.stage = stageOf[root];
+    gridResult.index = exportIndex[root];
+    gridPlanned = true;
+}
+
+double FormulaProgram::eval(const double* inputs) const {
+    scalars.resize(code.numRegisters);
+    double* r = scalars.data();
+    for (const FormulaInstr& in : code.instrs) {
+        switch (in.op) {
+        case FormulaOp::Input: r[in.dst] = inputs[in.a]; break;
+        case FormulaOp::Var:   r[in.dst] = *vars[in.a]; break;
+        default:               r[in.dst] = ApplyFormulaOp(in.op, r[in.a], r[in.b], in.value); break;
+        }
+    }
+    return r[code.outputs[0]];
+}
+
+void FormulaProgram::evalPoints(const FormulaInput* inputs, double* out, size_t count) const {
+    run(code, inputs, &out, count);
+}
+
+void FormulaProgram::evalGrid(const double* xs, size_t nx, const double* ys, size_t ny, const double* fixed, double* out) const {
+    if (nx == 0 || ny == 0) return;
+    if (!gridPlanned) {
+        std::vector<FormulaInput> in(numInputs);
+        for (size_t k = 0; k < numInputs; ++k) in[k] = { fixed + k, 0 };
+        in[0] = { xs, 1 };
+        for (size_t j = 0; j < ny; ++j) {
+            in[1] = { ys + j, 0 };
+            evalPoints(in.data(), out + j * nx, nx);
+        }
+        return;
+    }
+
+    const size_t stageCount[StageInner] = { 1, nx, ny };
+    for (uint8_t s = StageInvariant; s < StageCount; ++s) {
+        const GridStagePlan& plan = gridStages[s];
+        if (plan.code.instrs.empty()) continue;
+        gridInputs.resize(plan.slots.size());
+        for (size_t k = 0; k < plan.slots.size(); ++k) {
+            const GridSlot& slot = plan.slots[k];
+            if (slot.stage == StageInput) {
+                if (slot.index == 0) gridInputs[k] = { xs, 1 };
+                else if (slot.index == 1) gridInputs[k] = { ys, 1 };
+                else gridInputs[k] = { fixed + slot.index, 0 };
+            } else if (slot.stage == StageInvariant) {
+                gridInputs[k] = { gridValues[StageInvariant].data() + slot.index, 0 };
+            } else {
+                gridInputs[k] = { gridValues[slot.stage].data() + slot.index * stageCount[slot.stage], 1 };
+            }
+        }
+        if (s != StageInner) {
+            size_t count = stageCount[s];
+            gridValues[s].resize(plan.code.outputs.size() * count);
+            gridOutputs.resize(plan.code.outputs.size());
+            for (size_t k = 0; k < gridOutputs.size(); ++k) gridOutputs[k] = gridValues[s].data() + k * count;
+            run(plan.code, gridInputs.data(), gridOutputs.data(), count);
+            continue;
+        }
+        for (size_t j = 0; j < ny; ++j) {
+            for (size_t k = 0; k < plan.slots.size(); ++k) {
+                const GridSlot& slot = plan.slots[k];
+                if (slot.stage == StageRow) gridInputs[k] = { gridValues[StageRow].data() + slot.index * ny + j, 0 };
+            }
+            double* row = out + j * nx;
+            run(plan.code, gridInputs.data(), &row, nx);
+        }
+        return;
+    }
+
+    const double* values = gridValues[gridResult.stage].data() + gridResult.index * stageCount[gridResult.stage];
+    for (size_t j = 0; j < ny; ++j) {
+        double* row = out + j * nx;
+        if (gridResult.stage == StageColumn) std::memcpy(row, values, nx * sizeof(double));
+        else std::fill(row, row + nx, values[gridResult.stage == StageRow ? j : 0]);
+    }
+}
+
+bool FormulaProgram::planGridCache(FormulaGridCache& cache, const std::vector<char>& dirtyVars, size_t nx, size_t ny) const {
+    const size_t kMaxFrontier = 8;
+    cache.filled = false;
+    cache.dirtyVars = dirtyVars;
+    if (!valid() || numInputs < 2) return false;
+
+    std::vector<bool> dirty(nodes.size(), false);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const FormulaNode& n = nodes[i];
+        if (n.op == FormulaOp::Var) dirty[i] = n.a < dirtyVars.size() && dirtyVars[n.a];
+        else if (!IsLeaf(n.op)) dirty[i] = dirty[n.a] || (IsBinary(n.op) && dirty[n.b]);
+    }
+    if (!dirty[root]) return false;
+
+    std::vector<uint32_t> frontier;
+    std::vector<uint32_t> frontierIndex(nodes.size(), UINT32_MAX);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const FormulaNode& n = nodes[i];
+        if (!dirty[i] || IsLeaf(n.op)) continue;
+        uint32_t operands[2] = { n.a, n.b };
+        for (int k = 0; k < (IsBinary(n.op) ? 2 : 1); ++k) {
+            uint32_t src = operands[k];
+            if (dirty[src] || IsLeaf(nodes[src].op) || frontierIndex[src] != UINT32_MAX) continue;
+            frontierIndex[src] = (uint32_t)frontier.size();
+            frontier.push_back(src);
+        }
+    }
+    if (frontier.size() > kMaxFrontier) return false;
+
+    std::vector<uint32_t> fillOutputs(1, root);
+    fillOutputs.insert(fillOutputs.end(), frontier.begin(), frontier.end());
+    lower(nodes, fillOutputs, cache.fill);
+
+    std::vector<FormulaNode> graph;
+    std::vector<uint32_t> local(nodes.size(), UINT32_MAX);
+    cache.updateSlots.clear();
+    auto operand = [&](uint32_t src) -> uint32_t {
+        if (local[src] != UINT32_MAX) return local[src];
+        FormulaNode leaf = nodes[src];
+        if (leaf.op == FormulaOp::Input || frontierIndex[src] != UINT32_MAX) {
+            uint32_t slot = leaf.op == FormulaOp::Input ? leaf.a : (uint32_t)numInputs + frontierIndex[src];
+            leaf = { FormulaOp::Input, (uint32_t)cache.updateSlots.size(), 0, 0.0 };
+            cache.updateSlots.push_back(slot);
+        }
+        local[src] = (uint32_t)graph.size();
+        graph.push_back(leaf);
+        return local[src];
+    };
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (!dirty[i]) continue;
+        FormulaNode n = nodes[i];
+        if (!IsLeaf(n.op)) {
+            n.a = operand(n.a);
+            if (IsBinary(n.op)) n.b = operand(n.b);
+        }
+        local[i] = (uint32_t)graph.size();
+        graph.push_back(n);
+    }
+    lower(graph, std::vector<uint32_t>(1, local[root]), cache.update);
+
+    cache.frontierCount = frontier.size();
+    cache.nx = nx;
+    cache.ny = ny;
+    cache.values.resize(frontier.size() * nx * ny);
+    return true;
+}
+
+void FormulaProgram::evalGridRows(FormulaGridCache& cache, bool fill, const double* xs, const double* ys,
+                                  size_t rowBegin, size_t rowEnd, const double* fixed, double* out) const {
+    size_t nx = cache.nx;
+    size_t ny = cache.ny;
+    const FormulaCode& c = fill ? cache.fill : cache.update;
+    size_t slotCount = fill ? numInputs : cache.updateSlots.size();
+    gridInputs.resize(slotCount);
+    gridOutputs.resize(c.outputs.size());
+    for (size_t j = rowBegin; j < rowEnd; ++j) {
+        for (size_t k = 0; k < slotCount; ++k) {
+            uint32_t slot = fill ? (uint32_t)k : cache.updateSlots[k];
+            if (slot == 0) gridInputs[k] = { xs, 1 };
+            else if (slot == 1) gridInputs[k] = { ys + j, 0 };
+            else if (slot < numInputs) gridInputs[k] = { fixed + slot, 0 };
+            else gridInputs[k] = { cache.values.data() + ((slot - numInputs) * ny + j) * nx, 1 };
+        }
+        gridOutputs[0] = out + (j - rowBegin) * nx;
+        for (size_t k = 1; k < gridOutputs.size(); ++k) {
+            gridOutputs[k] = cache.values.data() + ((k - 1) * ny + j) * nx;
+        }
+        run(c, gridInputs.data(), gridOutputs.data(), nx);
+    }
+}
+
+void FormulaProgram::run(const FormulaCode& c, const FormulaInput* inputs, double* const* outs, size_t count) const {
+    lanes.resize(std::max(lanes.size(), c.numRegisters * kLanes));
+    double* regs = lanes.data();
+    for (size_t base = 0; base < count; base += kLanes) {
+        size_t n = std::min(kLanes, count - base);
+        for (const FormulaInstr& in : c.instrs) {
+            double* d = regs + in.dst * kLanes;
+            switch (in.op) {
+            case FormulaOp::Const:
+                LaneFill(d, in.value);
+                break;
+            case FormulaOp::Input: {
+                const FormulaInput& src = inputs[in.a];
+                if (src.stride == 0) {
+                    LaneFill(d, src.data[0]);
+                } else {
+                    const double* p = src.data + base * src.stride;
+                    if (n == kLanes && src.stride == 1) {
+                        std::memcpy(d, p, kLanes * sizeof(double));
+                    } else {
+                        for (size_t l = 0; l < n; ++l) d[l] = p[l * src.stride];
+                        for (size_t l = n; l < kLanes; ++l) d[l] = d[n - 1];
+                    }
+                }
+                break;
+            }
+            case FormulaOp::Var:
+                LaneFill(d, *vars[in.a]);
+                break;
+            default: {
+                const double* a = regs + in.a * kLanes;
+                const double* b = regs + in.b * kLanes;
+                switch (in.op) {
+                case FormulaOp::Neg:   LaneNeg(d, a); break;
+                case FormulaOp::Add:   LaneAdd(d, a, b); break;
+                case FormulaOp::Sub:   LaneSub(d, a, b); break;
+                case FormulaOp::Mul:   LaneMul(d, a, b); break;
+                case FormulaOp::Div:   LaneDiv(d, a, b); break;
+                case FormulaOp::Min:   LaneMin(d, a, b); break;
+                case FormulaOp::Max:   LaneMax(d, a, b); break;
+                case FormulaOp::Sqrt:  LaneSqrt(d, a); break;
+                case FormulaOp::Abs:   LaneAbs(d, a); break;
+                case FormulaOp::PowInt: LanePowInt(d, a, (int)in.value); break;
+                case FormulaOp::Mod:   LaneZip(d, a, b, [](double x, double y) { return std::fmod(x, y); }); break;
+                case FormulaOp::Pow:   LaneZip(d, a, b, [](double x, double y) { return std::pow(x, y); }); break;
+                case FormulaOp::Atan2: LaneZip(d, a, b, [](double x, double y) { return std::atan2(x, y); }); break;
+                case FormulaOp::Hypot: LaneZip(d, a, b, [](double x, double y) { return std::hypot(x, y); }); break;
+                case FormulaOp::Sin:   LaneMap(d, a, [](double v) { return std::sin(v); }); break;
+                case FormulaOp::Cos:   LaneMap(d, a, [](double v) { return std::cos(v); }); break;
+                case FormulaOp::Tan:   LaneMap(d, a, [](double v) { return std::tan(v); }); break;
+                case FormulaOp::Asin:  LaneMap(d, a, [](double v) { return std::asin(v); }); break;
+                case FormulaOp::Acos:  LaneMap(d, a, [](double v) { return std::acos(v); }); break;
+                case FormulaOp::Atan:  LaneMap(d, a, [](double v) { return std::atan(v); }); break;
+                case FormulaOp::Sinh:  LaneMap(d, a, [](double v) { return std::sinh(v); }); break;
+                case FormulaOp::Cosh:  LaneMap(d, a, [](double v) { return std::cosh(v); }); break;
+                case FormulaOp::Tanh:  LaneMap(d, a, [](double v) { return std::tanh(v); }); break;
+                case FormulaOp::Exp:   LaneMap(d, a, [](double v) { return std::exp(v); }); break;
+                case FormulaOp::Log:   LaneMap(d, a, [](double v) { return std::log(v); }); break;
+                case FormulaOp::Log10: LaneMap(d, a, [](double v) { return std::log10(v); }); break;
+                case FormulaOp::Log2:  LaneMap(d, a, [](double v) { return std::log2(v); }); break;
+                case FormulaOp::Floor: LaneMap(d, a, [](double v) { return std::floor(v); }); break;
+                case FormulaOp::Ceil:  LaneMap(d, a, [](double v) { return std::ceil(v); }); break;
+                case FormulaOp::Round: LaneMap(d, a, [](double v) { return std::round(v); }); break;
+                case FormulaOp::Trunc: LaneMap(d, a, [](double v) { return std::trunc(v); }); break;
+                case FormulaOp::Sgn:   LaneMap(d, a, [](double v) { return (v > 0.0) ? 1.0 : ((v < 0.0) ? -1.0 : 0.0); }); break;
+                default:               LaneFill(d, std::numeric_limits<double>::quiet_NaN()); break;
+                }
+                break;
+            }
+            }
+        }
+        for (size_t k = 0; k < c.outputs.size(); ++k) {
+            std::memcpy(outs[k] + base, regs + (size_t)c.outputs[k] * kLanes, n * sizeof(double));
+        }
+    }
+}
+
+Interval FormulaProgram::evalInterval(const Interval* inputs) const {
+    intervals.resize(nodes.size());
+    Interval* r = intervals.data();
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const FormulaNode& n = nodes[i];
+        if (n.op == FormulaOp::Const) { r[i] = Interval(n.value); continue; }
+        if (n.op == FormulaOp::Input) { r[i] = inputs[n.a]; continue; }
+        if (n.op == FormulaOp::Var) { r[i] = Interval(*vars[n.a]); continue; }
+        const Interval& a = r[n.a];
+        const Interval& b = r[n.b];
+        switch (n.op) {
+        case FormulaOp::Neg:    r[i] = interval::Neg(a); break;
+        case FormulaOp::Add:    r[i] = interval::Add(a, b); break;
+        case FormulaOp::Sub:    r[i] = interval::Sub(a, b); break;
+        case FormulaOp::Mul:    r[i] = interval::Mul(a, b); break;
+        case FormulaOp::Div:    r[i] = interval::Div(a, b); break;
+        case FormulaOp::Mod:    r[i] = interval::Mod(a, b); break;
+        case FormulaOp::Pow:    r[i] = interval::Pow(a, b); break;
+        case FormulaOp::PowInt: r[i] = interval::PowInt(a, (int)n.value); break;
+        case FormulaOp::Min:    r[i] = interval::Min(a, b); break;
+        case FormulaOp::Max:    r[i] = interval::Max(a, b); break;
+        case FormulaOp::Atan2:  r[i] = interval::Atan2(a, b); break;
+        case FormulaOp::Hypot:  r[i] = interval::Hypot(a, b); break;
+        case FormulaOp::Sin:    r[i] = interval::Sin(a); break;
+        case FormulaOp::Cos:    r[i] = interval::Cos(a); break;
+        case FormulaOp::Tan:    r[i] = interval::Tan(a); break;
+        case FormulaOp::Asin:   r[i] = interval::Asin(a); break;
+        case FormulaOp::Acos:   r[i] = interval::Acos(a); break;
+        case FormulaOp::Cosh:   r[i] = interval::Cosh(a); break;
+        case FormulaOp::Sqrt:   r[i] = interval::Sqrt(a); break;
+        case FormulaOp::Abs:    r[i] = interval::Abs(a); break;
+        case FormulaOp::Log:    r[i] = interval::LogLike(a, [](double v) { return std::log(v); }); break;
+        case FormulaOp::Log10:  r[i] = interval::LogLike(a, [](double v) { return std::log10(v); }); break;
+        case FormulaOp::Log2:   r[i] = interval::LogLike(a, [](double v) { return std::log2(v); }); break;
+        case FormulaOp::Atan:   r[i] = interval::Monotone(a, [](double v) { return std::atan(v); }); break;
+        case FormulaOp::Sinh:   r[i] = interval::Monotone(a, [](double v) { return std::sinh(v); }); break;
+        case FormulaOp::Tanh:   r[i] = interval::Monotone(a, [](double v) { return std::tanh(v); }); break;
+        case FormulaOp::Exp:    r[i] = interval::Monotone(a, [](double v) { return std::exp(v); }); break;
+        case FormulaOp::Floor:  r[i] = interval::Monotone(a, [](double v) { return std::floor(v); }, 0); break;
+        case FormulaOp::Ceil:   r[i] = interval::Monotone(a, [](double v) { return std::ceil(v); }, 0); break;
+        case FormulaOp::Round:  r[i] = interval::Monotone(a, [](double v) { return std::round(v); }, 0); break;
+        case FormulaOp::Trunc:  r[i] = interval::Monotone(a, [](double v) { return std::trunc(v); }, 0); break;
+        case FormulaOp::Sgn:    r[i] = interval::Sgn(a); break;
+        default:                r[i] = Interval::Entire(); break;
+        }
+    }
+    return nodes.empty() ? Interval::Entire() : r[root];
+}
+
+double FormulaProgram::evalGradient(const double* inputs, double* gradient) const {
+    duals.resize(nodes.size());
+    Dual* r = duals.data();
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const FormulaNode& n = nodes[i];
+        if (n.op == FormulaOp::Const) { r[i] = Dual(n.value); continue; }
+        if (n.op == FormulaOp::Input) { r[i] = Dual::Variable(inputs[n.a], (int)n.a); continue; }
+        if (n.op == FormulaOp::Var) { r[i] = Dual(*vars[n.a]); continue; }
+        const Dual& a = r[n.a];
+        const Dual& b = r[n.b];
+        switch (n.op) {
+        case FormulaOp::Neg:    r[i] = dual::Neg(a); break;
+        case FormulaOp::Add:    r[i] = dual::Add(a, b); break;
+        case FormulaOp::Sub:    r[i] = dual::Sub(a, b); break;
+        case FormulaOp::Mul:    r[i] = dual::Mul(a, b); break;
+        case FormulaOp::Div:    r[i] = dual::Div(a, b); break;
+        case FormulaOp::Mod:    r[i] = dual::Mod(a, b); break;
+        case FormulaOp::Pow:    r[i] = dual::Pow(a, b); break;
+        case FormulaOp::PowInt: r[i] = dual::PowInt(a, (int)n.value, PowInt(a.v, (int)n.value)); break;
+        case FormulaOp::Min:    r[i] = dual::Min(a, b); break;
+        case FormulaOp::Max:    r[i] = dual::Max(a, b); break;
+        case FormulaOp::Atan2:  r[i] = dual::Atan2(a, b); break;
+        case FormulaOp::Hypot:  r[i] = dual::Hypot(a, b); break;
+        case FormulaOp::Sin:    r[i] = dual::Sin(a); break;
+        case FormulaOp::Cos:    r[i] = dual::Cos(a); break;
+        case FormulaOp::Tan:    r[i] = dual::Tan(a); break;
+        case FormulaOp::Asin:   r[i] = dual::Asin(a); break;
+        case FormulaOp::Acos:   r[i] = dual::Acos(a); break;
+        case FormulaOp::Atan:   r[i] = dual::Atan(a); break;
+        case FormulaOp::Sinh:   r[i] = dual::Sinh(a); break;
+        case FormulaOp::Cosh:   r[i] = dual::Cosh(a); break;
+        case FormulaOp::Tanh:   r[i] = dual::Tanh(a); break;
+        case FormulaOp::Exp:    r[i] = dual::Exp(a); break;
+        case FormulaOp::Log:    r[i] = dual::Log(a); break;
+        case FormulaOp::Log10:  r[i] = dual::Log10(a); break;
+        case FormulaOp::Log2:   r[i] = dual::Log2(a); break;
+        case FormulaOp::Sqrt:   r[i] = dual::Sqrt(a); break;
+        case FormulaOp::Abs:    r[i] = dual::Abs(a); break;
+        default:                r[i] = Dual(ApplyFormulaOp(n.op, a.v, b.v, n.value)); break;
+        }
+    }
+    Dual result = nodes.empty() ? Dual(0.0) : r[root];
+    for (size_t k = 0; k < numInputs && k < (size_t)Dual::kPartials; ++k) gradient[k] = result.d[k];
+    return result.v;
+}
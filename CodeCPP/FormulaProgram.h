@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Dual.h"
+#include "Interval.h"
+
+enum class FormulaOp : uint8_t {
+    Const,
+    Input,
+    Var,
+    Neg,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod,
+    Pow,
+    PowInt,
+    Min,
+    Max,
+    Atan2,
+    Hypot,
+    Sin,
+    Cos,
+    Tan,
+    Asin,
+    Acos,
+    Atan,
+    Sinh,
+    Cosh,
+    Tanh,
+    Exp,
+    Log,
+    Log10,
+    Log2,
+    Sqrt,
+    Abs,
+    Floor,
+    Ceil,
+    Round,
+    Trunc,
+    Sgn
+};
+
+// One SSA value of a lowered formula. Operands always refer to earlier nodes.
+// Const keeps its value in `value`, Input/Var keep their slot in `a`, PowInt
+// keeps its integer exponent in `value`.
+struct FormulaNode {
+    FormulaOp op;
+    uint32_t a;
+    uint32_t b;
+    double value;
+};
+
+struct FormulaInstr {
+    FormulaOp op;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+    double value;
+};
+
+// Register code for one lowered graph. Output registers are never reused, so
+// one pass can produce several values per lane.
+struct FormulaCode {
+    std::vector<FormulaInstr> instrs;
+    size_t numRegisters = 0;
+    std::vector<uint16_t> outputs;
+};
+
+// Input lane source: stride 1 reads an array, stride 0 broadcasts data[0].
+struct FormulaInput {
+    const double* data;
+    size_t stride;
+};
+
+// Per-point values of the subexpressions that do not depend on a set of
+// changing variables. A fill pass stores them alongside the result; while
+// only those variables change, update passes re-run just the nodes that
+// depend on them. updateSlots maps update inputs to program inputs, or to
+// frontier value k when the slot is inputCount() + k.
+struct FormulaGridCache {
+    std::vector<char> dirtyVars;
+    FormulaCode fill;
+    FormulaCode update;
+    std::vector<uint32_t> updateSlots;
+    size_t frontierCount = 0;
+    size_t nx = 0;
+    size_t ny = 0;
+    std::vector<double> values;
+    bool filled = false;
+};
+
+double ApplyFormulaOp(FormulaOp op, double a, double b, double value);
+
+class FormulaProgram {
+public:
+    static constexpr size_t kLanes = 32;
+
+    bool compile(const std::string& text,
+                 const std::vector<std::string>& inputNames,
+                 const std::vector<std::pair<std::string, double*>>& variables);
+    void clear();
+
+    bool valid() const { return !code.instrs.empty(); }
+    const std::string& error() const { return errorText; }
+    const std::vector<FormulaNode>& graph() const { return nodes; }
+    uint32_t rootNode() const { return root; }
+    const std::vector<const double*>& boundVariables() const { return vars; }
+    size_t inputCount() const { return numInputs; }
+
+    double eval(const double* inputs) const;
+    void evalPoints(const FormulaInput* inputs, double* out, size_t count) const;
+    // Samples out[j * nx + i] at (xs[i], ys[j]) for inputs 0 and 1, with every
+    // other input held at fixed[k]. Subexpressions that depend only on x, only
+    // on y or on neither are computed once per column, row or call.
+    void evalGrid(const double* xs, size_t nx, const double* ys, size_t ny, const double* fixed, double* out) const;
+    bool planGridCache(FormulaGridCache& cache, const std::vector<char>& dirtyVars, size_t nx, size_t ny) const;
+    // Rows [rowBegin, rowEnd) of a grid cached by planGridCache; ys spans the
+    // whole grid and out points at row rowBegin.
+    void evalGridRows(FormulaGridCache& cache, bool fill, const double* xs, const double* ys,
+                      size_t rowBegin, size_t rowEnd, const double* fixed, double* out) const;
+    Interval evalInterval(const Interval* inputs) const;
+    double evalGradient(const double* inputs, double* gradient) const;
+
+private:
+    enum GridStage : uint8_t { StageInvariant, StageColumn, StageRow, StageInner, StageCount, StageInput = StageCount };
+
+    struct GridSlot {
+        uint8_t stage;
+        uint32_t index;
+    };
+
+    struct GridStagePlan {
+        FormulaCode code;
+        std::vector<GridSlot> slots;
+    };
+
+    static void lower(const std::vector<FormulaNode>& graph, const std::vector<uint32_t>& outputs, FormulaCode& out);
+    void run(const FormulaCode& c, const FormulaInput* inputs, double* const* outs, size_t count) const;
+    void planGrid();
+
+    std::vector<FormulaNode> nodes;
+    uint32_t root = 0;
+    std::vector<const double*> vars;
+    size_t numInputs = 0;
+    FormulaCode code;
+    GridStagePlan gridStages[StageCount];
+    GridSlot gridResult = { StageInvariant, 0 };
+    bool gridPlanned = false;
+    std::string errorText;
+    mutable std::vector<double> lanes;
+    mutable std::vector<double> gridValues[StageInner];
+    mutable std::vector<FormulaInput> gridInputs;
+    mutable std::vector<double*> gridOutputs;
+    mutable std::vector<double> scalars;
+    mutable std::vector<Interval> intervals;
+    mutable std::vector<Dual> duals;
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Closed interval [lo, hi] bounding every defined value of an expression over
+// a box. maybeNaN records that some points of the box may be undefined; an
+// empty interval (lo > hi) means no point of the box is defined. Bounds are
+// rounded outward so the true range is always contained.
+struct Interval
+{
+    double lo, hi;
+    bool maybeNaN;
+    Interval() : lo(0.0), hi(0.0), maybeNaN(false) {}
+    Interval(double v) : lo(v), hi(v), maybeNaN(std::isnan(v)) { if (maybeNaN) { lo = std::numeric_limits<double>::infinity(); hi = -lo; } }
+    Interval(double lo, double hi, bool maybeNaN = false) : lo(lo), hi(hi), maybeNaN(maybeNaN) {}
+
+    static Interval Empty() { return Interval(std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(), true); }
+    static Interval Entire() { return Interval(-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(), true); }
+
+    bool isEmpty() const { return !(lo <= hi); }
+    bool isBounded() const { return !isEmpty() && std::isfinite(lo) && std::isfinite(hi); }
+    bool contains(double v) const { return lo <= v && v <= hi; }
+    double width() const { return hi - lo; }
+};
+
+namespace interval {
+
+inline Interval Make(double lo, double hi, bool maybeNaN, int ulps = 1) {
+    if (std::isnan(lo) || std::isnan(hi)) return Interval::Entire();
+    for (int i = 0; i < ulps; ++i) {
+        lo = std::nextafter(lo, -std::numeric_limits<double>::infinity());
+        hi = std::nextafter(hi, std::numeric_limits<double>::infinity());
+    }
+    return Interval(lo, hi, maybeNaN);
+}
+
+inline Interval Hull(const Interval& a, const Interval& b) {
+    if (a.isEmpty()) return Interval(b.lo, b.hi, a.maybeNaN || b.maybeNaN);
+    if (b.isEmpty()) return Interval(a.lo, a.hi, a.maybeNaN || b.maybeNaN);
+    return Interval(std::min(a.lo, b.lo), std::max(a.hi, b.hi), a.maybeNaN || b.maybeNaN);
+}
+
+inline bool Unbounded(const Interval& a) {
+    return !a.isEmpty() && (std::isinf(a.lo) || std::isinf(a.hi));
+}
+
+inline double MulBound(double a, double b) {
+    if (a == 0.0 || b == 0.0) return 0.0;
+    return a * b;
+}
+
+inline Interval Add(const Interval& a, const Interval& b) {
+    if (a.isEmpty() || b.isEmpty()) return Interval::Empty();
+    bool nan = a.maybeNaN || b.maybeNaN ||
+               (std::isinf(a.lo) && std::isinf(b.hi)) || (std::isinf(a.hi) && std::isinf(b.lo));
+    return Make(a.lo + b.lo, a.hi + b.hi, nan);
+}
+
+inline Interval Neg(const Interval& a) {
+    if (a.isEmpty()) return a;
+    return Interval(-a.hi, -a.lo, a.maybeNaN);
+}
+
+inline Interval Sub(const Interval& a, const Interval& b) {
+    return Add(a, Neg(b));
+}
+
+inline Interval Mul(const Interval& a, const Interval& b) {
+    if (a.isEmpty() || b.isEmpty()) return Interval::Empty();
+    bool nan = a.maybeNaN || b.maybeNaN ||
+               (a.contains(0.0) && Unbounded(b)) || (b.contains(0.0) && Unbounded(a));
+    double p[4] = { MulBound(a.lo, b.lo), MulBound(a.lo, b.hi), MulBound(a.hi, b.lo), MulBound(a.hi, b.hi) };
+    return Make(*std::min_element(p, p + 4), *std::max_element(p, p + 4), nan);
+}
+
+inline Interval Div(const Interval& a, const Interval& b) {
+    if (a.isEmpty() || b.isEmpty()) return Interval::Empty();
+    if (b.contains(0.0)) {
+        Interval r = Interval::Entire();
+        r.maybeNaN = a.maybeNaN || b.maybeNaN || a.contains(0.0);
+        return r;
+    }
+    bool nan = a.maybeNaN || b.maybeNaN || (Unbounded(a) && Unbounded(b));
+    double p[4] = { a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi };
+    for (double& v : p) if (std::isnan(v)) return Interval::Entire();
+    return Make(*std::min_element(p, p + 4), *std::max_element(p, p + 4), nan);
+}
+
+// min(a, b) = (b < a) ? b : a, so a NaN in b yields a and a NaN in a stays NaN.
+inline Interval Min(const Interval& a, const Interval& b) {
+    if (a.isEmpty()) return Interval::Empty();
+    Interval r = b.isEmpty() ? a : Interval(std::min(a.lo, b.lo), std::min(a.hi, b.hi), a.maybeNaN);
+    return b.maybeNaN ? Hull(r, Interval(a.lo, a.hi, a.maybeNaN)) : r;
+}
+
+// max(a, b) = (a < b) ? b : a, with the same NaN behaviour as Min.
+inline Interval Max(const Interval& a, const Interval& b) {
+    if (a.isEmpty()) return Interval::Empty();
+    Interval r = b.isEmpty() ? a : Interval(std::max(a.lo, b.lo), std::max(a.hi, b.hi), a.maybeNaN);
+    return b.maybeNaN ? Hull(r, Interval(a.lo, a.hi, a.maybeNaN)) : r;
+}
+
+inline Interval Abs(const Interval& a) {
+    if (a.isEmpty()) return a;
+    if (a.lo >= 0.0) return a;
+    if (a.hi <= 0.0) return Neg(a);
+    return Interval(0.0, std::max(-a.lo, a.hi), a.maybeNaN);
+}
+
+template <typename F>
+inline Interval Monotone(const Interval& a, F f, int ulps = 2) {
+    if (a.isEmpty()) return a;
+    return Make(f(a.lo), f(a.hi), a.maybeNaN, ulps);
+}
+
+inline Interval Sgn(const Interval& a) {
+    Interval r = a.isEmpty() ? Interval(0.0) : Interval(a.lo > 0.0 ? 1.0 : (a.lo < 0.0 ? -1.0 : 0.0),
+                                                         a.hi > 0.0 ? 1.0 : (a.hi < 0.0 ? -1.0 : 0.0));
+    return a.maybeNaN ? Hull(r, Interval(0.0)) : r;
+}
+
+inline Interval PowInt(const Interval& a, int n) {
+    if (n == 0) return Interval(1.0);
+    if (a.isEmpty()) return a;
+    if (n < 0) return Div(Interval(1.0), PowInt(a, -n));
+    auto p = [n](double v) {
+        double r = 1.0;
+        for (int i = 0; i < n; ++i) r *= v;
+        return r;
+    };
+    if (n % 2 == 1) return Make(p(a.lo), p(a.hi), a.maybeNaN, n);
+    Interval m = Abs(a);
+    return Make(p(m.lo), p(m.hi), a.maybeNaN, n);
+}
+
+inline Interval Sqrt(const Interval& a) {
+    if (a.isEmpty() || a.hi < 0.0) return Interval::Empty();
+    return Make(std::sqrt(std::max(a.lo, 0.0)), std::sqrt(a.hi), a.maybeNaN || a.lo < 0.0);
+}
+
+template <typename F>
+inline Interval LogLike(const Interval& a, F f) {
+    if (a.isEmpty() || a.hi < 0.0) return Interval::Empty();
+    double lo = a.lo > 0.0 ? f(a.lo) : -std::numeric_limits<double>::infinity();
+    return Make(lo, f(a.hi), a.maybeNaN || a.lo < 0.0, 2);
+}
+
+inline Interval Pow(const Interval& a, const Interval& b) {
+    if (b.lo == b.hi && b.lo == std::floor(b.lo) && std::fabs(b.lo) <= 64.0) return PowInt(a, (int)b.lo);
+    if (a.isEmpty() && b.isEmpty()) return Interval::Empty();
+    Interval r;
+    if (a.isEmpty() || b.isEmpty()) {
+        r = Interval::Empty();
+    } else if (a.lo < 0.0) {
+        r = Interval::Entire();
+    } else {
+        double p[4] = { std::pow(a.lo, b.lo), std::pow(a.lo, b.hi), std::pow(a.hi, b.lo), std::pow(a.hi, b.hi) };
+        bool nan = a.maybeNaN || b.maybeNaN;
+        for (double& v : p) if (std::isnan(v)) return Interval::Entire();
+        r = Make(*std::min_element(p, p + 4), *std::max_element(p, p + 4), nan, 4);
+    }
+    if ((a.maybeNaN && b.contains(0.0)) || (b.maybeNaN && a.contains(1.0))) r = Hull(r, Interval(1.0));
+    return r;
+}
+
+inline bool ContainsPhase(const Interval& a, double phase, double period) {
+    double k = std::ceil((a.lo - phase) / period);
+    return phase + k * period <= a.hi;
+}
+
+template <typename F>
+inline Interval Periodic(const Interval& a, F f, double maxPhase, double minPhase) {
+    if (a.isEmpty()) return a;
+    const double pi = 3.14159265358979323846;
+    bool nan = a.maybeNaN || Unbounded(a);
+    if (!a.isBounded() || a.width() >= 2.0 * pi) return Interval(-1.0, 1.0, nan);
+    double fl = f(a.lo), fh = f(a.hi);
+    Interval r = Make(std::min(fl, fh), std::max(fl, fh), nan, 2);
+    Interval padded = Make(a.lo, a.hi, false, 4);
+    if (ContainsPhase(padded, maxPhase, 2.0 * pi)) r.hi = 1.0;
+    if (ContainsPhase(padded, minPhase, 2.0 * pi)) r.lo = -1.0;
+    return Interval(std::max(r.lo, -1.0), std::min(r.hi, 1.0), nan);
+}
+
+inline Interval Sin(const Interval& a) {
+    const double pi = 3.14159265358979323846;
+    return Periodic(a, [](double v) { return std::sin(v); }, 0.5 * pi, -0.5 * pi);
+}
+
+inline Interval Cos(const Interval& a) {
+    const double pi = 3.14159265358979323846;
+    return Periodic(a, [](double v) { return std::cos(v); }, 0.0, pi);
+}
+
+inline Interval Tan(const Interval& a) {
+    if (a.isEmpty()) return a;
+    const double pi = 3.14159265358979323846;
+    if (!a.isBounded() || a.width() >= pi) return Interval::Entire();
+    if (ContainsPhase(Make(a.lo, a.hi, false, 4), 0.5 * pi, pi)) return Interval::Entire();
+    double lo = std::tan(a.lo), hi = std::tan(a.hi);
+    if (lo > hi) return Interval::Entire();
+    return Make(lo, hi, a.maybeNaN, 2);
+}
+
+inline Interval Cosh(const Interval& a) {
+    if (a.isEmpty()) return a;
+    Interval m = Abs(a);
+    return Make(std::cosh(m.lo), std::cosh(m.hi), a.maybeNaN, 2);
+}
+
+inline Interval Asin(const Interval& a) {
+    if (a.isEmpty() || a.hi < -1.0 || a.lo > 1.0) return Interval::Empty();
+    bool nan = a.maybeNaN || a.lo < -1.0 || a.hi > 1.0;
+    return Make(std::asin(std::max(a.lo, -1.0)), std::asin(std::min(a.hi, 1.0)), nan, 2);
+}
+
+inline Interval Acos(const Interval& a) {
+    if (a.isEmpty() || a.hi < -1.0 || a.lo > 1.0) return Interval::Empty();
+    bool nan = a.maybeNaN || a.lo < -1.0 || a.hi > 1.0;
+    return Make(std::acos(std::min(a.hi, 1.0)), std::acos(std::max(a.lo, -1.0)), nan, 2);
+}
+
+inline Interval Mod(const Interval& a, const Interval& b) {
+    if (a.isEmpty() || b.isEmpty()) return Interval::Empty();
+    double m = std::max(std::fabs(b.lo), std::fabs(b.hi));
+    if (m == 0.0) return Interval::Empty();
+    bool nan = a.maybeNaN || b.maybeNaN || b.contains(0.0) || Unbounded(a);
+    if (a.lo >= 0.0) return Interval(0.0, std::min(a.hi, m), nan);
+    if (a.hi <= 0.0) return Interval(std::max(a.lo, -m), 0.0, nan);
+    return Interval(std::max(a.lo, -m), std::min(a.hi, m), nan);
+}
+
+inline Interval Hypot(const Interval& a, const Interval& b) {
+    if (a.isEmpty() && b.isEmpty()) return Interval::Empty();
+    if (a.isEmpty() || b.isEmpty()) {
+        const Interval& other = a.isEmpty() ? b : a;
+        Interval r = Interval::Empty();
+        if (Unbounded(other)) r = Interval(std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(), true);
+        return r;
+    }
+    Interval x = Abs(a), y = Abs(b);
+    Interval r = Make(std::hypot(x.lo, y.lo), std::hypot(x.hi, y.hi), a.maybeNaN || b.maybeNaN, 2);
+    if ((a.maybeNaN && Unbounded(b)) || (b.maybeNaN && Unbounded(a))) r.hi = std::numeric_limits<double>::infinity();
+    return r;
+}
+
+inline Interval Atan2(const Interval& a, const Interval& b) {
+    if (a.isEmpty() || b.isEmpty()) return Interval::Empty();
+    const double pi = 3.14159265358979323846;
+    return Make(-pi, pi, a.maybeNaN || b.maybeNaN);
+}
+
+}
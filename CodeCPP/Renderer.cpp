@@ -1,5 +1,9 @@
 #include "Renderer.h"
 #include "Vector3.h"
+#include "WorkerPool.h"
+#include "AllocationCounter.h"
+#include "FormulaProgram.h"
+#include "SurfaceMesh.h"
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -17,8 +21,16 @@
 #include <cctype>
 #include <map>
 #include <sstream>
+#include <memory>
+#include <deque>
+#include <list>
+#include <cstddef>
+#include <unordered_map>
+#include <atomic>
+#include <condition_variable>
+#include <queue>
 
-#include "exprtk.hpp"
+#include "ExprtkFormula.h"
 
 std::string g_formula = "sin(x)*cos(y)";
 double g_range_min = -10.0;
@@ -35,7 +47,7 @@ struct UserVariable {
     bool isDragging;
 };
 
-std::vector<UserVariable> g_userVars;
+std::deque<UserVariable> g_userVars;
 std::string g_consoleInput;
 std::vector<std::string> g_consoleHistory;
 bool g_consoleActive = true;
@@ -46,14 +58,9 @@ const int g_visibleLines = 4;
 double g_fps = 0.0;
 double g_frameTime = 0.0;
 
-struct CachedVertex {
-    float x, y, z;
-    float r, g, b;
-};
-std::vector<CachedVertex> g_cachedVertices;
-std::vector<int> g_stripStarts;
-bool g_cacheValid = false;
-GLuint g_displayList = 0;
+SurfaceMesh g_cachedMesh;
+size_t g_cachedEvaluations = 0;
+size_t g_cachedAllocations = 0;
 
 bool g_isParametric = false;
 std::string g_paramX, g_paramY, g_paramZ;
@@ -202,42 +209,296 @@ enum class EquationType {
     IMPLICIT
 };
 
-struct ExprEvaluator {
-    typedef exprtk::symbol_table<double> symbol_table_t;
-    typedef exprtk::expression<double> expression_t;
-    typedef exprtk::parser<double> parser_t;
+enum class EvalBackend {
+    Exprtk,
+    Bytecode
+};
+
+EvalBackend g_backend = EvalBackend::Bytecode;
+
+enum class SurfaceTessellation {
+    Uniform,
+    Adaptive,
+    Tiled
+};
+
+SurfaceTessellation g_tessellation = SurfaceTessellation::Uniform;
+
+enum class ImplicitMesher {
+    Cubes,
+    Dual,
+    Octree
+};
+
+ImplicitMesher g_implicitMesher = ImplicitMesher::Cubes;
+// Implicit formulas draw the level set f(x, y, z) = g_isoLevel.
+double g_isoLevel = 0.0;
+// Regula falsi steps spent on each crossed lattice edge; 0 interpolates.
+int g_edgeRefinement = 0;
+double g_adaptiveTolerance = 0.01;
+double g_tilePixelError = 3.0;
+bool g_lighting = true;
+
+enum class BuildMode {
+    Thread,
+    Sliced
+};
+
+// Sliced mode builds on the render thread a few milliseconds per frame, for
+// hosts without a core to spare; it is the default on single-core machines.
+BuildMode g_buildMode = std::thread::hardware_concurrency() > 1 ? BuildMode::Thread : BuildMode::Sliced;
+double g_sliceBudgetMs = 4.0;
+size_t g_buildEvaluations = 0;
+
+// Generation of the newest build request, and of the job the build thread is
+// running. Builders poll BuildCancelled() between stages and bands and stop
+// early once a newer request has been made.
+std::atomic<uint64_t> g_latestGeneration{ 0 };
+uint64_t g_jobGeneration = 0;
+
+inline bool BuildCancelled() {
+    return g_jobGeneration != g_latestGeneration.load(std::memory_order_relaxed);
+}
+
+// End of the current build slice in sliced mode. Resumable builders stop at
+// the first batch boundary past it and set g_buildPaused; called again for the
+// same job, they carry on where they stopped. The build thread never sets a
+// deadline, so there every builder runs to the end in one call.
+thread_local std::chrono::steady_clock::time_point g_sliceDeadline = std::chrono::steady_clock::time_point::max();
+thread_local bool g_buildPaused = false;
+
+inline bool SliceActive() {
+    return g_sliceDeadline != std::chrono::steady_clock::time_point::max();
+}
+
+// True once the slice deadline has passed; the builder must then return.
+inline bool PauseBuild() {
+    if (!SliceActive() || std::chrono::steady_clock::now() < g_sliceDeadline) return false;
+    g_buildPaused = true;
+    return true;
+}
+
+// Progress of a resumable builder: the stage it reached, the next item of that
+// stage's loop, the batch size that fitted so far and the measured cost of an
+// item. A builder called for another job than the one it stopped in starts over.
+struct BuildCursor {
+    uint64_t generation = 0;
+    int stage = 0;
+    size_t next = 0;
+    size_t batch = 1;
+    double itemMs = 0.0;
+
+    bool resumes() const { return stage != 0 && generation == g_jobGeneration; }
+
+    void start(int first) {
+        generation = g_jobGeneration;
+        enter(first);
+    }
+
+    void enter(int nextStage) {
+        stage = nextStage;
+        next = 0;
+        batch = 1;
+        itemMs = 0.0;
+    }
+
+    void finish() { stage = 0; }
+};
+
+// Runs body(begin, end) over items [cursor.next, count). Outside a slice the
+// items go in one call. In a slice they go in batches that double while they
+// fit, cut to the time left at the cost measured so far, and stop before an
+// item that would not fit; returns false when they stopped. Loops whose items
+// differ widely in cost, such as empty and crossed blocks of a lattice, pass
+// maxBatch: a run of cheap items would otherwise grow the batch past what the
+// costly ones fit.
+template <typename F>
+bool RunSliced(BuildCursor& cursor, size_t count, F&& body, size_t maxBatch = SIZE_MAX) {
+    if (!SliceActive()) {
+        if (cursor.next < count) body(cursor.next, count);
+        cursor.next = count;
+        return true;
+    }
+    bool ran = false;
+    while (cursor.next < count) {
+        if (PauseBuild()) return false;
+        auto start = std::chrono::steady_clock::now();
+        size_t size = std::min(std::min(cursor.batch, maxBatch), count - cursor.next);
+        if (cursor.itemMs > 0.0) {
+            double left = std::chrono::duration<double, std::milli>(g_sliceDeadline - start).count();
+            if (ran && left < cursor.itemMs) {
+                g_buildPaused = true;
+                return false;
+            }
+            size = std::min(size, std::max<size_t>(1, (size_t)(left / cursor.itemMs)));
+        }
+        ran = true;
+        body(cursor.next, cursor.next + size);
+        cursor.next += size;
+        double took = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        cursor.itemMs = took / (double)size;
+        if (size == cursor.batch) cursor.batch *= 2;
+    }
+    return true;
+}
+
+// ComputeTriangleNormals as three stages of cursor from `zero`: clearing the
+// face sums, adding the faces and packing the vertices. sum keeps the sums
+// between calls and is released at the end. Returns false when paused.
+bool ComputeNormalsSliced(SurfaceMesh& mesh, BuildCursor& cursor, int zero, std::vector<double>& sum) {
+    if (cursor.stage == zero) {
+        if (cursor.next == 0) {
+            sum.clear();
+            sum.reserve(mesh.vertices.size() * 3);
+        }
+        if (!RunSliced(cursor, mesh.vertices.size(), [&](size_t, size_t last) { sum.resize(last * 3, 0.0); })) {
+            return false;
+        }
+        cursor.enter(zero + 1);
+    }
+    if (cursor.stage == zero + 1) {
+        if (!RunSliced(cursor, mesh.indices.size() / 3, [&](size_t first, size_t last) {
+                AccumulateTriangleNormals(mesh, first, last, sum);
+            })) {
+            return false;
+        }
+        cursor.enter(zero + 2);
+    }
+    if (!RunSliced(cursor, mesh.vertices.size(), [&](size_t first, size_t last) {
+            PackVertexNormals(sum, first, last, mesh);
+        })) {
+        return false;
+    }
+    std::vector<double>().swap(sum);
+    return true;
+}
+
+std::string NormalizeFormulaKey(const std::string& formula) {
+    std::string key;
+    bool pendingSpace = false;
+    for (char c : formula) {
+        if (isspace((unsigned char)c)) {
+            pendingSpace = !key.empty();
+            continue;
+        }
+        char lower = (char)tolower((unsigned char)c);
+        if (pendingSpace && (isalnum((unsigned char)key.back()) || key.back() == '_' || key.back() == '.') &&
+            (isalnum((unsigned char)lower) || lower == '_' || lower == '.')) {
+            key += ' ';
+        }
+        pendingSpace = false;
+        key += lower;
+    }
+    return key;
+}
 
+struct ExprEvaluator {
     double X = 0.0;
     double Y = 0.0;
     double Z = 0.0;
 
-    symbol_table_t symbol_table;
-    expression_t expression;
-    parser_t parser;
+    ExprtkContext context{ false };
+    ExprtkExpression expression;
     EquationType eqType = EquationType::EXPLICIT_Z;
     std::string originalFormula;
     std::string rightSideFormula;
-    expression_t rightSideExpression;
+    ExprtkExpression rightSideExpression;
     bool hasRightSideExpression = false;
     bool allVarsEqual = false;
+    std::vector<std::pair<std::string, double*>> userBindings;
+    EvalBackend backend = g_backend;
+    std::string rightSideSource;
+    FormulaProgram program;
+    FormulaProgram rightSideProgram;
+    std::vector<double> gridXs;
+
+    struct CompiledPlan {
+        std::string key;
+        EquationType eqType;
+        std::string rightSideFormula;
+        std::string rightSideSource;
+        bool hasRightSideExpression;
+        bool allVarsEqual;
+        ExprtkExpression expression;
+        ExprtkExpression rightSideExpression;
+        FormulaProgram program;
+        FormulaProgram rightSideProgram;
+    };
+
+    static const size_t kPlanCacheSize = 16;
+    std::list<CompiledPlan> planCache;
 
     ExprEvaluator() {
-        symbol_table.add_variable("x", X);
-        symbol_table.add_variable("y", Y);
-        symbol_table.add_variable("z", Z);
-        symbol_table.add_constants();
-        expression.register_symbol_table(symbol_table);
-        rightSideExpression.register_symbol_table(symbol_table);
-        parser.settings().disable_all_control_structures();
+        context.addVariable("x", X);
+        context.addVariable("y", Y);
+        context.addVariable("z", Z);
     }
 
     void addUserVariable(const std::string& name, double& value) {
-        symbol_table.add_variable(name, value);
+        if (context.addVariable(name, value)) {
+            userBindings.emplace_back(name, &value);
+        }
+    }
+
+    std::unique_ptr<ExprEvaluator> clone() const {
+        std::unique_ptr<ExprEvaluator> copy(new ExprEvaluator());
+        copy->backend = backend;
+        for (const auto& binding : userBindings) {
+            copy->addUserVariable(binding.first, *binding.second);
+        }
+        copy->compile(originalFormula);
+        return copy;
+    }
+
+    std::string planKey(const std::string& formula) const {
+        std::vector<std::string> names;
+        for (const auto& binding : userBindings) names.push_back(binding.first);
+        std::sort(names.begin(), names.end());
+        std::string key = NormalizeFormulaKey(formula);
+        key += backend == EvalBackend::Bytecode ? "|vm|" : "|exprtk|";
+        for (const auto& name : names) key += name + ",";
+        return key;
     }
 
     bool compile(const std::string& formula) {
         originalFormula = formula;
+        std::string key = planKey(formula);
+        for (auto it = planCache.begin(); it != planCache.end(); ++it) {
+            if (it->key != key) continue;
+            planCache.splice(planCache.begin(), planCache, it);
+            const CompiledPlan& plan = planCache.front();
+            eqType = plan.eqType;
+            rightSideFormula = plan.rightSideFormula;
+            rightSideSource = plan.rightSideSource;
+            hasRightSideExpression = plan.hasRightSideExpression;
+            allVarsEqual = plan.allVarsEqual;
+            expression = plan.expression;
+            rightSideExpression = plan.rightSideExpression;
+            program = plan.program;
+            rightSideProgram = plan.rightSideProgram;
+            return true;
+        }
+
+        if (!parseFormula(formula)) return false;
+        CompiledPlan plan;
+        plan.key = key;
+        plan.eqType = eqType;
+        plan.rightSideFormula = rightSideFormula;
+        plan.rightSideSource = rightSideSource;
+        plan.hasRightSideExpression = hasRightSideExpression;
+        plan.allVarsEqual = allVarsEqual;
+        plan.expression = expression;
+        plan.rightSideExpression = rightSideExpression;
+        plan.program = program;
+        plan.rightSideProgram = rightSideProgram;
+        planCache.push_front(plan);
+        if (planCache.size() > kPlanCacheSize) planCache.pop_back();
+        return true;
+    }
+
+    bool parseFormula(const std::string& formula) {
         std::string processedFormula = formula;
+        rightSideSource.clear();
         hasRightSideExpression = false;
         allVarsEqual = false;
 
@@ -312,7 +573,8 @@ struct ExprEvaluator {
                             allVarsEqual = false;
                             rightSideFormula = parts[exprIdx];
                             rightSideFormula += std::string("|") + paramVar + "|" + singleVars;
-                            hasRightSideExpression = parser.compile(parts[exprIdx], rightSideExpression);
+                            rightSideSource = parts[exprIdx];
+                            hasRightSideExpression = context.compile(rightSideSource, rightSideExpression);
                             processedFormula = "0";
                         } else {
                             eqType = EquationType::IMPLICIT;
@@ -377,7 +639,8 @@ struct ExprEvaluator {
                 } else {
                     eqType = EquationType::IMPLICIT;
                     rightSideFormula = right;
-                    hasRightSideExpression = parser.compile(right, rightSideExpression);
+                    rightSideSource = right;
+                    hasRightSideExpression = context.compile(right, rightSideExpression);
                     processedFormula = "(" + left + ") - (" + right + ")";
                 }
             }
@@ -385,27 +648,376 @@ struct ExprEvaluator {
             eqType = EquationType::EXPLICIT_Z;
         }
 
-        return parser.compile(processedFormula, expression);
+        bool ok = context.compile(processedFormula, expression);
+        program.clear();
+        rightSideProgram.clear();
+        if (ok && backend == EvalBackend::Bytecode) {
+            static const std::vector<std::string> inputs = { "x", "y", "z" };
+            program.compile(processedFormula, inputs, userBindings);
+            if (hasRightSideExpression) rightSideProgram.compile(rightSideSource, inputs, userBindings);
+        }
+        return ok;
+    }
+
+    void setBackend(EvalBackend b) {
+        if (backend == b) return;
+        backend = b;
+        if (!originalFormula.empty()) compile(originalFormula);
+    }
+
+    bool usingBytecode() const {
+        return program.valid() && (!hasRightSideExpression || rightSideProgram.valid());
     }
 
     double evalRightSide(double x, double y, double z) {
         if (!hasRightSideExpression) return 0.0;
+        if (rightSideProgram.valid()) {
+            double in[3] = { x, y, z };
+            return rightSideProgram.eval(in);
+        }
         X = x; Y = y; Z = z;
         return rightSideExpression.value();
     }
 
     double eval(double x, double y) {
+        if (program.valid()) {
+            double in[3] = { x, y, 0.0 };
+            return program.eval(in);
+        }
         X = x; Y = y; Z = 0.0;
         return expression.value();
     }
 
     double evalImplicit(double x, double y, double z) {
+        if (program.valid()) {
+            double in[3] = { x, y, z };
+            return program.eval(in);
+        }
+        X = x; Y = y; Z = z;
+        return expression.value();
+    }
+
+    void evalPoints(const double* xs, const double* ys, double* out, size_t count) {
+        if (program.valid()) {
+            const double zero = 0.0;
+            FormulaInput in[3] = { { xs, 1 }, { ys, 1 }, { &zero, 0 } };
+            program.evalPoints(in, out, count);
+            return;
+        }
+        const ExprtkExpression& expr = expression;
+        Z = 0.0;
+        for (size_t i = 0; i < count; ++i) {
+            X = xs[i];
+            Y = ys[i];
+            out[i] = expr.value();
+        }
+    }
+
+    void evalPoints(const double* xs, const double* ys, const double* zs, double* out, size_t count) {
+        if (program.valid()) {
+            FormulaInput in[3] = { { xs, 1 }, { ys, 1 }, { zs, 1 } };
+            program.evalPoints(in, out, count);
+            return;
+        }
+        const ExprtkExpression& expr = expression;
+        for (size_t i = 0; i < count; ++i) {
+            X = xs[i];
+            Y = ys[i];
+            Z = zs[i];
+            out[i] = expr.value();
+        }
+    }
+
+    double evalGradient(double x, double y, double z, double* gradient) {
+        if (program.valid()) {
+            double in[3] = { x, y, z };
+            return program.evalGradient(in, gradient);
+        }
         X = x; Y = y; Z = z;
+        gradient[0] = expression.derivative(X);
+        gradient[1] = expression.derivative(Y);
+        gradient[2] = expression.derivative(Z);
         return expression.value();
     }
+
+    bool evalInterval(const Interval& x, const Interval& y, const Interval& z, Interval& out) {
+        if (!program.valid()) return false;
+        Interval in[3] = { x, y, z };
+        out = program.evalInterval(in);
+        return true;
+    }
+
+    // out[j * nx + i] = f(xs[i], ys[j]).
+    void evalGrid(const double* xs, size_t nx, const double* ys, size_t ny, double* out) {
+        if (program.valid()) {
+            const double fixed[3] = { 0.0, 0.0, 0.0 };
+            program.evalGrid(xs, nx, ys, ny, fixed, out);
+            return;
+        }
+        const ExprtkExpression& expr = expression;
+        Z = 0.0;
+        for (size_t j = 0; j < ny; ++j) {
+            Y = ys[j];
+            double* row = out + j * nx;
+            for (size_t i = 0; i < nx; ++i) {
+                X = xs[i];
+                row[i] = expr.value();
+            }
+        }
+    }
+
+    // Samples the right side over a grid on uAxis and vAxis with the third
+    // coordinate held at zero: out[j * nu + i] = rhs at (uMin + step * i, vMin + step * j).
+    void evalRightSideGrid(int uAxis, int vAxis, double uMin, size_t nu, double vMin, size_t nv, double step, double* out) {
+        if (!hasRightSideExpression) {
+            std::fill(out, out + nu * nv, 0.0);
+            return;
+        }
+        if (rightSideProgram.valid()) {
+            gridXs.resize(nu);
+            for (size_t i = 0; i < nu; ++i) gridXs[i] = uMin + step * (double)i;
+            const double zero = 0.0;
+            for (size_t j = 0; j < nv; ++j) {
+                double v = vMin + step * (double)j;
+                FormulaInput in[3] = { { &zero, 0 }, { &zero, 0 }, { &zero, 0 } };
+                in[uAxis] = { gridXs.data(), 1 };
+                in[vAxis] = { &v, 0 };
+                rightSideProgram.evalPoints(in, out + j * nu, nu);
+            }
+            return;
+        }
+        double* coords[3] = { &X, &Y, &Z };
+        X = Y = Z = 0.0;
+        for (size_t j = 0; j < nv; ++j) {
+            *coords[vAxis] = vMin + step * (double)j;
+            for (size_t i = 0; i < nu; ++i) {
+                *coords[uAxis] = uMin + step * (double)i;
+                out[j * nu + i] = rightSideExpression.value();
+            }
+        }
+    }
+};
+
+inline size_t GridCount(double rangeMin, double rangeMax, double step) {
+    if (!(step > 0.0) || rangeMax < rangeMin) return 0;
+    return (size_t)std::floor((rangeMax - rangeMin) / step + 1e-9) + 1;
+}
+
+std::vector<std::unique_ptr<ExprEvaluator>> g_workerEvaluators;
+
+void SyncWorkerEvaluators(const ExprEvaluator& eval) {
+    size_t needed = WorkerPool::Instance().workerCount() - 1;
+    bool stale = g_workerEvaluators.size() != needed;
+    for (const auto& worker : g_workerEvaluators) {
+        if (worker->originalFormula != eval.originalFormula ||
+            worker->userBindings != eval.userBindings ||
+            worker->backend != eval.backend) {
+            stale = true;
+            break;
+        }
+    }
+    if (!stale) return;
+    g_workerEvaluators.clear();
+    for (size_t i = 0; i < needed; ++i) {
+        g_workerEvaluators.push_back(eval.clone());
+    }
+}
+
+// Sets out[k] = origin + step * (first + stride * k) for k < count. Every
+// sampler places lattice points this way, so a point gets the same coordinate
+// whether it is sampled with the whole grid, in a band or in a coarser level.
+void LatticeCoordinates(double origin, double step, size_t first, size_t stride, size_t count,
+                        std::vector<double>& out) {
+    out.resize(count);
+    for (size_t k = 0; k < count; ++k) out[k] = origin + step * (double)(first + stride * k);
+}
+
+void SampleGridParallel(ExprEvaluator& eval, const double* xs, size_t nx, const double* ys, size_t ny, double* out) {
+    SyncWorkerEvaluators(eval);
+    size_t bands = (size_t)WorkerPool::Instance().workerCount() * 4;
+    size_t bandRows = std::max<size_t>(1, ny / bands);
+    ParallelFor(ny, bandRows, [&](size_t begin, size_t end, unsigned worker) {
+        if (BuildCancelled()) return;
+        ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+        local.evalGrid(xs, nx, ys + begin, end - begin, out + begin * nx);
+    });
+}
+
+void SampleRightSideGridParallel(ExprEvaluator& eval, int uAxis, int vAxis, double uMin, size_t nu,
+                                 double vMin, size_t nv, double step, double* out) {
+    SyncWorkerEvaluators(eval);
+    size_t bands = (size_t)WorkerPool::Instance().workerCount() * 4;
+    size_t bandRows = std::max<size_t>(1, nv / bands);
+    ParallelFor(nv, bandRows, [&](size_t begin, size_t end, unsigned worker) {
+        if (BuildCancelled()) return;
+        ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+        local.evalRightSideGrid(uAxis, vAxis, uMin, nu, vMin + step * (double)begin, end - begin, step, out + begin * nu);
+    });
+}
+
+struct SliderGridState {
+    std::string formula;
+    EvalBackend backend = EvalBackend::Exprtk;
+    double rangeMin = 0.0;
+    double step = 0.0;
+    size_t nx = 0;
+    size_t ny = 0;
+    std::vector<double> varValues;
+    std::vector<char> changed;
+    std::vector<double> xs;
+    std::vector<double> ys;
+    FormulaGridCache cache;
+    // How the planned grid's rows are sampled: through the formula cache, and
+    // if so whether they fill it or only re-evaluate what the change touched.
+    bool cached = false;
+    bool fill = false;
 };
 
-ExprEvaluator* g_evaluator = nullptr;
+SliderGridState g_sliderGrid;
+
+// Slider-aware sampling of the nx x ny explicit-surface grid at (rangeMin +
+// step * i, rangeMin + step * j). BeginSurfaceGrid compares the variables with
+// the previous grid's and plans the cached re-evaluation; SampleSurfaceRows
+// then samples rows [r0, r1) in order, into out pointing at row r0, so a build
+// may take the grid in one call or in bands.
+void BeginSurfaceGrid(ExprEvaluator& eval, double rangeMin, double step, size_t nx, size_t ny) {
+    SliderGridState& state = g_sliderGrid;
+    const std::vector<const double*>& vars = eval.program.boundVariables();
+    bool sameGrid = eval.program.valid() && state.formula == eval.originalFormula && state.backend == eval.backend &&
+                    state.rangeMin == rangeMin && state.step == step && state.nx == nx && state.ny == ny &&
+                    state.varValues.size() == vars.size();
+    std::vector<char>& changed = state.changed;
+    changed.assign(vars.size(), 0);
+    bool anyChanged = false;
+    bool covered = sameGrid && state.cache.filled;
+    for (size_t k = 0; sameGrid && k < vars.size(); ++k) {
+        changed[k] = *vars[k] != state.varValues[k];
+        anyChanged = anyChanged || changed[k];
+        if (changed[k] && !(k < state.cache.dirtyVars.size() && state.cache.dirtyVars[k])) covered = false;
+    }
+    state.formula = eval.originalFormula;
+    state.backend = eval.backend;
+    state.rangeMin = rangeMin;
+    state.step = step;
+    state.nx = nx;
+    state.ny = ny;
+    state.varValues.resize(vars.size());
+    for (size_t k = 0; k < vars.size(); ++k) state.varValues[k] = *vars[k];
+    if (!sameGrid) state.cache.filled = false;
+
+    LatticeCoordinates(rangeMin, step, 0, 1, nx, state.xs);
+    LatticeCoordinates(rangeMin, step, 0, 1, ny, state.ys);
+
+    state.fill = !covered;
+    state.cached = anyChanged && (!state.fill || eval.program.planGridCache(state.cache, changed, nx, ny));
+    // Until the last row is in, the cache holds a mix of old and new rows.
+    if (state.cached) state.cache.filled = false;
+}
+
+void SampleSurfaceRows(ExprEvaluator& eval, size_t r0, size_t r1, double* out) {
+    SliderGridState& state = g_sliderGrid;
+    size_t nx = state.nx;
+    if (!state.cached) {
+        SampleGridParallel(eval, state.xs.data(), nx, state.ys.data() + r0, r1 - r0, out);
+        return;
+    }
+    SyncWorkerEvaluators(eval);
+    const double fixed[3] = { 0.0, 0.0, 0.0 };
+    size_t bands = (size_t)WorkerPool::Instance().workerCount() * 4;
+    size_t bandRows = std::max<size_t>(1, (r1 - r0) / bands);
+    ParallelFor(r1 - r0, bandRows, [&](size_t begin, size_t end, unsigned worker) {
+        if (BuildCancelled()) return;
+        ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+        local.program.evalGridRows(state.cache, state.fill, state.xs.data(), state.ys.data(), r0 + begin, r0 + end,
+                                   fixed, out + begin * nx);
+    });
+    if (BuildCancelled()) {
+        state.formula.clear();
+        return;
+    }
+    if (r1 == state.ny) state.cache.filled = true;
+}
+
+void SampleSurfaceGrid(ExprEvaluator& eval, double rangeMin, double step, size_t nx, size_t ny, double* out) {
+    BeginSurfaceGrid(eval, rangeMin, step, nx, ny);
+    SampleSurfaceRows(eval, 0, ny, out);
+}
+
+std::string g_lastCompileError;
+
+struct ParametricEvaluator {
+    double T = 0.0;
+    ExprtkContext context;
+    ExprtkExpression exprX, exprY, exprZ;
+    bool compiled = false;
+    std::vector<std::pair<std::string, double*>> userBindings;
+    EvalBackend backend = g_backend;
+    std::string sources[3];
+    FormulaProgram programs[3];
+
+    ParametricEvaluator() {
+        context.addVariable("t", T);
+    }
+
+    void addUserVariable(const std::string& name, double& value) {
+        if (context.addVariable(name, value)) {
+            userBindings.emplace_back(name, &value);
+        }
+    }
+
+    bool compile(const std::string& xExpr, const std::string& yExpr, const std::string& zExpr) {
+        sources[0] = xExpr;
+        sources[1] = yExpr;
+        sources[2] = zExpr;
+        bool ok = true;
+        ok = ok && context.compile(xExpr, exprX);
+        ok = ok && context.compile(yExpr, exprY);
+        ok = ok && context.compile(zExpr, exprZ);
+        compiled = ok;
+        for (int i = 0; i < 3; ++i) {
+            programs[i].clear();
+            if (ok && backend == EvalBackend::Bytecode) {
+                static const std::vector<std::string> inputs = { "t" };
+                programs[i].compile(sources[i], inputs, userBindings);
+            }
+        }
+        return ok;
+    }
+
+    void setBackend(EvalBackend b) {
+        if (backend == b) return;
+        backend = b;
+        if (compiled) compile(sources[0], sources[1], sources[2]);
+    }
+
+    bool usingBytecode() const {
+        return programs[0].valid() && programs[1].valid() && programs[2].valid();
+    }
+
+    void eval(double t, double& x, double& y, double& z) {
+        T = t;
+        x = programs[0].valid() ? programs[0].eval(&t) : exprX.value();
+        y = programs[1].valid() ? programs[1].eval(&t) : exprY.value();
+        z = programs[2].valid() ? programs[2].eval(&t) : exprZ.value();
+    }
+
+    void evalPoints(const double* ts, double* xs, double* ys, double* zs, size_t count) {
+        const ExprtkExpression* exprs[3] = { &exprX, &exprY, &exprZ };
+        double* outs[3] = { xs, ys, zs };
+        FormulaInput in[1] = { { ts, 1 } };
+        for (int k = 0; k < 3; ++k) {
+            if (programs[k].valid()) {
+                programs[k].evalPoints(in, outs[k], count);
+            } else {
+                const ExprtkExpression& expr = *exprs[k];
+                for (size_t i = 0; i < count; ++i) {
+                    T = ts[i];
+                    outs[k][i] = expr.value();
+                }
+            }
+        }
+    }
+};
 
 void processCommand(const std::string& cmd) {
     std::string trimmed = cmd;
@@ -477,10 +1089,6 @@ void processCommand(const std::string& cmd) {
                 newVar.maxVal = maxV;
                 newVar.isDragging = false;
                 g_userVars.push_back(newVar);
-                
-                if (g_evaluator) {
-                    g_evaluator->addUserVariable(varName, g_userVars.back().value);
-                }
             }
             
             char buf[128];
@@ -507,6 +1115,28 @@ void processCommand(const std::string& cmd) {
             g_consoleHistory.push_back("Step: " + std::to_string(s));
         }
     }
+    else if (trimmed.substr(0, 4) == "iso ") {
+        std::istringstream iss(trimmed.substr(4));
+        double c;
+        if (iss >> c && std::isfinite(c)) {
+            g_isoLevel = c;
+            g_formula_dirty = true;
+            g_consoleHistory.push_back("Iso-level: " + std::to_string(g_isoLevel));
+        } else {
+            g_consoleHistory.push_back("Usage: iso <level>");
+        }
+    }
+    else if (trimmed.substr(0, 7) == "refine ") {
+        std::istringstream iss(trimmed.substr(7));
+        int steps;
+        if (iss >> steps && steps >= 0) {
+            g_edgeRefinement = std::min(steps, 16);
+            g_formula_dirty = true;
+            g_consoleHistory.push_back("Edge refinement: " + std::to_string(g_edgeRefinement) + " steps");
+        } else {
+            g_consoleHistory.push_back("Usage: refine <steps>");
+        }
+    }
     else if (trimmed == "help") {
         g_consoleHistory.push_back("Commands:");
         g_consoleHistory.push_back("  <formula>  - set formula (e.g. sin(x)*cos(y))");
@@ -515,8 +1145,88 @@ void processCommand(const std::string& cmd) {
         g_consoleHistory.push_back("  var t = 0 from -31.4 to 31.4  - slider with custom range");
         g_consoleHistory.push_back("  range -5 5 - set x,y,z range");
         g_consoleHistory.push_back("  step 0.5   - set grid step");
+        g_consoleHistory.push_back("  backend vm|exprtk - choose formula evaluator");
+        g_consoleHistory.push_back("  mesh uniform|adaptive [tol]|tiled [px] - surface tessellation");
+        g_consoleHistory.push_back("  implicit cubes|dual|octree - implicit surface extraction");
+        g_consoleHistory.push_back("  iso 0.5  - draw the implicit level set f = 0.5");
+        g_consoleHistory.push_back("  refine 3  - root-finding steps per implicit edge (0 interpolates)");
+        g_consoleHistory.push_back("  light on|off - shade surfaces");
+        g_consoleHistory.push_back("  build thread|sliced [ms] - background or per-frame building");
         g_consoleHistory.push_back("Functions: sin cos tan asin acos atan exp log sqrt abs pow");
     }
+    else if (trimmed.substr(0, 8) == "backend ") {
+        std::string name = trimmed.substr(8);
+        if (name == "vm" || name == "exprtk") {
+            g_backend = (name == "vm") ? EvalBackend::Bytecode : EvalBackend::Exprtk;
+            g_formula_dirty = true;
+            g_consoleHistory.push_back("Backend: " + name);
+        } else {
+            g_consoleHistory.push_back("Usage: backend vm|exprtk");
+        }
+    }
+    else if (trimmed == "implicit cubes" || trimmed == "implicit dual" || trimmed == "implicit octree") {
+        if (trimmed == "implicit dual") {
+            g_implicitMesher = ImplicitMesher::Dual;
+            g_consoleHistory.push_back("Implicit: dual contouring");
+        } else if (trimmed == "implicit octree") {
+            g_implicitMesher = ImplicitMesher::Octree;
+            g_consoleHistory.push_back("Implicit: sparse octree");
+        } else {
+            g_implicitMesher = ImplicitMesher::Cubes;
+            g_consoleHistory.push_back("Implicit: marching cubes");
+        }
+        g_formula_dirty = true;
+    }
+    else if (trimmed == "light on" || trimmed == "light off") {
+        g_lighting = trimmed == "light on";
+        g_consoleHistory.push_back(g_lighting ? "Lighting: on" : "Lighting: off");
+    }
+    else if (trimmed.substr(0, 6) == "build ") {
+        std::istringstream iss(trimmed.substr(6));
+        std::string mode;
+        iss >> mode;
+        double arg;
+        if (mode == "thread" || mode == "sliced") {
+            char buf[64];
+            if (mode == "sliced") {
+                g_buildMode = BuildMode::Sliced;
+                if (iss >> arg && arg > 0) g_sliceBudgetMs = arg;
+                snprintf(buf, sizeof(buf), "Build: sliced (%g ms per frame)", g_sliceBudgetMs);
+            } else {
+                g_buildMode = BuildMode::Thread;
+                snprintf(buf, sizeof(buf), "Build: thread");
+            }
+            g_formula_dirty = true;
+            g_consoleHistory.push_back(buf);
+        } else {
+            g_consoleHistory.push_back("Usage: build thread|sliced [ms]");
+        }
+    }
+    else if (trimmed.substr(0, 5) == "mesh ") {
+        std::istringstream iss(trimmed.substr(5));
+        std::string mode;
+        iss >> mode;
+        double arg;
+        if (mode == "uniform" || mode == "adaptive" || mode == "tiled") {
+            char buf[64];
+            if (mode == "adaptive") {
+                g_tessellation = SurfaceTessellation::Adaptive;
+                if (iss >> arg && arg > 0) g_adaptiveTolerance = arg;
+                snprintf(buf, sizeof(buf), "Mesh: adaptive (tol %g)", g_adaptiveTolerance);
+            } else if (mode == "tiled") {
+                g_tessellation = SurfaceTessellation::Tiled;
+                if (iss >> arg && arg > 0) g_tilePixelError = arg;
+                snprintf(buf, sizeof(buf), "Mesh: tiled (%g px)", g_tilePixelError);
+            } else {
+                g_tessellation = SurfaceTessellation::Uniform;
+                snprintf(buf, sizeof(buf), "Mesh: uniform");
+            }
+            g_formula_dirty = true;
+            g_consoleHistory.push_back(buf);
+        } else {
+            g_consoleHistory.push_back("Usage: mesh uniform|adaptive [tol]|tiled [px]");
+        }
+    }
     else if (trimmed.substr(0, 6) == "param ") {
         std::string rest = trimmed.substr(6);
         std::vector<std::string> parts;
@@ -567,460 +1277,3197 @@ void processCommand(const std::string& cmd) {
     }
 }
 
-std::string g_lastCompileError;
-
-struct ParametricEvaluator {
-    typedef exprtk::symbol_table<double> symbol_table_t;
-    typedef exprtk::expression<double> expression_t;
-    typedef exprtk::parser<double> parser_t;
-
-    double T = 0.0;
-    symbol_table_t symbol_table;
-    expression_t exprX, exprY, exprZ;
-    parser_t parser;
-    bool compiled = false;
+void BuildParametricMesh(ParametricEvaluator& eval, double tMin, double tMax, int numPoints,
+                         double rangeMin, double rangeMax, SurfaceMesh& mesh) {
+    mesh.reset(MeshPrimitive::Lines, 3.0f);
+    bool inLine = false;
+    float rangeMinF = (float)rangeMin;
+    float rangeMaxF = (float)rangeMax;
+    
+    size_t count = (size_t)numPoints + 1;
+    std::vector<double> ts(count), xs(count), ys(count), zs(count);
+    for (size_t i = 0; i < count; ++i) ts[i] = tMin + (tMax - tMin) * (i / (double)numPoints);
+    eval.evalPoints(ts.data(), xs.data(), ys.data(), zs.data(), count);
 
-    ParametricEvaluator() {
-        symbol_table.add_variable("t", T);
-        symbol_table.add_constants();
-        exprX.register_symbol_table(symbol_table);
-        exprY.register_symbol_table(symbol_table);
-        exprZ.register_symbol_table(symbol_table);
+    for (int i = 0; i <= numPoints; ++i) {
+        float x = (float)xs[i], y = (float)ys[i], z = (float)zs[i];
+        bool valid = IsVertexValid(x, y, z, rangeMinF, rangeMaxF);
+        if (valid) {
+            float colorT = (float)i / numPoints;
+            mesh.addLineVertex(x, y, z, 1.0f - colorT * 0.5f, 0.3f + colorT * 0.4f, 0.2f + colorT * 0.6f, inLine);
+        }
+        inLine = valid;
     }
+}
 
-    void addUserVariable(const std::string& name, double& value) {
-        symbol_table.add_variable(name, value);
+void MarkPoleCells(ExprEvaluator& eval, const std::vector<double>& heights, size_t nx, size_t strip,
+                   double xMin, double yMin, double step, size_t firstRow, size_t j0, size_t j1,
+                   std::vector<char>& poles) {
+    double x0 = xMin + step * (double)strip;
+    Interval bound;
+    if (!eval.evalInterval(Interval(x0, x0 + step),
+                           Interval(yMin + step * (double)(firstRow + j0), yMin + step * (double)(firstRow + j1)),
+                           Interval(0.0), bound)) {
+        return;
     }
-
-    bool compile(const std::string& xExpr, const std::string& yExpr, const std::string& zExpr) {
-        bool ok = true;
-        ok = ok && parser.compile(xExpr, exprX);
-        ok = ok && parser.compile(yExpr, exprY);
-        ok = ok && parser.compile(zExpr, exprZ);
-        compiled = ok;
-        return ok;
+    if (bound.isBounded() || bound.isEmpty()) return;
+    if (j1 - j0 > 1) {
+        size_t mid = (j0 + j1) / 2;
+        MarkPoleCells(eval, heights, nx, strip, xMin, yMin, step, firstRow, j0, mid, poles);
+        MarkPoleCells(eval, heights, nx, strip, xMin, yMin, step, firstRow, mid, j1, poles);
+        return;
     }
-
-    void eval(double t, double& x, double& y, double& z) {
-        T = t;
-        x = exprX.value();
-        y = exprY.value();
-        z = exprZ.value();
+    double corners[4] = {
+        heights[j0 * nx + strip], heights[j0 * nx + strip + 1],
+        heights[j1 * nx + strip], heights[j1 * nx + strip + 1]
+    };
+    double lo = corners[0], hi = corners[0];
+    bool finite = true;
+    for (double c : corners) {
+        finite = finite && std::isfinite(c);
+        lo = std::min(lo, c);
+        hi = std::max(hi, c);
     }
-};
-
-ParametricEvaluator* g_paramEvaluator = nullptr;
-
-inline bool IsInRange(float val, float rangeMin, float rangeMax) {
-    const float MARGIN = 5.0f;
-    return val >= rangeMin - MARGIN && val <= rangeMax + MARGIN && std::isfinite(val);
+    if (!finite || (lo < 0.0 && hi > 0.0)) poles[j0 * (nx - 1) + strip] = 1;
 }
 
-inline bool IsVertexValid(float x, float y, float z, float rangeMin, float rangeMax) {
-    return IsInRange(x, rangeMin, rangeMax) && 
-           IsInRange(y, rangeMin, rangeMax) && 
-           IsInRange(z, rangeMin, rangeMax);
+void SamplePointsParallel(ExprEvaluator& eval, const double* xs, const double* ys, double* out, size_t count) {
+    SyncWorkerEvaluators(eval);
+    size_t chunks = (size_t)WorkerPool::Instance().workerCount() * 4;
+    size_t grain = std::max<size_t>(256, count / chunks);
+    ParallelFor(count, grain, [&](size_t begin, size_t end, unsigned worker) {
+        if (BuildCancelled()) return;
+        ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+        local.evalPoints(xs + begin, ys + begin, out + begin, end - begin);
+    });
 }
 
-void BuildParametricDisplayList(ParametricEvaluator& eval, double tMin, double tMax, int numPoints = 2000) {
-    if (g_displayList != 0) {
-        glDeleteLists(g_displayList, 1);
-    }
-    g_displayList = glGenLists(1);
-    glNewList(g_displayList, GL_COMPILE);
-    
-    glLineWidth(3.0f);
-    bool inLine = false;
-    float rangeMinF = (float)g_range_min;
-    float rangeMaxF = (float)g_range_max;
-    
-    for (int i = 0; i <= numPoints; ++i) {
-        double t = tMin + (tMax - tMin) * (i / (double)numPoints);
-        double x, y, z;
-        eval.eval(t, x, y, z);
-        
-        if (IsVertexValid((float)x, (float)y, (float)z, rangeMinF, rangeMaxF)) {
-            if (!inLine) { glBegin(GL_LINE_STRIP); inLine = true; }
-            float colorT = (float)i / numPoints;
-            glColor3f(1.0f - colorT * 0.5f, 0.3f + colorT * 0.4f, 0.2f + colorT * 0.6f);
-            glVertex3f((float)x, (float)y, (float)z);
-        } else {
-            if (inLine) { glEnd(); inLine = false; }
+// Quadtree over the g_step lattice. Cells are refined level by level, so each
+// level's new samples go through one batched evaluation; lattice points are
+// keyed by their integer coordinates and never evaluated twice.
+struct AdaptiveSurface {
+    struct Cell {
+        uint32_t i, j, size;
+    };
+
+    ExprEvaluator* eval;
+    double rangeMin;
+    double step;
+    double tolerance;
+    float rangeMinF, rangeMaxF;
+    std::unordered_map<uint64_t, uint32_t> lookup;
+    std::vector<double> xs, ys, heights;
+    std::vector<char> valid;
+    std::vector<uint32_t> vertexOf;
+    size_t evaluated = 0;
+
+    static uint64_t Key(uint32_t i, uint32_t j) { return ((uint64_t)i << 32) | j; }
+
+    uint32_t sample(uint32_t i, uint32_t j) {
+        auto it = lookup.emplace(Key(i, j), (uint32_t)xs.size());
+        if (it.second) {
+            xs.push_back(rangeMin + step * (double)i);
+            ys.push_back(rangeMin + step * (double)j);
         }
+        return it.first->second;
     }
-    if (inLine) glEnd();
-    
-    glEndList();
-    g_cacheValid = true;
-}
 
-void DrawParametricCurve() {
-    if (g_displayList != 0) {
-        glCallList(g_displayList);
+    uint32_t find(uint32_t i, uint32_t j) const {
+        auto it = lookup.find(Key(i, j));
+        return it == lookup.end() ? UINT32_MAX : it->second;
     }
-}
 
-void BuildSurfaceDisplayList(ExprEvaluator& eval, double rangeMin, double rangeMax, double step) {
-    if (g_displayList != 0) {
-        glDeleteLists(g_displayList, 1);
+    // Evaluates the requested points up to end.
+    void flush(size_t end) {
+        size_t count = end - evaluated;
+        heights.resize(xs.size());
+        valid.resize(xs.size());
+        if (count == 0) return;
+        SamplePointsParallel(*eval, xs.data() + evaluated, ys.data() + evaluated, heights.data() + evaluated, count);
+        for (size_t n = evaluated; n < end; ++n) {
+            valid[n] = IsVertexValid((float)xs[n], (float)ys[n], (float)heights[n], rangeMinF, rangeMaxF);
+        }
+        evaluated = end;
     }
-    g_displayList = glGenLists(1);
-    glNewList(g_displayList, GL_COMPILE);
-    
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    float rangeMinF = (float)rangeMin;
-    float rangeMaxF = (float)rangeMax;
 
-    for (double x = rangeMin; x < rangeMax; x += step) {
-        bool inStrip = false;
-        for (double y = rangeMin; y <= rangeMax; y += step) {
-            double z1 = eval.eval(x, y);
-            double z2 = eval.eval(x + step, y);
-            float x1f = (float)x, y1f = (float)y, z1f = (float)z1;
-            float x2f = (float)(x + step), y2f = (float)y, z2f = (float)z2;
-
-            bool v1Valid = IsVertexValid(x1f, y1f, z1f, rangeMinF, rangeMaxF);
-            bool v2Valid = IsVertexValid(x2f, y2f, z2f, rangeMinF, rangeMaxF);
-
-            if (v1Valid && v2Valid) {
-                if (!inStrip) { glBegin(GL_TRIANGLE_STRIP); inStrip = true; }
-                glColor3f(0.2f + (float)((z1 + 5.0) / 20.0), 0.4f, 0.7f - (float)((z1 + 5.0) / 40.0));
-                glVertex3f(x1f, y1f, z1f);
-                glColor3f(0.2f + (float)((z2 + 5.0) / 20.0), 0.4f, 0.7f - (float)((z2 + 5.0) / 40.0));
-                glVertex3f(x2f, y2f, z2f);
-            } else {
-                if (inStrip) { glEnd(); inStrip = false; }
-            }
+    void requestChildren(const Cell& c) {
+        uint32_t h = c.size / 2;
+        sample(c.i + h, c.j);
+        sample(c.i + c.size, c.j + h);
+        sample(c.i + h, c.j + c.size);
+        sample(c.i, c.j + h);
+        sample(c.i + h, c.j + h);
+    }
+
+    bool needsRefine(const Cell& c) {
+        uint32_t h = c.size / 2;
+        uint32_t a = find(c.i, c.j), b = find(c.i + c.size, c.j);
+        uint32_t d = find(c.i, c.j + c.size), e = find(c.i + c.size, c.j + c.size);
+        uint32_t mids[5] = { find(c.i + h, c.j), find(c.i + c.size, c.j + h), find(c.i + h, c.j + c.size),
+                             find(c.i, c.j + h), find(c.i + h, c.j + h) };
+        uint32_t all[9] = { a, b, d, e, mids[0], mids[1], mids[2], mids[3], mids[4] };
+        int validCount = 0;
+        double lo = 0.0, hi = 0.0;
+        for (uint32_t s : all) {
+            if (!valid[s]) continue;
+            if (validCount == 0) lo = hi = heights[s];
+            lo = std::min(lo, heights[s]);
+            hi = std::max(hi, heights[s]);
+            ++validCount;
         }
-        if (inStrip) glEnd();
+        if (validCount == 0) return false;
+        if (validCount < 9) return true;
+
+        const double* z = heights.data();
+        double err = 0.0;
+        err = std::max(err, fabs(z[mids[0]] - 0.5 * (z[a] + z[b])));
+        err = std::max(err, fabs(z[mids[1]] - 0.5 * (z[b] + z[e])));
+        err = std::max(err, fabs(z[mids[2]] - 0.5 * (z[d] + z[e])));
+        err = std::max(err, fabs(z[mids[3]] - 0.5 * (z[a] + z[d])));
+        err = std::max(err, fabs(z[mids[4]] - 0.25 * (z[a] + z[b] + z[d] + z[e])));
+        if (err > tolerance) return true;
+
+        Interval bound;
+        Interval bx(xs[a], xs[b]), by(ys[a], ys[d]);
+        if (eval->evalInterval(bx, by, Interval(0.0), bound)) {
+            if (!bound.isBounded() || bound.lo < lo - tolerance || bound.hi > hi + tolerance) return true;
+        }
+        return false;
     }
-    
-    glEndList();
-    g_cacheValid = true;
-}
 
-void DrawSurface() {
-    if (g_displayList != 0) {
-        glCallList(g_displayList);
+    uint32_t vertex(uint32_t s, SurfaceMesh& mesh) {
+        if (vertexOf[s] != UINT32_MAX) return vertexOf[s];
+        CachedVertex v;
+        v.x = (float)xs[s];
+        v.y = (float)ys[s];
+        v.z = (float)heights[s];
+        HeightColor(heights[s], v.r, v.g, v.b);
+        v.a = 1.0f;
+        vertexOf[s] = (uint32_t)mesh.vertices.size();
+        mesh.vertices.push_back(v);
+        return vertexOf[s];
     }
-}
 
-void BuildImplicitDisplayList(ExprEvaluator& eval, double rangeMin, double rangeMax, double step) {
-    if (g_displayList != 0) {
-        glDeleteLists(g_displayList, 1);
+    void emitTriangle(uint32_t a, uint32_t b, uint32_t c, SurfaceMesh& mesh) {
+        if (!valid[a] || !valid[b] || !valid[c]) return;
+        mesh.indices.push_back(vertex(a, mesh));
+        mesh.indices.push_back(vertex(b, mesh));
+        mesh.indices.push_back(vertex(c, mesh));
     }
-    g_displayList = glGenLists(1);
-    glNewList(g_displayList, GL_COMPILE);
-    
-    glLineWidth(3.0f);
-    glColor3f(1.0f, 0.8f, 0.2f);
 
-    std::string formula = eval.originalFormula;
-    std::string cleanFormula = formula;
-    cleanFormula.erase(std::remove_if(cleanFormula.begin(), cleanFormula.end(), ::isspace), cleanFormula.end());
+    // Finest cells split into two triangles. Larger leaves fan around their
+    // centre through every sampled point on their boundary; neighbours see
+    // the same points on a shared edge, so the mesh has no T-junction cracks.
+    void emitLeaf(const Cell& c, SurfaceMesh& mesh, std::vector<uint32_t>& ring) {
+        if (c.size == 1) {
+            uint32_t a = find(c.i, c.j), b = find(c.i + 1, c.j);
+            uint32_t d = find(c.i, c.j + 1), e = find(c.i + 1, c.j + 1);
+            emitTriangle(a, b, d, mesh);
+            emitTriangle(d, b, e, mesh);
+            return;
+        }
+        ring.clear();
+        for (uint32_t k = 0; k < c.size; ++k) {
+            uint32_t s = find(c.i + k, c.j);
+            if (s != UINT32_MAX) ring.push_back(s);
+        }
+        for (uint32_t k = 0; k < c.size; ++k) {
+            uint32_t s = find(c.i + c.size, c.j + k);
+            if (s != UINT32_MAX) ring.push_back(s);
+        }
+        for (uint32_t k = c.size; k > 0; --k) {
+            uint32_t s = find(c.i + k, c.j + c.size);
+            if (s != UINT32_MAX) ring.push_back(s);
+        }
+        for (uint32_t k = c.size; k > 0; --k) {
+            uint32_t s = find(c.i, c.j + k);
+            if (s != UINT32_MAX) ring.push_back(s);
+        }
+        uint32_t center = find(c.i + c.size / 2, c.j + c.size / 2);
+        for (size_t k = 0; k < ring.size(); ++k) {
+            emitTriangle(center, ring[k], ring[(k + 1) % ring.size()], mesh);
+        }
+    }
+};
 
-    std::string lowerFormula = cleanFormula;
-    std::transform(lowerFormula.begin(), lowerFormula.end(), lowerFormula.begin(), ::tolower);
+// Progress of BuildAdaptiveSurfaceMesh: the quadtree so far, the level being
+// refined and the leaves found.
+struct AdaptiveBuild {
+    BuildCursor cursor;
+    AdaptiveSurface surface;
+    std::vector<AdaptiveSurface::Cell> level, next, leaves;
+    std::vector<uint32_t> ring;
+    std::vector<double> normals;
+};
 
-    size_t eqPos = lowerFormula.find('=');
-    if (eqPos != std::string::npos && eqPos > 0 && eqPos < lowerFormula.length() - 1) {
-        std::string left = lowerFormula.substr(0, eqPos);
-        std::string right = lowerFormula.substr(eqPos + 1);
-        left.erase(std::remove_if(left.begin(), left.end(), ::isspace), left.end());
-        right.erase(std::remove_if(right.begin(), right.end(), ::isspace), right.end());
+AdaptiveBuild g_adaptiveBuild;
 
-        if (left.length() == 1 && (left[0] == 'x' || left[0] == 'y' || left[0] == 'z')) {
-            char leftVar = left[0];
-            bool hasX = right.find('x') != std::string::npos;
-            bool hasY = right.find('y') != std::string::npos;
-            bool hasZ = right.find('z') != std::string::npos;
-            int varCount = (hasX ? 1 : 0) + (hasY ? 1 : 0) + (hasZ ? 1 : 0);
+// Each level's requests, evaluation and refinement tests go in batches, as do
+// the leaves, so in a build slice it may stop early with g_buildPaused set;
+// the next call carries on.
+size_t BuildAdaptiveSurfaceMesh(ExprEvaluator& eval, double rangeMin, double rangeMax, double step,
+                                double tolerance, SurfaceMesh& mesh) {
+    enum Stage { Request = 1, Flush, Refine, Emit, Normals, Release = Normals + 3 };
+    AdaptiveBuild& build = g_adaptiveBuild;
+    BuildCursor& cursor = build.cursor;
+    AdaptiveSurface& surface = build.surface;
+    auto& level = build.level;
+    auto& next = build.next;
+    auto& leaves = build.leaves;
+    if (!cursor.resumes()) {
+        mesh.reset(MeshPrimitive::Triangles, 1.0f);
+        size_t cellsPerSide = (size_t)std::ceil((rangeMax - rangeMin) / step - 1e-9);
+        if (cellsPerSide == 0) return 0;
+        uint32_t rootSize = 1;
+        while (rootSize < 64 && (size_t)rootSize * 2 * 8 <= cellsPerSide) rootSize *= 2;
+        uint32_t roots = (uint32_t)((cellsPerSide + rootSize - 1) / rootSize);
 
-            if (varCount == 2 && eval.hasRightSideExpression) {
-                glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-                float rangeMinF = (float)rangeMin;
-                float rangeMaxF = (float)rangeMax;
+        surface.rangeMin = rangeMin;
+        surface.step = step;
+        surface.tolerance = tolerance;
+        surface.rangeMinF = (float)rangeMin;
+        surface.rangeMaxF = (float)rangeMax;
+        surface.lookup.clear();
+        surface.xs.clear();
+        surface.ys.clear();
+        surface.heights.clear();
+        surface.valid.clear();
+        surface.evaluated = 0;
 
-                char var1 = '?', var2 = '?';
-                if (hasX && leftVar != 'x') { var1 = 'x'; }
-                if (hasY && leftVar != 'y') { if (var1 == '?') var1 = 'y'; else var2 = 'y'; }
-                if (hasZ && leftVar != 'z') { if (var1 == '?') var1 = 'z'; else var2 = 'z'; }
+        level.clear();
+        leaves.clear();
+        for (uint32_t j = 0; j < roots; ++j) {
+            for (uint32_t i = 0; i < roots; ++i) {
+                level.push_back({ i * rootSize, j * rootSize, rootSize });
+            }
+        }
+        for (uint32_t j = 0; j <= roots; ++j) {
+            for (uint32_t i = 0; i <= roots; ++i) surface.sample(i * rootSize, j * rootSize);
+        }
+        cursor.start(Request);
+    }
+    surface.eval = &eval;
 
-                if (leftVar == 'y' && var1 == 'x' && var2 == 'z') {
-                    for (double x = rangeMin; x < rangeMax; x += step) {
-                        bool inStrip = false;
-                        for (double z = rangeMin; z <= rangeMax; z += step) {
-                            double y1 = eval.evalRightSide(x, 0.0, z);
-                            double y2 = eval.evalRightSide(x + step, 0.0, z);
-                            float x1f = (float)x, y1f = (float)y1, z1f = (float)z;
-                            float x2f = (float)(x + step), y2f = (float)y2, z2f = (float)z;
-                            bool v1Valid = IsVertexValid(x1f, y1f, z1f, rangeMinF, rangeMaxF);
-                            bool v2Valid = IsVertexValid(x2f, y2f, z2f, rangeMinF, rangeMaxF);
-                            if (v1Valid && v2Valid) {
-                                if (!inStrip) { glBegin(GL_TRIANGLE_STRIP); inStrip = true; }
-                                glColor3f(0.2f + (float)((y1 + 5.0) / 20.0), 0.4f, 0.7f - (float)((y1 + 5.0) / 40.0));
-                                glVertex3f(x1f, y1f, z1f);
-                                glColor3f(0.2f + (float)((y2 + 5.0) / 20.0), 0.4f, 0.7f - (float)((y2 + 5.0) / 40.0));
-                                glVertex3f(x2f, y2f, z2f);
-                            } else {
-                                if (inStrip) { glEnd(); inStrip = false; }
-                            }
+    while (cursor.stage == Request || cursor.stage == Flush || cursor.stage == Refine) {
+        if (cursor.stage == Request) {
+            if (level.empty()) {
+                // A vertex per sample at most, and a planar mesh has fewer
+                // than two triangles per vertex.
+                surface.vertexOf.assign(surface.xs.size(), UINT32_MAX);
+                mesh.vertices.reserve(surface.xs.size());
+                mesh.indices.reserve(surface.xs.size() * 6);
+                cursor.enter(Emit);
+                break;
+            }
+            if (BuildCancelled()) return surface.evaluated;
+            bool done = RunSliced(cursor, level.size(), [&](size_t first, size_t last) {
+                for (size_t k = first; k < last; ++k) {
+                    if (level[k].size > 1) surface.requestChildren(level[k]);
+                }
+            });
+            if (!done) return surface.evaluated;
+            cursor.enter(Flush);
+            cursor.next = surface.evaluated;
+        }
+        if (cursor.stage == Flush) {
+            bool done = RunSliced(cursor, surface.xs.size(), [&](size_t, size_t last) { surface.flush(last); });
+            if (!done) return surface.evaluated;
+            surface.flush(surface.xs.size());
+            next.clear();
+            cursor.enter(Refine);
+        }
+        bool done = RunSliced(cursor, level.size(), [&](size_t first, size_t last) {
+            for (size_t k = first; k < last; ++k) {
+                const AdaptiveSurface::Cell& c = level[k];
+                if (c.size > 1 && surface.needsRefine(c)) {
+                    uint32_t h = c.size / 2;
+                    next.push_back({ c.i, c.j, h });
+                    next.push_back({ c.i + h, c.j, h });
+                    next.push_back({ c.i, c.j + h, h });
+                    next.push_back({ c.i + h, c.j + h, h });
+                } else {
+                    leaves.push_back(c);
+                }
+            }
+        });
+        if (!done) return surface.evaluated;
+        level.swap(next);
+        cursor.enter(Request);
+    }
+
+    if (cursor.stage == Emit) {
+        bool done = RunSliced(cursor, leaves.size(), [&](size_t first, size_t last) {
+            for (size_t k = first; k < last; ++k) surface.emitLeaf(leaves[k], mesh, build.ring);
+        });
+        if (!done) return surface.evaluated;
+        cursor.enter(Normals);
+    }
+    if (cursor.stage < Release) {
+        if (!ComputeNormalsSliced(mesh, cursor, Normals, build.normals)) return surface.evaluated;
+        cursor.enter(Release);
+    }
+
+    // The lookup is emptied in batches too, as freeing a large one at once
+    // takes longer than a frame; the vectors keep their capacity.
+    bool done = RunSliced(cursor, cursor.next + surface.lookup.size(), [&](size_t first, size_t last) {
+        auto end = surface.lookup.begin();
+        std::advance(end, last - first);
+        surface.lookup.erase(surface.lookup.begin(), end);
+    });
+    if (done) cursor.finish();
+    return surface.evaluated;
+}
+
+// A step between neighbouring grid points may hide a jump when it exceeds this
+// part of the visible range and is more than kJumpRatio times the steps beside
+// it, or runs against them. Cells with such a step are resampled kRefineCells
+// times finer before meshing.
+const double kJumpFraction = 0.25;
+const double kJumpRatio = 4.0;
+const size_t kRefineCells = 8;
+
+// How many cells MeshHeightGrid may resample finer. Pole cells have their own
+// allowance, twice the cells along the grid's border, so a few asymptotes
+// across the grid are refined along their whole length. The other suspects
+// may at most double the cost of the grid; each cell row gets its share, and
+// what a row leaves unused carries on to the next. The budget is spent row by
+// row, so meshing a grid in one go or in bands makes the same choices.
+struct HeightGridBudget {
+    size_t poleCells = 0;
+    size_t cells = 0;
+    size_t cellRows = 0;
+    size_t spent = 0;
+    // Which cells of the last meshed cell row were drawn coarse, for the next band.
+    std::vector<char> drawn;
+};
+
+void BeginRefineBudget(size_t nx, size_t ny, HeightGridBudget& budget) {
+    budget.poleCells = nx > 1 && ny > 1 ? 4 * (nx - 1 + ny - 1) : 0;
+    budget.cells = nx * ny / ((kRefineCells + 1) * (kRefineCells + 1));
+    budget.cellRows = ny > 1 ? ny - 1 : 0;
+    budget.spent = 0;
+    budget.drawn.clear();
+}
+
+// Work buffers of MeshHeightGrid. One set lives per thread and keeps its
+// capacity, so rebuilding a grid of the same size allocates nothing.
+struct HeightGridScratch {
+    std::vector<char> poles;
+    std::vector<char> validCorners;
+    std::vector<char> drawn;
+    std::vector<char> fineBreaks;
+    std::vector<std::pair<double, size_t>> suspects;
+    std::vector<std::pair<size_t, size_t>> refined;
+    std::vector<double> xs;
+    std::vector<double> ys;
+    std::vector<double> fineHeights;
+};
+
+// Meshes an nx x ny band of a height grid. Band row j is grid row firstRow + j,
+// and point (i, j) sits at (x0 + step * i, y0 + step * (firstRow + j)). A cell
+// is suspect when the interval test finds a pole in it, when its corners jump,
+// or when only some corners can be drawn. Suspect cells are resampled on a
+// finer lattice. Sub-cells that still jump, or that change sign across an
+// unbounded interval, are left out. The mesh is split along the discontinuity,
+// not bridged or cut a whole cell wide. Returns the number of extra evaluations.
+//
+// Only cell rows [cellRow0, cellRow1) are meshed, and they must follow the rows
+// the budget has seen. The band rows around them are a halo from the
+// neighbouring bands: one row below and two above give the edge vertices
+// central normals and the jump test its neighbouring steps, and let the first
+// cell row of the next band be decided ahead, so the refinement knows which
+// neighbour cells are drawn coarse and bands meet without a seam.
+size_t MeshHeightGrid(ExprEvaluator& eval, const std::vector<double>& heights, size_t nx, size_t ny,
+                      size_t firstRow, size_t cellRow0, size_t cellRow1, double x0, double y0, double step,
+                      double rangeMin, double rangeMax, HeightGridBudget& budget, SurfaceMesh& mesh) {
+    thread_local HeightGridScratch scratch;
+    size_t numStrips = nx - 1;
+    size_t cells = ny > 1 ? numStrips * (ny - 1) : 0;
+    std::vector<char>& poles = scratch.poles;
+    poles.assign(cells, 0);
+    if (ny > 1) {
+        for (size_t i = 0; i < numStrips; ++i) {
+            MarkPoleCells(eval, heights, nx, i, x0, y0, step, firstRow, 0, ny - 1, poles);
+        }
+    }
+
+    float rangeMinF = (float)rangeMin;
+    float rangeMaxF = (float)rangeMax;
+    double jumpLimit = (rangeMax - rangeMin) * kJumpFraction;
+    auto rowY = [&](size_t j) { return y0 + step * (double)(firstRow + j); };
+    auto drawable = [&](size_t i, size_t j) {
+        size_t n = j * nx + i;
+        return IsVertexValid((float)(x0 + step * (double)i), (float)rowY(j), (float)heights[n],
+                             rangeMinF, rangeMaxF);
+    };
+    auto spread = [](const double* c, size_t count) {
+        double lo = INFINITY, hi = -INFINITY;
+        for (size_t k = 0; k < count; ++k) {
+            if (!std::isfinite(c[k])) continue;
+            lo = std::min(lo, c[k]);
+            hi = std::max(hi, c[k]);
+        }
+        return hi >= lo ? hi - lo : 0.0;
+    };
+    // The step from point n to n + stride, where k of count points lie before
+    // n along that axis, or 0 when it is no jump. A smooth surface changes its
+    // slope gradually, so a steep step is only a jump when the step beside it
+    // is much shallower or goes the other way.
+    auto stepJump = [&](size_t n, size_t stride, size_t k, size_t count) {
+        double d = heights[n + stride] - heights[n];
+        if (!std::isfinite(d) || std::fabs(d) <= jumpLimit) return 0.0;
+        auto steady = [&](double beside) {
+            return beside * d > 0.0 && std::fabs(d) <= kJumpRatio * std::fabs(beside);
+        };
+        if (k > 0 && steady(heights[n] - heights[n - stride])) return 0.0;
+        if (k + 2 < count && steady(heights[n + 2 * stride] - heights[n + stride])) return 0.0;
+        return std::fabs(d);
+    };
+    auto cellJump = [&](size_t i, size_t j) {
+        size_t n = j * nx + i;
+        return std::max(std::max(stepJump(n, 1, i, nx), stepJump(n + nx, 1, i, nx)),
+                        std::max(stepJump(n, nx, j, ny), stepJump(n + 1, nx, j, ny)));
+    };
+
+    // Cell rows are decided in order. Poles are taken up to their own
+    // allowance and left out past it. The row's other suspects, the largest
+    // jumps first and then cells that merely leave the range, ties by column,
+    // are refined up to the row's share of the budget and drawn coarse past it.
+    const size_t m = kRefineCells + 1;
+    std::vector<std::pair<double, size_t>>& suspects = scratch.suspects;
+    std::vector<char>& validCorners = scratch.validCorners;
+    std::vector<char>& drawn = scratch.drawn;
+    std::vector<std::pair<size_t, size_t>>& refined = scratch.refined;
+    validCorners.assign(cells, 0);
+    for (size_t j = 0; j + 1 < ny; ++j) {
+        for (size_t i = 0; i < numStrips; ++i) {
+            int valid = (int)drawable(i, j) + (int)drawable(i + 1, j) + (int)drawable(i, j + 1) + (int)drawable(i + 1, j + 1);
+            validCorners[j * numStrips + i] = (char)valid;
+        }
+    }
+    drawn.assign(cells, 0);
+    refined.clear();
+    auto decideRow = [&](size_t j, size_t& poleCells, size_t& spent, bool meshed) {
+        suspects.clear();
+        for (size_t i = 0; i < numStrips; ++i) {
+            size_t c = j * numStrips + i;
+            int valid = validCorners[c];
+            if (valid == 0) continue;
+            if (poles[c]) {
+                if (poleCells == 0) continue;
+                --poleCells;
+                if (meshed) refined.emplace_back(i, j);
+                continue;
+            }
+            double jump = cellJump(i, j);
+            if (jump > 0.0) suspects.emplace_back(jump, i);
+            else if (valid < 4) suspects.emplace_back(0.0, i);
+            else drawn[c] = 1;
+        }
+        std::sort(suspects.begin(), suspects.end(),
+                  [](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+                      return a.first != b.first ? a.first > b.first : a.second < b.second;
+                  });
+        size_t share = budget.cells * (firstRow + j + 1) / budget.cellRows - spent;
+        size_t taken = std::min(suspects.size(), share);
+        spent += taken;
+        for (size_t k = 0; k < suspects.size(); ++k) {
+            size_t c = j * numStrips + suspects[k].second;
+            if (k >= taken) {
+                drawn[c] = validCorners[c] == 4;
+                continue;
+            }
+            poles[c] = 1;
+            if (meshed) refined.emplace_back(suspects[k].second, j);
+        }
+    };
+    if (cellRow0 > 0 && budget.drawn.size() == numStrips) {
+        std::copy(budget.drawn.begin(), budget.drawn.end(), drawn.begin() + (cellRow0 - 1) * numStrips);
+    }
+    for (size_t j = cellRow0; j < cellRow1; ++j) decideRow(j, budget.poleCells, budget.spent, true);
+    if (cellRow1 + 1 < ny) {
+        size_t poleCells = budget.poleCells, spent = budget.spent;
+        decideRow(cellRow1, poleCells, spent, false);
+    }
+    if (cellRow1 > cellRow0) {
+        budget.drawn.assign(drawn.begin() + (cellRow1 - 1) * numStrips, drawn.begin() + cellRow1 * numStrips);
+    }
+    std::fill(poles.begin(), poles.begin() + std::min(cellRow0 * numStrips, cells), 1);
+    if (cellRow1 * numStrips < cells) std::fill(poles.begin() + cellRow1 * numStrips, poles.end(), 1);
+
+    BuildHeightMesh(heights.data(), nx, ny, firstRow, x0, y0, step, 0, 1, poles.data(), rangeMinF, rangeMaxF, mesh);
+    if (refined.empty()) return 0;
+
+    const size_t perCell = m * m;
+    double fine = step / (double)kRefineCells;
+    std::vector<double>& xs = scratch.xs;
+    std::vector<double>& ys = scratch.ys;
+    std::vector<double>& fineHeights = scratch.fineHeights;
+    xs.resize(refined.size() * perCell);
+    ys.resize(xs.size());
+    fineHeights.resize(xs.size());
+    for (size_t r = 0; r < refined.size(); ++r) {
+        double cx = x0 + step * (double)refined[r].first;
+        double cy = rowY(refined[r].second);
+        for (size_t v = 0; v < m; ++v) {
+            for (size_t u = 0; u < m; ++u) {
+                xs[r * perCell + v * m + u] = cx + fine * (double)u;
+                ys[r * perCell + v * m + u] = cy + fine * (double)v;
+            }
+        }
+    }
+    SamplePointsParallel(eval, xs.data(), ys.data(), fineHeights.data(), xs.size());
+    if (BuildCancelled()) return xs.size();
+
+    std::vector<char>& fineBreaks = scratch.fineBreaks;
+    fineBreaks.resize((m - 1) * (m - 1));
+    for (size_t r = 0; r < refined.size(); ++r) {
+        size_t i = refined[r].first, j = refined[r].second;
+        double* h = fineHeights.data() + r * perCell;
+
+        // Where the neighbour across an edge is drawn coarse, the border samples
+        // follow its straight edge so no crack opens between the two.
+        auto snap = [&](size_t first, size_t stride, double a, double b) {
+            for (size_t k = 0; k < m; ++k) h[first + stride * k] = a + (b - a) * (double)k / (double)kRefineCells;
+        };
+        const double h00 = heights[j * nx + i], h10 = heights[j * nx + i + 1];
+        const double h01 = heights[(j + 1) * nx + i], h11 = heights[(j + 1) * nx + i + 1];
+        size_t c = j * numStrips + i;
+        if (j > 0 && drawn[c - numStrips]) snap(0, 1, h00, h10);
+        if (j + 2 < ny && drawn[c + numStrips]) snap((m - 1) * m, 1, h01, h11);
+        if (i > 0 && drawn[c - 1]) snap(0, m, h00, h01);
+        if (i + 1 < numStrips && drawn[c + 1]) snap(m - 1, m, h10, h11);
+
+        const double corners[4] = { h00, h10, h01, h11 };
+        double limit = std::max(jumpLimit, 0.5 * spread(corners, 4));
+        double cx = x0 + step * (double)i;
+        double cy = rowY(j);
+        for (size_t u = 0; u + 1 < m; ++u) {
+            for (size_t v = 0; v + 1 < m; ++v) {
+                const double sub[4] = { h[v * m + u], h[v * m + u + 1], h[(v + 1) * m + u], h[(v + 1) * m + u + 1] };
+                double lo = std::min(std::min(sub[0], sub[1]), std::min(sub[2], sub[3]));
+                double hi = std::max(std::max(sub[0], sub[1]), std::max(sub[2], sub[3]));
+                bool split = hi - lo > limit;
+                if (!split && lo < 0.0 && hi > 0.0) {
+                    Interval bound;
+                    split = eval.evalInterval(Interval(cx + fine * (double)u, cx + fine * (double)(u + 1)),
+                                              Interval(cy + fine * (double)v, cy + fine * (double)(v + 1)),
+                                              Interval(0.0), bound) &&
+                            !bound.isBounded() && !bound.isEmpty();
+                }
+                fineBreaks[v * (m - 1) + u] = split;
+            }
+        }
+        AppendHeightPatch(h, m, m, cx, cy, fine, 0, 1, fineBreaks.data(), rangeMinF, rangeMaxF, mesh);
+    }
+    return xs.size();
+}
+
+size_t MeshHeightGrid(ExprEvaluator& eval, const std::vector<double>& heights, size_t nx, size_t ny,
+                      double x0, double y0, double step, double rangeMin, double rangeMax, SurfaceMesh& mesh) {
+    thread_local HeightGridBudget budget;
+    BeginRefineBudget(nx, ny, budget);
+    return MeshHeightGrid(eval, heights, nx, ny, 0, 0, ny > 0 ? ny - 1 : 0, x0, y0, step, rangeMin, rangeMax,
+                          budget, mesh);
+}
+
+// Recently sampled explicit-surface grids for the current formula, backend and
+// variable values. Grids are matched by world-space lattice, so a range or step
+// change copies every point an older grid already holds and evaluates only the
+// rest. Halving the step, for example, reuses every other point.
+struct SampleCacheGrid {
+    double x0 = 0.0;
+    double y0 = 0.0;
+    double step = 0.0;
+    size_t nx = 0;
+    size_t ny = 0;
+    std::vector<double> heights;
+};
+
+struct SampleCache {
+    std::string formula;
+    EvalBackend backend = EvalBackend::Exprtk;
+    std::vector<double> varValues;
+    std::list<SampleCacheGrid> grids;
+    // Retired grids whose nodes and buffers are handed out again. One is kept
+    // between stores, so a steady rebuild finds a buffer without allocating.
+    std::list<SampleCacheGrid> spare;
+    size_t samples = 0;
+};
+
+const size_t kSampleCacheGrids = 4;
+const size_t kSampleCacheSamples = (size_t)1 << 23;
+SampleCache g_sampleCache;
+
+bool SampleCacheMatches(const ExprEvaluator& eval) {
+    const SampleCache& cache = g_sampleCache;
+    if (cache.formula != eval.originalFormula || cache.backend != eval.backend ||
+        cache.varValues.size() != eval.userBindings.size()) {
+        return false;
+    }
+    for (size_t k = 0; k < cache.varValues.size(); ++k) {
+        if (cache.varValues[k] != *eval.userBindings[k].second) return false;
+    }
+    return true;
+}
+
+// Takes a fully sampled grid by swapping buffers: heights comes back holding
+// a retired grid's buffer, usually of the same size, so the caller can sample
+// into it next time without allocating. A grid for another formula or other
+// variable values replaces everything cached so far.
+void StoreSampleGrid(const ExprEvaluator& eval, double x0, double y0, double step, size_t nx, size_t ny,
+                     std::vector<double>& heights) {
+    SampleCache& cache = g_sampleCache;
+    if (!SampleCacheMatches(eval)) {
+        cache.formula = eval.originalFormula;
+        cache.backend = eval.backend;
+        cache.varValues.resize(eval.userBindings.size());
+        for (size_t k = 0; k < cache.varValues.size(); ++k) cache.varValues[k] = *eval.userBindings[k].second;
+        cache.spare.splice(cache.spare.end(), cache.grids);
+        cache.samples = 0;
+    }
+    for (auto it = cache.grids.begin(); it != cache.grids.end(); ++it) {
+        if (it->x0 == x0 && it->y0 == y0 && it->step == step && it->nx == nx && it->ny == ny) {
+            cache.samples -= it->heights.size();
+            cache.spare.splice(cache.spare.begin(), cache.grids, it);
+            break;
+        }
+    }
+    if (cache.spare.empty()) cache.spare.emplace_back();
+    cache.grids.splice(cache.grids.begin(), cache.spare, cache.spare.begin());
+    SampleCacheGrid& grid = cache.grids.front();
+    grid.x0 = x0;
+    grid.y0 = y0;
+    grid.step = step;
+    grid.nx = nx;
+    grid.ny = ny;
+    grid.heights.swap(heights);
+    cache.samples += grid.heights.size();
+    while (cache.grids.size() > 1 &&
+           (cache.grids.size() > kSampleCacheGrids || cache.samples > kSampleCacheSamples)) {
+        cache.samples -= cache.grids.back().heights.size();
+        cache.spare.splice(cache.spare.end(), cache.grids, std::prev(cache.grids.end()));
+    }
+    while (cache.spare.size() > 1) cache.spare.pop_back();
+}
+
+// Maps each of count lattice coordinates origin + step * i to its index on
+// the cached axis, or SIZE_MAX when it falls between or outside cached samples.
+void MapCachedAxis(double origin, double step, size_t count, double cachedOrigin, double cachedStep,
+                   size_t cachedCount, std::vector<size_t>& map) {
+    map.assign(count, SIZE_MAX);
+    for (size_t i = 0; i < count; ++i) {
+        double t = (origin + step * (double)i - cachedOrigin) / cachedStep;
+        double k = std::round(t);
+        if (std::fabs(t - k) < 1e-6 && k >= 0.0 && k < (double)cachedCount) map[i] = (size_t)k;
+    }
+}
+
+// Where each row and column of a new grid lies in the cached grids, newest
+// first. PlanCachedGrid builds it; SampleCachedRows then fills rows from it,
+// so a build may take the grid in one call or in bands.
+struct CachedGridPlan {
+    double rangeMin = 0.0;
+    double step = 0.0;
+    size_t nx = 0;
+    size_t ny = 0;
+    std::vector<const SampleCacheGrid*> grids;
+    std::vector<std::vector<size_t>> cols;
+    std::vector<std::vector<size_t>> rows;
+    std::vector<char> have;
+    std::vector<size_t> missing;
+    std::vector<double> xs;
+    std::vector<double> ys;
+    std::vector<double> values;
+};
+
+// Plans an nx x ny grid over the sample cache. Returns false when less than a
+// quarter of the grid is cached, which still admits halving the step; the
+// caller should then take the normal sampling path. A cached sample is copied
+// when it lies within 1e-6 of a cell of the new lattice point, so it was taken
+// at the cached lattice's coordinate and may differ from a fresh sample when
+// the two coordinates round differently. The plan points into g_sampleCache
+// and is spent once the next grid is stored.
+bool PlanCachedGrid(const ExprEvaluator& eval, double rangeMin, double step, size_t nx, size_t ny,
+                    CachedGridPlan& plan) {
+    if (!SampleCacheMatches(eval) || g_sampleCache.grids.empty()) return false;
+    plan.rangeMin = rangeMin;
+    plan.step = step;
+    plan.nx = nx;
+    plan.ny = ny;
+    plan.grids.clear();
+    for (const SampleCacheGrid& grid : g_sampleCache.grids) plan.grids.push_back(&grid);
+    plan.cols.resize(plan.grids.size());
+    plan.rows.resize(plan.grids.size());
+    for (size_t g = 0; g < plan.grids.size(); ++g) {
+        const SampleCacheGrid& grid = *plan.grids[g];
+        MapCachedAxis(rangeMin, step, nx, grid.x0, grid.step, grid.nx, plan.cols[g]);
+        MapCachedAxis(rangeMin, step, ny, grid.y0, grid.step, grid.ny, plan.rows[g]);
+    }
+
+    // A point is cached when some grid holds both its row and its column.
+    // Columns are counted by the set of grids holding them, so each row costs
+    // one pass over the sets rather than over the columns.
+    size_t columnsHeldBy[(size_t)1 << kSampleCacheGrids] = {};
+    for (size_t i = 0; i < nx; ++i) {
+        size_t set = 0;
+        for (size_t g = 0; g < plan.grids.size(); ++g) {
+            if (plan.cols[g][i] != SIZE_MAX) set |= (size_t)1 << g;
+        }
+        ++columnsHeldBy[set];
+    }
+    size_t reused = 0;
+    for (size_t j = 0; j < ny; ++j) {
+        size_t rowSet = 0;
+        for (size_t g = 0; g < plan.grids.size(); ++g) {
+            if (plan.rows[g][j] != SIZE_MAX) rowSet |= (size_t)1 << g;
+        }
+        for (size_t set = 1; rowSet && set < ((size_t)1 << plan.grids.size()); ++set) {
+            if (set & rowSet) reused += columnsHeldBy[set];
+        }
+    }
+    return reused * 4 >= nx * ny;
+}
+
+// Fills rows [r0, r1) of a planned grid into out, which points at row r0.
+// Cached points are copied from the newest grid holding them and the rest are
+// evaluated in one batch. Returns the number of evaluations.
+size_t SampleCachedRows(ExprEvaluator& eval, CachedGridPlan& plan, size_t r0, size_t r1, double* out) {
+    size_t nx = plan.nx;
+    std::vector<char>& have = plan.have;
+    std::vector<size_t>& missing = plan.missing;
+    std::vector<double>& xs = plan.xs;
+    std::vector<double>& ys = plan.ys;
+    std::vector<double>& values = plan.values;
+    missing.clear();
+    xs.clear();
+    ys.clear();
+    for (size_t j = r0; j < r1; ++j) {
+        double* row = out + (j - r0) * nx;
+        have.assign(nx, 0);
+        for (size_t g = 0; g < plan.grids.size(); ++g) {
+            if (plan.rows[g][j] == SIZE_MAX) continue;
+            const SampleCacheGrid& grid = *plan.grids[g];
+            const double* src = grid.heights.data() + plan.rows[g][j] * grid.nx;
+            const std::vector<size_t>& cols = plan.cols[g];
+            for (size_t i = 0; i < nx; ++i) {
+                if (cols[i] == SIZE_MAX || have[i]) continue;
+                row[i] = src[cols[i]];
+                have[i] = 1;
+            }
+        }
+        for (size_t i = 0; i < nx; ++i) {
+            if (have[i]) continue;
+            missing.push_back((j - r0) * nx + i);
+            xs.push_back(plan.rangeMin + plan.step * (double)i);
+            ys.push_back(plan.rangeMin + plan.step * (double)j);
+        }
+    }
+    values.resize(xs.size());
+    SamplePointsParallel(eval, xs.data(), ys.data(), values.data(), values.size());
+    for (size_t k = 0; k < missing.size(); ++k) out[missing[k]] = values[k];
+    return values.size();
+}
+
+// Fills a whole grid from the sample cache; see PlanCachedGrid.
+bool SampleGridCached(ExprEvaluator& eval, double rangeMin, double step, size_t nx, size_t ny, double* out,
+                      size_t& evaluated) {
+    thread_local CachedGridPlan plan;
+    if (!PlanCachedGrid(eval, rangeMin, step, nx, ny, plan)) return false;
+    evaluated = SampleCachedRows(eval, plan, 0, ny, out);
+    return true;
+}
+
+// Coarse-to-fine sampling of a new explicit surface. Level s samples the
+// lattice points whose indices are multiples of s; only the points missing
+// from level 2s are evaluated, so the three levels together cost one full grid.
+struct ProgressiveSurface {
+    std::string formula;
+    EvalBackend backend = EvalBackend::Exprtk;
+    double rangeMin = 0.0;
+    double rangeMax = 0.0;
+    double step = 0.0;
+    std::vector<double> varValues;
+    size_t nextStride = 0;
+    size_t sampledStride = 0;
+    size_t evaluations = 0;
+    size_t nx = 0;
+    size_t ny = 0;
+    std::vector<double> heights;
+    std::vector<double> level;
+    std::vector<double> scratch;
+    std::vector<double> xs;
+    std::vector<double> ys;
+};
+
+const size_t kPreviewStride = 4;
+ProgressiveSurface g_progressive;
+
+void SampleProgressiveLevel(ExprEvaluator& eval, ProgressiveSurface& p, size_t stride) {
+    size_t cx = (p.nx - 1) / stride + 1;
+    size_t cy = (p.ny - 1) / stride + 1;
+    // Samples columns i0 + di * k of rows j0 + dj * k.
+    auto sample = [&](size_t i0, size_t di, size_t count, size_t j0, size_t dj, size_t rows) {
+        LatticeCoordinates(p.rangeMin, p.step, i0, di, count, p.xs);
+        LatticeCoordinates(p.rangeMin, p.step, j0, dj, rows, p.ys);
+        SampleGridParallel(eval, p.xs.data(), count, p.ys.data(), rows, p.scratch.data());
+    };
+    auto scatter = [&](size_t i0, size_t di, size_t count, size_t j0, size_t dj, size_t rows) {
+        for (size_t j = 0; j < rows; ++j) {
+            for (size_t i = 0; i < count; ++i) {
+                p.heights[(j0 + j * dj) * p.nx + i0 + i * di] = p.scratch[j * count + i];
+            }
+        }
+        p.evaluations += count * rows;
+    };
+    if (p.sampledStride != stride * 2) {
+        p.scratch.resize(cx * cy);
+        sample(0, stride, cx, 0, stride, cy);
+        scatter(0, stride, cx, 0, stride, cy);
+    } else {
+        size_t oddRows = cy / 2, evenRows = (cy + 1) / 2, oddCols = cx / 2;
+        p.scratch.resize(std::max(cx * oddRows, oddCols * evenRows));
+        if (oddRows > 0) {
+            sample(0, stride, cx, stride, stride * 2, oddRows);
+            scatter(0, stride, cx, stride, stride * 2, oddRows);
+        }
+        if (oddCols > 0) {
+            sample(stride, stride * 2, oddCols, 0, stride * 2, evenRows);
+            scatter(stride, stride * 2, oddCols, 0, stride * 2, evenRows);
+        }
+    }
+    p.sampledStride = stride;
+}
+
+// Returns false while a coarser preview is shown and finer levels remain.
+bool BuildSurfaceMesh(ExprEvaluator& eval, double rangeMin, double rangeMax, double step,
+                      SurfaceTessellation tessellation, double tolerance, SurfaceMesh& mesh) {
+    if (tessellation == SurfaceTessellation::Adaptive) {
+        g_buildEvaluations = BuildAdaptiveSurfaceMesh(eval, rangeMin, rangeMax, step, tolerance, mesh);
+        return true;
+    }
+    size_t numStrips = (size_t)std::ceil((rangeMax - rangeMin) / step - 1e-9);
+    size_t nx = numStrips + 1;
+    size_t ny = GridCount(rangeMin, rangeMax, step);
+
+    ProgressiveSurface& p = g_progressive;
+    bool sameGrid = p.formula == eval.originalFormula && p.backend == eval.backend &&
+                    p.rangeMin == rangeMin && p.rangeMax == rangeMax && p.step == step;
+    bool sameVars = p.varValues.size() == eval.userBindings.size();
+    for (size_t k = 0; sameVars && k < p.varValues.size(); ++k) {
+        sameVars = p.varValues[k] == *eval.userBindings[k].second;
+    }
+    p.formula = eval.originalFormula;
+    p.backend = eval.backend;
+    p.rangeMin = rangeMin;
+    p.rangeMax = rangeMax;
+    p.step = step;
+    p.varValues.resize(eval.userBindings.size());
+    for (size_t k = 0; k < p.varValues.size(); ++k) p.varValues[k] = *eval.userBindings[k].second;
+    if (!sameGrid) {
+        // A range or step change over the same formula usually overlaps the
+        // previous grids; then only the new points are evaluated, in one pass.
+        std::vector<double>& heights = p.heights;
+        heights.resize(nx * ny);
+        size_t evaluated = 0;
+        if (SampleGridCached(eval, rangeMin, step, nx, ny, heights.data(), evaluated)) {
+            if (BuildCancelled()) {
+                p.formula.clear();
+                return false;
+            }
+            p.nextStride = 0;
+            g_buildEvaluations = evaluated + MeshHeightGrid(eval, heights, nx, ny, rangeMin, rangeMin, step,
+                                                            rangeMin, rangeMax, mesh);
+            StoreSampleGrid(eval, rangeMin, rangeMin, step, nx, ny, heights);
+            return true;
+        }
+        p.nextStride = kPreviewStride;
+        p.sampledStride = 0;
+        p.evaluations = 0;
+    } else if (!sameVars) {
+        p.nextStride = 0;
+    }
+    while (p.nextStride > 1 && (numStrips / p.nextStride < 2 || ny / p.nextStride < 2)) p.nextStride /= 2;
+
+    if (p.nextStride == 0) {
+        // Rebuilding an unchanged grid (another mesher, another build mode)
+        // takes it back from the sample cache; p.heights was handed to the
+        // cache by the previous store and no longer holds it.
+        std::vector<double>& heights = p.heights;
+        heights.resize(nx * ny);
+        size_t evaluated = nx * ny;
+        if (!SampleGridCached(eval, rangeMin, step, nx, ny, heights.data(), evaluated)) {
+            SampleSurfaceGrid(eval, rangeMin, step, nx, ny, heights.data());
+        }
+        if (BuildCancelled()) return true;
+        g_buildEvaluations = evaluated + MeshHeightGrid(eval, heights, nx, ny, rangeMin, rangeMin, step,
+                                                      rangeMin, rangeMax, mesh);
+        StoreSampleGrid(eval, rangeMin, rangeMin, step, nx, ny, heights);
+        return true;
+    }
+
+    size_t stride = p.nextStride;
+    p.nx = nx;
+    p.ny = ny;
+    p.heights.resize(nx * ny);
+    SampleProgressiveLevel(eval, p, stride);
+    if (BuildCancelled()) {
+        p.formula.clear();
+        return false;
+    }
+    g_buildEvaluations = p.evaluations;
+    p.nextStride = stride / 2;
+
+    if (stride == 1) {
+        g_buildEvaluations += MeshHeightGrid(eval, p.heights, nx, ny, rangeMin, rangeMin, step, rangeMin, rangeMax, mesh);
+        StoreSampleGrid(eval, rangeMin, rangeMin, step, nx, ny, p.heights);
+        return true;
+    }
+    size_t cx = (nx - 1) / stride + 1;
+    size_t cy = (ny - 1) / stride + 1;
+    p.level.resize(cx * cy);
+    for (size_t j = 0; j < cy; ++j) {
+        for (size_t i = 0; i < cx; ++i) p.level[j * cx + i] = p.heights[j * stride * nx + i * stride];
+    }
+    g_buildEvaluations += MeshHeightGrid(eval, p.level, cx, cy, rangeMin, rangeMin, step * (double)stride,
+                                         rangeMin, rangeMax, mesh);
+    return false;
+}
+
+// Tiled terrain splits the domain into a quadtree of square tiles. Every tile
+// is sampled on the same (kTileCells + 1)^2 lattice, so each level halves the
+// sample spacing; the deepest level reaches the step setting.
+const size_t kTileCells = 64;
+const int kMaxTileLevel = 16;
+
+struct TileKey {
+    int level = 0;
+    int32_t ix = 0;
+    int32_t iy = 0;
+
+    bool operator==(const TileKey& other) const {
+        return level == other.level && ix == other.ix && iy == other.iy;
+    }
+
+    TileKey parent() const { return { level - 1, ix / 2, iy / 2 }; }
+    TileKey child(int k) const { return { level + 1, ix * 2 + (k & 1), iy * 2 + (k >> 1) }; }
+};
+
+struct TileKeyHash {
+    size_t operator()(const TileKey& key) const {
+        return std::hash<uint64_t>()(((uint64_t)key.level << 40) ^ ((uint64_t)(uint32_t)key.ix << 20) ^ (uint32_t)key.iy);
+    }
+};
+
+struct TerrainLayout {
+    double origin = 0.0;
+    double span = 0.0;
+    int maxLevel = 0;
+
+    TerrainLayout() {}
+
+    TerrainLayout(double rangeMin, double rangeMax, double step) : origin(rangeMin), span(rangeMax - rangeMin) {
+        while (maxLevel < kMaxTileLevel && spacing(maxLevel) > step) ++maxLevel;
+    }
+
+    double tileSize(int level) const { return span / (double)(1u << level); }
+    double spacing(int level) const { return tileSize(level) / (double)kTileCells; }
+};
+
+struct TerrainTileMesh {
+    TileKey key;
+    SurfaceMesh mesh;
+    float zMin = 0.0f;
+    float zMax = 0.0f;
+};
+
+// Samples and triangulates one tile. Returns false when a newer build request
+// interrupted the sampling.
+bool BuildTerrainTile(ExprEvaluator& eval, const TerrainLayout& layout, double rangeMin, double rangeMax,
+                      TerrainTileMesh& tile) {
+    const size_t n = kTileCells + 1;
+    double size = layout.tileSize(tile.key.level);
+    double step = layout.spacing(tile.key.level);
+    double x0 = layout.origin + size * (double)tile.key.ix;
+    double y0 = layout.origin + size * (double)tile.key.iy;
+
+    std::vector<double> xs, ys;
+    LatticeCoordinates(x0, step, 0, 1, n, xs);
+    LatticeCoordinates(y0, step, 0, 1, n, ys);
+    std::vector<double> heights(n * n);
+    SampleGridParallel(eval, xs.data(), n, ys.data(), n, heights.data());
+    if (BuildCancelled()) return false;
+
+    MeshHeightGrid(eval, heights, n, n, x0, y0, step, rangeMin, rangeMax, tile.mesh);
+    if (BuildCancelled()) return false;
+
+    tile.zMin = (float)rangeMax;
+    tile.zMax = (float)rangeMin;
+    for (const auto& v : tile.mesh.vertices) {
+        tile.zMin = std::min(tile.zMin, v.z);
+        tile.zMax = std::max(tile.zMax, v.z);
+    }
+
+    // A coarser neighbour interpolates across every other border sample, so
+    // the gap along a shared edge is at most one border step in height.
+    double depth = step;
+    for (size_t k = 0; k + 1 < n; ++k) {
+        const size_t edges[4][2] = {
+            { k, k + 1 }, { (n - 1) * n + k, (n - 1) * n + k + 1 },
+            { k * n, (k + 1) * n }, { k * n + n - 1, (k + 1) * n + n - 1 }
+        };
+        for (const auto& e : edges) {
+            double d = fabs(heights[e[1]] - heights[e[0]]);
+            if (std::isfinite(d)) depth = std::max(depth, d + step);
+        }
+    }
+    AddHeightMeshSkirt(n, n, 2, (float)std::min(depth, rangeMax - rangeMin), tile.mesh);
+    std::vector<uint32_t>().swap(tile.mesh.remap);
+    return true;
+}
+
+// Marching cubes. Cube corner c sits at offset (c & 1, c >> 1 & 1, c >> 2 & 1);
+// edge a * 4 + m runs along axis a from corner CubeEdgeStart(a, m). The case
+// table is built once by walking the cube faces: on each face the crossed edges
+// are joined in pairs, and a face with two diagonal inside corners always cuts
+// the inside corners off. Neighbouring cubes see the same signs on a shared
+// face and so join it the same way, which keeps the surface free of cracks.
+struct CubeCase {
+    uint8_t count = 0;
+    uint8_t edges[18];
+};
+
+int CubeEdgeStart(int axis, int m) {
+    int other0 = (axis + 1) % 3;
+    int other1 = (axis + 2) % 3;
+    return ((m & 1) << other0) | ((m >> 1 & 1) << other1);
+}
+
+void CubeEdgeCorners(int edge, int& c0, int& c1) {
+    int axis = edge / 4;
+    c0 = CubeEdgeStart(axis, edge % 4);
+    c1 = c0 | (1 << axis);
+}
+
+struct CubeCaseTable {
+    CubeCase cases[256];
+    CubeCaseTable();
+};
+
+CubeCaseTable::CubeCaseTable() {
+    for (int mask = 0; mask < 256; ++mask) {
+        auto inside = [&](int c) { return (mask >> c & 1) != 0; };
+        int link[12][2];
+        int links[12] = {};
+        auto join = [&](int e0, int e1) {
+            link[e0][links[e0]++] = e1;
+            link[e1][links[e1]++] = e0;
+        };
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int side = 0; side < 2; ++side) {
+                int crossed[4];
+                int count = 0;
+                for (int e = 0; e < 12; ++e) {
+                    int c0, c1;
+                    CubeEdgeCorners(e, c0, c1);
+                    if (e / 4 == axis || (c0 >> axis & 1) != side || inside(c0) == inside(c1)) continue;
+                    crossed[count++] = e;
+                }
+                if (count == 2) join(crossed[0], crossed[1]);
+                if (count != 4) continue;
+                for (int c = 0; c < 8; ++c) {
+                    if ((c >> axis & 1) != side || !inside(c)) continue;
+                    int pair[2];
+                    int found = 0;
+                    for (int k = 0; k < 4; ++k) {
+                        int c0, c1;
+                        CubeEdgeCorners(crossed[k], c0, c1);
+                        if (c0 == c || c1 == c) pair[found++] = crossed[k];
+                    }
+                    join(pair[0], pair[1]);
+                }
+            }
+        }
+
+        CubeCase& out = cases[mask];
+        bool visited[12] = {};
+        for (int start = 0; start < 12; ++start) {
+            if (links[start] != 2 || visited[start]) continue;
+            int loop[12];
+            int length = 0;
+            int prev = -1;
+            int e = start;
+            do {
+                visited[e] = true;
+                loop[length++] = e;
+                int next = link[e][0] == prev ? link[e][1] : link[e][0];
+                prev = e;
+                e = next;
+            } while (e != start);
+
+            // Orient the loop so its normal points from inside corners to outside.
+            double mid[12][3];
+            double outward[3] = { 0.0, 0.0, 0.0 };
+            for (int k = 0; k < length; ++k) {
+                int c0, c1;
+                CubeEdgeCorners(loop[k], c0, c1);
+                for (int a = 0; a < 3; ++a) {
+                    double p0 = (double)(c0 >> a & 1);
+                    double p1 = (double)(c1 >> a & 1);
+                    mid[k][a] = 0.5 * (p0 + p1);
+                    outward[a] += inside(c0) ? p1 - p0 : p0 - p1;
+                }
+            }
+            double normal[3] = { 0.0, 0.0, 0.0 };
+            for (int k = 0; k < length; ++k) {
+                const double* p = mid[k];
+                const double* q = mid[(k + 1) % length];
+                normal[0] += (p[1] - q[1]) * (p[2] + q[2]);
+                normal[1] += (p[2] - q[2]) * (p[0] + q[0]);
+                normal[2] += (p[0] - q[0]) * (p[1] + q[1]);
+            }
+            if (normal[0] * outward[0] + normal[1] * outward[1] + normal[2] * outward[2] < 0.0) {
+                std::reverse(loop, loop + length);
+            }
+            for (int k = 1; k + 1 < length; ++k) {
+                out.edges[out.count++] = (uint8_t)loop[0];
+                out.edges[out.count++] = (uint8_t)loop[k];
+                out.edges[out.count++] = (uint8_t)loop[k + 1];
+            }
+        }
+    }
+}
+
+const CubeCase* CubeCases() {
+    static const CubeCaseTable table;
+    return table.cases;
+}
+
+// The lattice is cut into slabs of cube layers along z, one slab per task.
+// Within a slab, slices of node values from the implicit volume roll upwards,
+// and only tiles of kImplicitTileCells^2 cubes the volume marks live are
+// visited. Each slab records the vertices it shares with the slabs below and
+// above, so the slabs are welded where they meet when they are merged.
+const size_t kImplicitMaxCells = 256;
+const size_t kImplicitTileCells = 16;
+const uint32_t kNoImplicitVertex = UINT32_MAX;
+
+struct ImplicitSlab {
+    std::vector<CachedVertex> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<std::pair<uint32_t, uint32_t>> bottom;
+    std::vector<std::pair<uint32_t, uint32_t>> top;
+    size_t evaluations = 0;
+};
+
+struct ImplicitSlabScratch {
+    std::vector<char> needed;
+    std::vector<uint32_t> nodes;
+    std::vector<double> values[2];
+    std::vector<uint32_t> xEdges[2];
+    std::vector<uint32_t> yEdges[2];
+    std::vector<uint32_t> zEdges;
+    std::vector<uint32_t> cellVertices[2];
+};
+
+std::vector<ImplicitSlab> g_implicitSlabs;
+
+// Cube layers per slab in a build slice, where a few slabs must fit a frame.
+const size_t kSlicedSlabCells = 2;
+
+// Progress of BuildImplicitSurface, which goes through the volume update, the
+// slabs, the merge and the normals in turn.
+struct ImplicitSurfaceBuild {
+    BuildCursor cursor;
+    size_t n = 0;
+    double cellStep = 0.0;
+    size_t slabs = 0;
+    size_t slabCells = 0;
+    size_t evaluations = 0;
+    std::vector<uint32_t> seam;
+    std::vector<double> normals;
+};
+
+ImplicitSurfaceBuild g_implicitBuild;
+
+CachedVertex ImplicitVertex(const double p[3], double rangeMin, double rangeMax) {
+    float colorT = (float)((p[0] - rangeMin) / (rangeMax - rangeMin));
+    return { (float)p[0], (float)p[1], (float)p[2], 1.0f - colorT * 0.3f, 0.7f, 0.3f + colorT * 0.4f, 1.0f,
+             0, 0, 127, 0 };
+}
+
+// Field values of the lattice, kept between builds of the same formula,
+// variables, range and cell size so a new iso-level is extracted without
+// evaluating again. The lattice is split into blocks of kImplicitTileCells^3
+// cubes. A block's nodes are evaluated the first time it may hold the level;
+// its value range then decides that, and before that its interval bound does.
+struct ImplicitVolume {
+    BuildCursor cursor;
+    std::string formula;
+    EvalBackend backend = EvalBackend::Exprtk;
+    std::vector<double> varValues;
+    double rangeMin = 0.0;
+    double cellStep = 0.0;
+    size_t n = 0;
+    size_t blocks = 0;
+    double iso = 0.0;
+    std::vector<float> values;
+    std::vector<char> evaluated;
+    std::vector<char> bounded;
+    std::vector<Interval> bounds;
+    std::vector<float> blockMin;
+    std::vector<float> blockMax;
+    std::vector<char> live;
+};
+
+ImplicitVolume g_implicitVolume;
+
+// Marks the blocks that may hold f = iso and evaluates the nodes not yet in
+// the volume, adding the point evaluations to evaluations. Each pass goes over
+// the blocks in batches; returns false when the build slice ran out.
+bool UpdateImplicitVolume(ExprEvaluator& eval, double rangeMin, double cellStep, size_t n, double iso,
+                          size_t& evaluations) {
+    enum Stage { Grow = 1, Bounds, Evaluate, Ranges };
+    ImplicitVolume& v = g_implicitVolume;
+    BuildCursor& cursor = v.cursor;
+    size_t cells = n - 1;
+    size_t blocks = (cells + kImplicitTileCells - 1) / kImplicitTileCells;
+    size_t count = blocks * blocks * blocks;
+    if (!cursor.resumes()) {
+        bool same = v.formula == eval.originalFormula && v.backend == eval.backend && v.rangeMin == rangeMin &&
+                    v.cellStep == cellStep && v.n == n && v.varValues.size() == eval.userBindings.size();
+        for (size_t k = 0; same && k < v.varValues.size(); ++k) same = v.varValues[k] == *eval.userBindings[k].second;
+        if (!same) {
+            v.formula = eval.originalFormula;
+            v.backend = eval.backend;
+            v.varValues.resize(eval.userBindings.size());
+            for (size_t k = 0; k < v.varValues.size(); ++k) v.varValues[k] = *eval.userBindings[k].second;
+            v.rangeMin = rangeMin;
+            v.cellStep = cellStep;
+            v.n = n;
+            v.blocks = blocks;
+            if (v.values.size() != n * n * n) {
+                v.values.clear();
+                v.values.reserve(n * n * n);
+            }
+            v.evaluated.assign(count, 0);
+            v.bounded.assign(count, 0);
+            v.bounds.resize(count);
+            v.blockMin.resize(count);
+            v.blockMax.resize(count);
+        }
+        v.iso = iso;
+        v.live.assign(count, 0);
+        cursor.start(Grow);
+    }
+    // A new lattice grows a layer at a time, which spreads its page faults.
+    if (cursor.stage == Grow) {
+        cursor.next = std::max(cursor.next, v.values.size() / (n * n));
+        if (!RunSliced(cursor, n, [&](size_t, size_t last) { v.values.resize(last * n * n); })) return false;
+        cursor.enter(Bounds);
+    }
+
+    auto coord = [&](size_t i) { return rangeMin + cellStep * (double)i; };
+    auto blockNodes = [&](size_t b, size_t lo[3], size_t hi[3]) {
+        size_t index[3] = { b % blocks, b / blocks % blocks, b / (blocks * blocks) };
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = index[a] * kImplicitTileCells;
+            hi[a] = std::min(cells, lo[a] + kImplicitTileCells);
+        }
+    };
+    SyncWorkerEvaluators(eval);
+    if (cursor.stage == Bounds) {
+        bool done = RunSliced(cursor, count, [&](size_t from, size_t to) {
+            ParallelFor(to - from, 16, [&](size_t begin, size_t end, unsigned worker) {
+                ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+                for (size_t b = from + begin; b < from + end; ++b) {
+                    if (v.evaluated[b]) {
+                        v.live[b] = v.blockMin[b] < iso && v.blockMax[b] >= iso;
+                        continue;
+                    }
+                    if (!v.bounded[b]) {
+                        size_t lo[3], hi[3];
+                        blockNodes(b, lo, hi);
+                        if (!local.evalInterval(Interval(coord(lo[0]), coord(hi[0])), Interval(coord(lo[1]), coord(hi[1])),
+                                                Interval(coord(lo[2]), coord(hi[2])), v.bounds[b])) {
+                            v.bounds[b] = Interval::Entire();
                         }
-                        if (inStrip) glEnd();
+                        v.bounded[b] = 1;
                     }
-                    glEndList();
-                    g_cacheValid = true;
-                    return;
+                    const Interval& bound = v.bounds[b];
+                    v.live[b] = !(bound.isEmpty() || bound.lo > iso || bound.hi < iso);
                 }
-                else if (leftVar == 'x' && var1 == 'y' && var2 == 'z') {
-                    for (double y = rangeMin; y < rangeMax; y += step) {
-                        bool inStrip = false;
-                        for (double z = rangeMin; z <= rangeMax; z += step) {
-                            double x1 = eval.evalRightSide(0.0, y, z);
-                            double x2 = eval.evalRightSide(0.0, y + step, z);
-                            float x1f = (float)x1, y1f = (float)y, z1f = (float)z;
-                            float x2f = (float)x2, y2f = (float)(y + step), z2f = (float)z;
-                            bool v1Valid = IsVertexValid(x1f, y1f, z1f, rangeMinF, rangeMaxF);
-                            bool v2Valid = IsVertexValid(x2f, y2f, z2f, rangeMinF, rangeMaxF);
-                            if (v1Valid && v2Valid) {
-                                if (!inStrip) { glBegin(GL_TRIANGLE_STRIP); inStrip = true; }
-                                glColor3f(0.2f + (float)((x1 + 5.0) / 20.0), 0.4f, 0.7f - (float)((x1 + 5.0) / 40.0));
-                                glVertex3f(x1f, y1f, z1f);
-                                glColor3f(0.2f + (float)((x2 + 5.0) / 20.0), 0.4f, 0.7f - (float)((x2 + 5.0) / 40.0));
-                                glVertex3f(x2f, y2f, z2f);
-                            } else {
-                                if (inStrip) { glEnd(); inStrip = false; }
+            });
+        });
+        if (!done) return false;
+        cursor.enter(Evaluate);
+    }
+
+    // A node shared by several newly live blocks is evaluated by the first of
+    // them, and not at all if a block holding it was evaluated before.
+    auto fresh = [&](size_t b) { return v.live[b] && !v.evaluated[b]; };
+    if (cursor.stage == Evaluate) {
+        bool done = RunSliced(cursor, count, [&](size_t from, size_t to) {
+            std::atomic<size_t> batchEvaluations(0);
+            ParallelFor(to - from, 1, [&](size_t begin, size_t end, unsigned worker) {
+                thread_local std::vector<double> xs, ys, zs, results;
+                thread_local std::vector<size_t> slots;
+                ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+                for (size_t b = from + begin; b < from + end && !BuildCancelled(); ++b) {
+                    if (!fresh(b)) continue;
+                    size_t lo[3], hi[3];
+                    blockNodes(b, lo, hi);
+                    xs.clear();
+                    ys.clear();
+                    zs.clear();
+                    slots.clear();
+                    for (size_t k = lo[2]; k <= hi[2]; ++k) {
+                        for (size_t j = lo[1]; j <= hi[1]; ++j) {
+                            for (size_t i = lo[0]; i <= hi[0]; ++i) {
+                                size_t p[3] = { i, j, k };
+                                size_t first[3], last[3];
+                                for (int a = 0; a < 3; ++a) {
+                                    first[a] = p[a] > 0 && p[a] % kImplicitTileCells == 0 ? p[a] / kImplicitTileCells - 1 : p[a] / kImplicitTileCells;
+                                    last[a] = std::min(p[a] / kImplicitTileCells, blocks - 1);
+                                }
+                                bool known = false;
+                                size_t owner = SIZE_MAX;
+                                for (size_t bz = first[2]; bz <= last[2]; ++bz) {
+                                    for (size_t by = first[1]; by <= last[1]; ++by) {
+                                        for (size_t bx = first[0]; bx <= last[0]; ++bx) {
+                                            size_t c = (bz * blocks + by) * blocks + bx;
+                                            known = known || v.evaluated[c];
+                                            if (owner == SIZE_MAX && fresh(c)) owner = c;
+                                        }
+                                    }
+                                }
+                                if (known || owner != b) continue;
+                                xs.push_back(coord(i));
+                                ys.push_back(coord(j));
+                                zs.push_back(coord(k));
+                                slots.push_back((k * n + j) * n + i);
                             }
                         }
-                        if (inStrip) glEnd();
                     }
-                    glEndList();
-                    g_cacheValid = true;
-                    return;
+                    results.resize(slots.size());
+                    local.evalPoints(xs.data(), ys.data(), zs.data(), results.data(), slots.size());
+                    for (size_t m = 0; m < slots.size(); ++m) v.values[slots[m]] = (float)results[m];
+                    batchEvaluations += slots.size();
                 }
-                else if (leftVar == 'z' && var1 == 'x' && var2 == 'y') {
-                    for (double x = rangeMin; x < rangeMax; x += step) {
-                        bool inStrip = false;
-                        for (double y = rangeMin; y <= rangeMax; y += step) {
-                            double z1 = eval.evalRightSide(x, y, 0.0);
-                            double z2 = eval.evalRightSide(x + step, y, 0.0);
-                            float x1f = (float)x, y1f = (float)y, z1f = (float)z1;
-                            float x2f = (float)(x + step), y2f = (float)y, z2f = (float)z2;
-                            bool v1Valid = IsVertexValid(x1f, y1f, z1f, rangeMinF, rangeMaxF);
-                            bool v2Valid = IsVertexValid(x2f, y2f, z2f, rangeMinF, rangeMaxF);
-                            if (v1Valid && v2Valid) {
-                                if (!inStrip) { glBegin(GL_TRIANGLE_STRIP); inStrip = true; }
-                                glColor3f(0.2f + (float)((z1 + 5.0) / 20.0), 0.4f, 0.7f - (float)((z1 + 5.0) / 40.0));
-                                glVertex3f(x1f, y1f, z1f);
-                                glColor3f(0.2f + (float)((z2 + 5.0) / 20.0), 0.4f, 0.7f - (float)((z2 + 5.0) / 40.0));
-                                glVertex3f(x2f, y2f, z2f);
-                            } else {
-                                if (inStrip) { glEnd(); inStrip = false; }
-                            }
+            });
+            evaluations += batchEvaluations;
+        }, WorkerPool::Instance().workerCount());
+        if (!done) return false;
+        if (BuildCancelled()) return true;
+        cursor.enter(Ranges);
+    }
+
+    bool done = RunSliced(cursor, count, [&](size_t from, size_t to) {
+        ParallelFor(to - from, 16, [&](size_t begin, size_t end, unsigned) {
+            for (size_t b = from + begin; b < from + end; ++b) {
+                if (!fresh(b)) continue;
+                size_t lo[3], hi[3];
+                blockNodes(b, lo, hi);
+                float low = INFINITY;
+                float high = -INFINITY;
+                for (size_t k = lo[2]; k <= hi[2]; ++k) {
+                    for (size_t j = lo[1]; j <= hi[1]; ++j) {
+                        const float* row = v.values.data() + (k * n + j) * n;
+                        for (size_t i = lo[0]; i <= hi[0]; ++i) {
+                            if (!std::isfinite(row[i])) continue;
+                            low = std::min(low, row[i]);
+                            high = std::max(high, row[i]);
                         }
-                        if (inStrip) glEnd();
                     }
-                    glEndList();
-                    g_cacheValid = true;
-                    return;
                 }
+                v.blockMin[b] = low;
+                v.blockMax[b] = high;
+                v.evaluated[b] = 1;
             }
-            else if (varCount == 1 && eval.hasRightSideExpression) {
-                int numPoints = 400;
-                float rangeMinF = (float)rangeMin;
-                float rangeMaxF = (float)rangeMax;
+        });
+    }, WorkerPool::Instance().workerCount() * 16);
+    if (done) cursor.finish();
+    return done;
+}
 
-                char rightVar = '?';
-                if (hasX && leftVar != 'x') rightVar = 'x';
-                else if (hasY && leftVar != 'y') rightVar = 'y';
-                else if (hasZ && leftVar != 'z') rightVar = 'z';
+// Lists the tiles live in any block of cube layers k0..k1 - 1 and the nodes
+// they touch. Returns false when no tile is live.
+bool PrepareImplicitSlab(const ImplicitVolume& volume, size_t n, size_t k0, size_t k1, ImplicitSlabScratch& s) {
+    size_t cells = n - 1;
+    size_t tiles = volume.blocks;
+    s.needed.assign(n * n, 0);
+    bool anyLive = false;
+    for (size_t ty = 0; ty < tiles; ++ty) {
+        for (size_t tx = 0; tx < tiles; ++tx) {
+            bool live = false;
+            for (size_t bz = k0 / kImplicitTileCells; bz <= (k1 - 1) / kImplicitTileCells; ++bz) {
+                live = live || volume.live[(bz * tiles + ty) * tiles + tx];
+            }
+            if (!live) continue;
+            anyLive = true;
+            size_t i0 = tx * kImplicitTileCells, i1 = std::min(cells, i0 + kImplicitTileCells);
+            size_t j0 = ty * kImplicitTileCells, j1 = std::min(cells, j0 + kImplicitTileCells);
+            for (size_t j = j0; j <= j1; ++j) {
+                std::fill(s.needed.begin() + j * n + i0, s.needed.begin() + j * n + i1 + 1, 1);
+            }
+        }
+    }
+    if (!anyLive) return false;
+
+    s.nodes.clear();
+    for (size_t node = 0; node < n * n; ++node) {
+        if (s.needed[node]) s.nodes.push_back((uint32_t)node);
+    }
+    return true;
+}
 
-                glLineWidth(3.0f);
-                bool inLine = false;
+// Loads the listed nodes of slice k, relative to the iso-level.
+void SampleImplicitSlice(const ImplicitVolume& volume, ImplicitSlabScratch& s, size_t n, size_t k,
+                         std::vector<double>& values) {
+    const float* slice = volume.values.data() + k * n * n;
+    values.resize(n * n);
+    for (uint32_t node : s.nodes) values[node] = (double)slice[node] - volume.iso;
+}
 
-                if (rightVar == 'x' && leftVar == 'y') {
-                    for (int i = 0; i <= numPoints; ++i) {
-                        double x = rangeMin + (rangeMax - rangeMin) * (i / (double)numPoints);
-                        double y = eval.evalRightSide(x, 0.0, 0.0);
-                        if (IsVertexValid((float)x, (float)y, 0.0f, rangeMinF, rangeMaxF)) {
-                            if (!inLine) { glBegin(GL_LINE_STRIP); inLine = true; }
-                            float colorT = (float)i / numPoints;
-                            glColor3f(1.0f - colorT * 0.5f, 0.5f + colorT * 0.3f, 0.2f + colorT * 0.6f);
-                            glVertex3f((float)x, (float)y, 0.0f);
-                        } else {
-                            if (inLine) { glEnd(); inLine = false; }
-                        }
+// Calls cell(i, j) for every cube of layer k in a live block. Nodes of other
+// blocks may hold stale values, so they must not be meshed.
+template <typename F>
+void ForEachLiveCell(const ImplicitVolume& volume, size_t n, size_t k, F&& cell) {
+    size_t cells = n - 1;
+    size_t tiles = volume.blocks;
+    const char* live = volume.live.data() + k / kImplicitTileCells * tiles * tiles;
+    for (size_t ty = 0; ty < tiles; ++ty) {
+        for (size_t tx = 0; tx < tiles; ++tx) {
+            if (!live[ty * tiles + tx]) continue;
+            size_t i1 = std::min(cells, (tx + 1) * kImplicitTileCells);
+            size_t j1 = std::min(cells, (ty + 1) * kImplicitTileCells);
+            for (size_t j = ty * kImplicitTileCells; j < j1; ++j) {
+                for (size_t i = tx * kImplicitTileCells; i < i1; ++i) cell(i, j);
+            }
+        }
+    }
+}
+
+// Sign mask of cube (i, j) between the two value slices; false if a corner is
+// not finite.
+bool ImplicitCubeMask(const ImplicitSlabScratch& s, size_t n, size_t i, size_t j, int& mask) {
+    mask = 0;
+    for (int c = 0; c < 8; ++c) {
+        double v = s.values[c >> 2][(j + (c >> 1 & 1)) * n + i + (c & 1)];
+        if (!std::isfinite(v)) return false;
+        if (v < 0.0) mask |= 1 << c;
+    }
+    return true;
+}
+
+// Fraction along the lattice edge from p along axis at which f crosses iso,
+// given the values v0 and v1 relative to iso at its ends. Starts from linear
+// interpolation and spends up to `steps` evaluations on the Illinois variant of
+// regula falsi, which keeps the root bracketed.
+double RefineEdgeRoot(ExprEvaluator& eval, const double p[3], int axis, double length, double v0, double v1,
+                      double iso, int steps, size_t& evaluations) {
+    double a = 0.0, b = 1.0;
+    double fa = v0, fb = v1;
+    double t = fa / (fa - fb);
+    int kept = 0;
+    for (int step = 0; step < steps; ++step) {
+        double q[3] = { p[0], p[1], p[2] };
+        q[axis] += length * t;
+        double f = eval.evalImplicit(q[0], q[1], q[2]) - iso;
+        ++evaluations;
+        if (!std::isfinite(f) || f == 0.0) break;
+        if ((f < 0.0) == (fa < 0.0)) {
+            a = t;
+            fa = f;
+            if (kept == 1) fb *= 0.5;
+            kept = 1;
+        } else {
+            b = t;
+            fb = f;
+            if (kept == -1) fa *= 0.5;
+            kept = -1;
+        }
+        t = a + (b - a) * (fa / (fa - fb));
+    }
+    return t;
+}
+
+// Marching cubes over cube layers k0..k1. Edge vertices are shared through
+// per-slice index maps; the slabs share the vertices on their boundary slices.
+void MarchImplicitSlab(ExprEvaluator& eval, const ImplicitVolume& volume, double rangeMin, double rangeMax,
+                       double cellStep, size_t n, size_t k0, size_t k1, int refinement, ImplicitSlab& slab) {
+    thread_local ImplicitSlabScratch scratch;
+    ImplicitSlabScratch& s = scratch;
+    const CubeCase* cases = CubeCases();
+    slab.vertices.clear();
+    slab.indices.clear();
+    slab.bottom.clear();
+    slab.top.clear();
+    slab.evaluations = 0;
+    if (!PrepareImplicitSlab(volume, n, k0, k1, s)) return;
+
+    auto coord = [&](size_t i) { return rangeMin + cellStep * (double)i; };
+    for (int slice = 0; slice < 2; ++slice) {
+        s.xEdges[slice].assign(n * n, kNoImplicitVertex);
+        s.yEdges[slice].assign(n * n, kNoImplicitVertex);
+    }
+    s.zEdges.resize(n * n);
+    SampleImplicitSlice(volume, s, n, k0, s.values[0]);
+
+    for (size_t k = k0; k < k1; ++k) {
+        if (BuildCancelled()) return;
+        SampleImplicitSlice(volume, s, n, k + 1, s.values[1]);
+        std::fill(s.zEdges.begin(), s.zEdges.end(), kNoImplicitVertex);
+        for (size_t node : s.nodes) {
+            s.xEdges[1][node] = kNoImplicitVertex;
+            s.yEdges[1][node] = kNoImplicitVertex;
+        }
+
+        auto edgeVertex = [&](size_t i, size_t j, int edge) -> uint32_t {
+            int c0, c1;
+            CubeEdgeCorners(edge, c0, c1);
+            int axis = edge / 4;
+            size_t node = (j + (c0 >> 1 & 1)) * n + i + (c0 & 1);
+            int slice = c0 >> 2 & 1;
+            uint32_t& slot = axis == 2 ? s.zEdges[node] : (axis == 0 ? s.xEdges : s.yEdges)[slice][node];
+            if (slot != kNoImplicitVertex) return slot;
+            double v0 = s.values[slice][node];
+            double v1 = s.values[c1 >> 2 & 1][axis == 0 ? node + 1 : (axis == 1 ? node + n : node)];
+            double p[3] = { coord(i + (c0 & 1)), coord(j + (c0 >> 1 & 1)), coord(k + slice) };
+            p[axis] += cellStep * RefineEdgeRoot(eval, p, axis, cellStep, v0, v1, volume.iso, refinement, slab.evaluations);
+            slot = (uint32_t)slab.vertices.size();
+            slab.vertices.push_back(ImplicitVertex(p, rangeMin, rangeMax));
+            if (axis != 2 && (k + slice == k0 || k + slice == k1)) {
+                uint32_t key = (uint32_t)(axis * n * n + node);
+                (k + slice == k0 ? slab.bottom : slab.top).emplace_back(key, slot);
+            }
+            return slot;
+        };
+
+        ForEachLiveCell(volume, n, k, [&](size_t i, size_t j) {
+            int mask;
+            if (!ImplicitCubeMask(s, n, i, j, mask)) return;
+            const CubeCase& cube = cases[mask];
+            for (int t = 0; t < cube.count; ++t) slab.indices.push_back(edgeVertex(i, j, cube.edges[t]));
+        });
+        s.values[0].swap(s.values[1]);
+        s.xEdges[0].swap(s.xEdges[1]);
+        s.yEdges[0].swap(s.yEdges[1]);
+    }
+}
+
+// Places the dual contouring vertex of a cube from the crossings of its edges
+// and the gradients there: the point closest to all their tangent planes,
+// pulled slightly toward the crossings' centroid so flat and creased patches
+// stay well posed, and clamped to the cube.
+void SolveCubeVertex(ExprEvaluator& eval, const ImplicitSlabScratch& s, size_t n, size_t i, size_t j, int mask,
+                     const double origin[3], double cellStep, double iso, int refinement, size_t& evaluations,
+                     double vertex[3]) {
+    const double kCentroidWeight = 0.05;
+    double ata[3][3] = {};
+    double atb[3] = {};
+    double mass[3] = {};
+    double points[12][3];
+    double normals[12][3];
+    int count = 0;
+    for (int edge = 0; edge < 12; ++edge) {
+        int c0, c1;
+        CubeEdgeCorners(edge, c0, c1);
+        if ((mask >> c0 & 1) == (mask >> c1 & 1)) continue;
+        int axis = edge / 4;
+        double v0 = s.values[c0 >> 2][(j + (c0 >> 1 & 1)) * n + i + (c0 & 1)];
+        double v1 = s.values[c1 >> 2][(j + (c1 >> 1 & 1)) * n + i + (c1 & 1)];
+        double* p = points[count];
+        for (int a = 0; a < 3; ++a) p[a] = origin[a] + cellStep * (double)(c0 >> a & 1);
+        p[axis] += cellStep * RefineEdgeRoot(eval, p, axis, cellStep, v0, v1, iso, refinement, evaluations);
+        double* g = normals[count];
+        eval.evalGradient(p[0], p[1], p[2], g);
+        ++evaluations;
+        double length = std::sqrt(g[0] * g[0] + g[1] * g[1] + g[2] * g[2]);
+        for (int a = 0; a < 3; ++a) {
+            g[a] = length > 0.0 && std::isfinite(length) ? g[a] / length : 0.0;
+            mass[a] += p[a];
+        }
+        ++count;
+    }
+    for (int a = 0; a < 3; ++a) mass[a] /= (double)count;
+    for (int k = 0; k < count; ++k) {
+        const double* g = normals[k];
+        double d = g[0] * (points[k][0] - mass[0]) + g[1] * (points[k][1] - mass[1]) + g[2] * (points[k][2] - mass[2]);
+        for (int a = 0; a < 3; ++a) {
+            for (int b = 0; b < 3; ++b) ata[a][b] += g[a] * g[b];
+            atb[a] += g[a] * d;
+        }
+    }
+    for (int a = 0; a < 3; ++a) ata[a][a] += kCentroidWeight;
+
+    double det = ata[0][0] * (ata[1][1] * ata[2][2] - ata[1][2] * ata[2][1]) -
+                 ata[0][1] * (ata[1][0] * ata[2][2] - ata[1][2] * ata[2][0]) +
+                 ata[0][2] * (ata[1][0] * ata[2][1] - ata[1][1] * ata[2][0]);
+    for (int a = 0; a < 3; ++a) {
+        double m[3][3];
+        for (int r = 0; r < 3; ++r) {
+            for (int c = 0; c < 3; ++c) m[r][c] = c == a ? atb[r] : ata[r][c];
+        }
+        double da = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                    m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                    m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        double x = mass[a] + da / det;
+        if (!std::isfinite(x)) x = mass[a];
+        vertex[a] = std::min(origin[a] + cellStep, std::max(origin[a], x));
+    }
+}
+
+// Dual contouring over cube layers k0..k1: one vertex per cube the surface
+// crosses, and a quad around every crossed lattice edge. An edge on slice k
+// joins cubes of layers k - 1 and k, so a slab also solves the layer below its
+// own (its neighbour solves the same vertices from the same values) and shares
+// the vertices of that layer and of its top layer with the adjacent slabs.
+void ContourImplicitSlab(ExprEvaluator& eval, const ImplicitVolume& volume, double rangeMin, double rangeMax,
+                         double cellStep, size_t n, size_t k0, size_t k1, int refinement, ImplicitSlab& slab) {
+    thread_local ImplicitSlabScratch scratch;
+    ImplicitSlabScratch& s = scratch;
+    slab.vertices.clear();
+    slab.indices.clear();
+    slab.bottom.clear();
+    slab.top.clear();
+    slab.evaluations = 0;
+    size_t kFirst = k0 > 0 ? k0 - 1 : 0;
+    if (!PrepareImplicitSlab(volume, n, kFirst, k1, s)) return;
+
+    auto coord = [&](size_t i) { return rangeMin + cellStep * (double)i; };
+    s.cellVertices[0].assign(n * n, kNoImplicitVertex);
+    s.cellVertices[1].resize(n * n);
+    SampleImplicitSlice(volume, s, n, kFirst, s.values[0]);
+
+    auto quad = [&](uint32_t a, uint32_t b, uint32_t c, uint32_t d, bool flip) {
+        if (a == kNoImplicitVertex || b == kNoImplicitVertex || c == kNoImplicitVertex || d == kNoImplicitVertex) return;
+        if (flip) std::swap(b, d);
+        // Split along the shorter diagonal.
+        auto dist2 = [&](uint32_t u, uint32_t v) {
+            const CachedVertex& p = slab.vertices[u];
+            const CachedVertex& q = slab.vertices[v];
+            return (p.x - q.x) * (p.x - q.x) + (p.y - q.y) * (p.y - q.y) + (p.z - q.z) * (p.z - q.z);
+        };
+        const uint32_t split[2][6] = { { a, b, c, a, c, d }, { a, b, d, b, c, d } };
+        const uint32_t* t = split[dist2(a, c) <= dist2(b, d) ? 0 : 1];
+        slab.indices.insert(slab.indices.end(), t, t + 6);
+    };
+
+    for (size_t k = kFirst; k < k1; ++k) {
+        if (BuildCancelled()) return;
+        SampleImplicitSlice(volume, s, n, k + 1, s.values[1]);
+        std::vector<uint32_t>& below = s.cellVertices[0];
+        std::vector<uint32_t>& layer = s.cellVertices[1];
+        std::fill(layer.begin(), layer.end(), kNoImplicitVertex);
+        ForEachLiveCell(volume, n, k, [&](size_t i, size_t j) {
+            int mask;
+            if (!ImplicitCubeMask(s, n, i, j, mask) || mask == 0 || mask == 255) return;
+            double origin[3] = { coord(i), coord(j), coord(k) };
+            double p[3];
+            SolveCubeVertex(eval, s, n, i, j, mask, origin, cellStep, volume.iso, refinement, slab.evaluations, p);
+            uint32_t id = (uint32_t)slab.vertices.size();
+            layer[j * n + i] = id;
+            slab.vertices.push_back(ImplicitVertex(p, rangeMin, rangeMax));
+            if (k + 1 == k0) slab.bottom.emplace_back((uint32_t)(j * n + i), id);
+            if (k + 1 == k1) slab.top.emplace_back((uint32_t)(j * n + i), id);
+        });
+
+        // Cubes are listed counter-clockwise about each edge's axis; the quad
+        // faces along the axis when the edge runs from inside to outside.
+        const std::vector<double>& lower = s.values[0];
+        const std::vector<double>& upper = s.values[1];
+        for (size_t node : s.nodes) {
+            size_t i = node % n;
+            size_t j = node / n;
+            if (k >= k0 && i > 0 && j > 0 && (lower[node] < 0.0) != (upper[node] < 0.0)) {
+                quad(layer[node - n - 1], layer[node - n], layer[node], layer[node - 1], !(lower[node] < 0.0));
+            }
+            if (k < k0 || k == 0) continue;
+            if (i + 1 < n && j > 0 && j + 1 < n && s.needed[node + 1] && (lower[node] < 0.0) != (lower[node + 1] < 0.0)) {
+                quad(below[node - n], below[node], layer[node], layer[node - n], !(lower[node] < 0.0));
+            }
+            if (j + 1 < n && i > 0 && i + 1 < n && s.needed[node + n] && (lower[node] < 0.0) != (lower[node + n] < 0.0)) {
+                quad(below[node - 1], layer[node - 1], layer[node], below[node], !(lower[node] < 0.0));
+            }
+        }
+        s.values[0].swap(s.values[1]);
+        s.cellVertices[0].swap(s.cellVertices[1]);
+    }
+}
+
+// Polygonises f(x, y, z) = iso over the cube [rangeMin, rangeMax]^3 into an
+// indexed triangle mesh. Returns the number of point evaluations. In a build
+// slice it may stop early with g_buildPaused set; the next call carries on.
+size_t BuildImplicitSurface(ExprEvaluator& eval, double rangeMin, double rangeMax, double cellStep, double iso,
+                            int refinement, ImplicitMesher mesher, SurfaceMesh& mesh) {
+    enum Stage { Volume = 1, Slabs, Merge, Normals };
+    ImplicitSurfaceBuild& build = g_implicitBuild;
+    BuildCursor& cursor = build.cursor;
+    if (!cursor.resumes()) {
+        mesh.reset(MeshPrimitive::Triangles, 1.0f);
+        if (rangeMax - rangeMin > cellStep * (double)kImplicitMaxCells) {
+            cellStep = (rangeMax - rangeMin) / (double)kImplicitMaxCells;
+        }
+        size_t n = GridCount(rangeMin, rangeMax, cellStep);
+        if (n < 2) return 0;
+        size_t cells = n - 1;
+        size_t slabs = std::min(cells, (size_t)WorkerPool::Instance().workerCount() * 4);
+        size_t slabCells = (cells + slabs - 1) / slabs;
+        if (SliceActive()) slabCells = std::min(slabCells, kSlicedSlabCells);
+        build.n = n;
+        build.cellStep = cellStep;
+        build.slabCells = slabCells;
+        build.slabs = (cells + slabCells - 1) / slabCells;
+        build.evaluations = 0;
+        g_implicitSlabs.resize(std::max(g_implicitSlabs.size(), build.slabs));
+        cursor.start(Volume);
+    }
+    size_t n = build.n;
+    size_t cells = n - 1;
+    cellStep = build.cellStep;
+    if (cursor.stage == Volume) {
+        if (!UpdateImplicitVolume(eval, rangeMin, cellStep, n, iso, build.evaluations)) return build.evaluations;
+        if (BuildCancelled()) return build.evaluations;
+        cursor.enter(Slabs);
+    }
+
+    const ImplicitVolume& volume = g_implicitVolume;
+    if (cursor.stage == Slabs) {
+        SyncWorkerEvaluators(eval);
+        bool done = RunSliced(cursor, build.slabs, [&](size_t first, size_t last) {
+            ParallelFor(last - first, 1, [&](size_t begin, size_t end, unsigned worker) {
+                ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+                for (size_t slab = first + begin; slab < first + end; ++slab) {
+                    size_t k0 = slab * build.slabCells;
+                    size_t k1 = std::min(cells, k0 + build.slabCells);
+                    if (mesher == ImplicitMesher::Dual) {
+                        ContourImplicitSlab(local, volume, rangeMin, rangeMax, cellStep, n, k0, k1, refinement,
+                                            g_implicitSlabs[slab]);
+                    } else {
+                        MarchImplicitSlab(local, volume, rangeMin, rangeMax, cellStep, n, k0, k1, refinement,
+                                          g_implicitSlabs[slab]);
                     }
-                    if (inLine) glEnd();
-                    glEndList();
-                    g_cacheValid = true;
-                    return;
                 }
-                else if (rightVar == 'x' && leftVar == 'z') {
-                    for (int i = 0; i <= numPoints; ++i) {
-                        double x = rangeMin + (rangeMax - rangeMin) * (i / (double)numPoints);
-                        double z = eval.evalRightSide(x, 0.0, 0.0);
-                        if (IsVertexValid((float)x, 0.0f, (float)z, rangeMinF, rangeMaxF)) {
-                            if (!inLine) { glBegin(GL_LINE_STRIP); inLine = true; }
-                            float colorT = (float)i / numPoints;
-                            glColor3f(1.0f - colorT * 0.5f, 0.5f + colorT * 0.3f, 0.2f + colorT * 0.6f);
-                            glVertex3f((float)x, 0.0f, (float)z);
-                        } else {
-                            if (inLine) { glEnd(); inLine = false; }
-                        }
-                    }
-                    if (inLine) glEnd();
-                    glEndList();
-                    g_cacheValid = true;
-                    return;
+            });
+        }, WorkerPool::Instance().workerCount());
+        if (!done || BuildCancelled()) return build.evaluations;
+
+        size_t vertices = 0;
+        size_t indices = 0;
+        for (size_t slab = 0; slab < build.slabs; ++slab) {
+            vertices += g_implicitSlabs[slab].vertices.size();
+            indices += g_implicitSlabs[slab].indices.size();
+            build.evaluations += g_implicitSlabs[slab].evaluations;
+        }
+        mesh.vertices.reserve(vertices);
+        mesh.indices.reserve(indices);
+        build.seam.assign(2 * n * n, kNoImplicitVertex);
+        cursor.enter(Merge);
+    }
+
+    if (cursor.stage == Merge) {
+        std::vector<uint32_t>& seam = build.seam;
+        bool done = RunSliced(cursor, build.slabs, [&](size_t first, size_t last) {
+            thread_local std::vector<uint32_t> remap;
+            for (size_t k = first; k < last; ++k) {
+                const ImplicitSlab& slab = g_implicitSlabs[k];
+                remap.assign(slab.vertices.size(), kNoImplicitVertex);
+                for (const auto& shared : slab.bottom) remap[shared.second] = seam[shared.first];
+                if (k > 0) {
+                    for (const auto& shared : g_implicitSlabs[k - 1].top) seam[shared.first] = kNoImplicitVertex;
                 }
-                else if (rightVar == 'y' && leftVar == 'x') {
-                    for (int i = 0; i <= numPoints; ++i) {
-                        double y = rangeMin + (rangeMax - rangeMin) * (i / (double)numPoints);
-                        double x = eval.evalRightSide(0.0, y, 0.0);
-                        if (IsVertexValid((float)x, (float)y, 0.0f, rangeMinF, rangeMaxF)) {
-                            if (!inLine) { glBegin(GL_LINE_STRIP); inLine = true; }
-                            float colorT = (float)i / numPoints;
-                            glColor3f(1.0f - colorT * 0.5f, 0.5f + colorT * 0.3f, 0.2f + colorT * 0.6f);
-                            glVertex3f((float)x, (float)y, 0.0f);
-                        } else {
-                            if (inLine) { glEnd(); inLine = false; }
+                for (size_t v = 0; v < slab.vertices.size(); ++v) {
+                    if (remap[v] != kNoImplicitVertex) continue;
+                    remap[v] = (uint32_t)mesh.vertices.size();
+                    mesh.vertices.push_back(slab.vertices[v]);
+                }
+                for (uint32_t index : slab.indices) mesh.indices.push_back(remap[index]);
+                for (const auto& shared : slab.top) seam[shared.first] = remap[shared.second];
+            }
+        });
+        if (!done) return build.evaluations;
+        cursor.enter(Normals);
+    }
+    if (ComputeNormalsSliced(mesh, cursor, Normals, build.normals)) cursor.finish();
+    return build.evaluations;
+}
+
+// Octree mode refines only the cubes whose interval bound may contain zero, a
+// level at a time, down to cubes of cellStep. The surviving cubes are a sparse
+// subset of that lattice; their corners are evaluated and they are meshed with
+// the marching cubes table, so the evaluation count follows the surface area.
+// Lattice points are packed into 20-bit fields of a key, so sorted keys run
+// along x, then y, then z.
+const size_t kOctreeMaxCells = 4096;
+const size_t kOctreeMaxLeaves = (size_t)1 << 21;
+
+// A level's children come out sorted without a sort: the children of one row
+// of parent cubes fill four rows, which join two layers, which are appended
+// to the next level when the parents move on to a new row and layer.
+struct ImplicitOctree {
+    BuildCursor cursor;
+    size_t cells = 0;
+    size_t size = 0;
+    double cellStep = 0.0;
+    size_t refined = 0;
+    std::vector<uint64_t> cubes;
+    std::vector<uint8_t> children;
+    std::vector<uint64_t> rows[4];
+    std::vector<uint64_t> layers[2];
+    uint64_t row = UINT64_MAX;
+    std::vector<uint64_t> nodes;
+    size_t shiftedAt = 0;
+    std::vector<uint64_t> merged;
+    std::vector<double> values;
+    std::vector<uint64_t> edges;
+    std::vector<std::vector<uint64_t>> chunkKeys;
+    std::vector<std::vector<CachedVertex>> chunkVertices;
+    std::vector<double> normals;
+};
+
+ImplicitOctree g_implicitOctree;
+
+uint64_t OctreeKey(uint64_t i, uint64_t j, uint64_t k) {
+    return i | j << 20 | k << 40;
+}
+
+void OctreeUnpack(uint64_t key, size_t p[3]) {
+    for (int a = 0; a < 3; ++a) p[a] = (size_t)(key >> (20 * a) & 0xFFFFF);
+}
+
+// Finds keys in a sorted list when successive queries never decrease, as the
+// corners of sorted cubes do: each search gallops forward from the last hit.
+struct OctreeCursor {
+    const uint64_t* keys = nullptr;
+    size_t count = 0;
+    size_t at = 0;
+
+    void reset(const std::vector<uint64_t>& list) {
+        keys = list.data();
+        count = list.size();
+        at = 0;
+    }
+
+    size_t seek(uint64_t key) {
+        size_t step = 1;
+        while (at + step < count && keys[at + step] < key) step *= 2;
+        at = std::lower_bound(keys + at, keys + std::min(at + step + 1, count), key) - keys;
+        return at < count && keys[at] == key ? at : SIZE_MAX;
+    }
+};
+
+// Runs body(chunk, begin, end) over items [first, last) cut into fixed chunks,
+// so the chunk outputs concatenate in item order.
+template <typename F>
+size_t ForEachOctreeChunk(size_t first, size_t last, F&& body) {
+    size_t count = last - first;
+    size_t chunks = std::max<size_t>(1, std::min(count, (size_t)WorkerPool::Instance().workerCount() * 8));
+    ParallelFor(chunks, 1, [&](size_t begin, size_t end, unsigned worker) {
+        for (size_t c = begin; c < end; ++c) {
+            body(c, first + count * c / chunks, first + count * (c + 1) / chunks, worker);
+        }
+    });
+    return chunks;
+}
+
+// Returns the number of point evaluations, or SIZE_MAX when the formula has no
+// interval bound to refine with. Every level and pass goes in batches, so in a
+// build slice it may stop early with g_buildPaused set; the next call carries on.
+size_t BuildImplicitOctree(ExprEvaluator& eval, double rangeMin, double rangeMax, double cellStep, double iso,
+                           int refinement, SurfaceMesh& mesh) {
+    enum Stage { Children = 1, Sort, Corners, Values = Corners + 3, Edges, Cubes, Normals };
+    ImplicitOctree& tree = g_implicitOctree;
+    BuildCursor& cursor = tree.cursor;
+    if (!cursor.resumes()) {
+        Interval probe;
+        if (!eval.evalInterval(Interval(rangeMin, rangeMax), Interval(rangeMin, rangeMax), Interval(rangeMin, rangeMax),
+                               probe)) {
+            return SIZE_MAX;
+        }
+        mesh.reset(MeshPrimitive::Triangles, 1.0f);
+        if (rangeMax - rangeMin > cellStep * (double)kOctreeMaxCells) {
+            cellStep = (rangeMax - rangeMin) / (double)kOctreeMaxCells;
+        }
+        size_t n = GridCount(rangeMin, rangeMax, cellStep);
+        if (n < 2) return 0;
+        tree.cells = n - 1;
+        tree.size = 1;
+        while (tree.size < tree.cells) tree.size *= 2;
+        tree.cellStep = cellStep;
+        tree.refined = 0;
+        tree.cubes.assign(1, 0);
+        cursor.start(Children);
+    }
+    cellStep = tree.cellStep;
+    size_t cells = tree.cells;
+
+    auto& chunkKeys = tree.chunkKeys;
+    auto& chunkVertices = tree.chunkVertices;
+    chunkKeys.resize(std::max<size_t>(chunkKeys.size(), WorkerPool::Instance().workerCount() * 8));
+    chunkVertices.resize(chunkKeys.size());
+    auto coord = [&](size_t i) { return rangeMin + cellStep * (double)i; };
+    SyncWorkerEvaluators(eval);
+
+    // Refine. A level stops short of cellStep when its cubes would exceed the
+    // leaf budget; the mesh is then built from the larger cubes.
+    while (cursor.stage == Children || cursor.stage == Sort) {
+        if (cursor.stage == Children) {
+            if (tree.size == 1 || tree.cubes.size() * 4 > kOctreeMaxLeaves) {
+                cursor.enter(Corners);
+                break;
+            }
+            if (cursor.next == 0) tree.children.resize(tree.cubes.size());
+            size_t half = tree.size / 2;
+            bool done = RunSliced(cursor, tree.cubes.size(), [&](size_t first, size_t last) {
+                ForEachOctreeChunk(first, last, [&](size_t, size_t begin, size_t end, unsigned worker) {
+                    ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+                    for (size_t m = begin; m < end && !BuildCancelled(); ++m) {
+                        size_t p[3];
+                        OctreeUnpack(tree.cubes[m], p);
+                        uint8_t mask = 0;
+                        for (int child = 0; child < 8; ++child) {
+                            Interval box[3];
+                            bool inside = true;
+                            for (int a = 0; a < 3; ++a) {
+                                size_t lo = (p[a] * 2 + (child >> a & 1)) * half;
+                                inside = inside && lo < cells;
+                                box[a] = Interval(coord(lo), coord(std::min(lo + half, cells)));
+                            }
+                            if (!inside) continue;
+                            Interval bound;
+                            local.evalInterval(box[0], box[1], box[2], bound);
+                            if (bound.isEmpty() || bound.lo > iso || bound.hi < iso) continue;
+                            mask |= (uint8_t)(1 << child);
                         }
+                        tree.children[m] = mask;
                     }
-                    if (inLine) glEnd();
-                    glEndList();
-                    g_cacheValid = true;
-                    return;
+                });
+            });
+            if (!done) return 0;
+            if (BuildCancelled()) return 0;
+            tree.merged.clear();
+            tree.row = UINT64_MAX;
+            cursor.enter(Sort);
+        }
+
+        auto flushRows = [&] {
+            for (int r = 0; r < 4; ++r) {
+                tree.layers[r >> 1].insert(tree.layers[r >> 1].end(), tree.rows[r].begin(), tree.rows[r].end());
+                tree.rows[r].clear();
+            }
+        };
+        auto flushLayers = [&] {
+            for (auto& layer : tree.layers) {
+                tree.merged.insert(tree.merged.end(), layer.begin(), layer.end());
+                layer.clear();
+            }
+        };
+        bool done = RunSliced(cursor, tree.cubes.size(), [&](size_t first, size_t last) {
+            for (size_t m = first; m < last; ++m) {
+                uint64_t key = tree.cubes[m];
+                uint64_t row = key >> 20;
+                if (row != tree.row) {
+                    flushRows();
+                    if (row >> 20 != tree.row >> 20) flushLayers();
+                    tree.row = row;
                 }
-                else if (rightVar == 'y' && leftVar == 'z') {
-                    for (int i = 0; i <= numPoints; ++i) {
-                        double y = rangeMin + (rangeMax - rangeMin) * (i / (double)numPoints);
-                        double z = eval.evalRightSide(0.0, y, 0.0);
-                        if (IsVertexValid(0.0f, (float)y, (float)z, rangeMinF, rangeMaxF)) {
-                            if (!inLine) { glBegin(GL_LINE_STRIP); inLine = true; }
-                            float colorT = (float)i / numPoints;
-                            glColor3f(1.0f - colorT * 0.5f, 0.5f + colorT * 0.3f, 0.2f + colorT * 0.6f);
-                            glVertex3f(0.0f, (float)y, (float)z);
-                        } else {
-                            if (inLine) { glEnd(); inLine = false; }
-                        }
+                size_t p[3];
+                OctreeUnpack(key, p);
+                for (int child = 0; child < 8; ++child) {
+                    if (!(tree.children[m] >> child & 1)) continue;
+                    uint64_t x = child & 1, y = child >> 1 & 1, z = child >> 2 & 1;
+                    tree.rows[z * 2 + y].push_back(OctreeKey(p[0] * 2 + x, p[1] * 2 + y, p[2] * 2 + z));
+                }
+            }
+        });
+        if (!done) return 0;
+        flushRows();
+        flushLayers();
+        tree.cubes.swap(tree.merged);
+        tree.size /= 2;
+        if (tree.cubes.empty()) {
+            cursor.finish();
+            return 0;
+        }
+        cursor.enter(Children);
+    }
+    double cubeStep = cellStep * (double)tree.size;
+
+    // Corners: the union of the cube keys shifted by one along each axis.
+    if (cursor.stage == Corners && cursor.next == 0) tree.nodes = tree.cubes;
+    while (cursor.stage >= Corners && cursor.stage < Corners + 3) {
+        uint64_t unit = (uint64_t)1 << (20 * (cursor.stage - Corners));
+        const std::vector<uint64_t>& nodes = tree.nodes;
+        if (cursor.next == 0) {
+            tree.merged.clear();
+            tree.shiftedAt = 0;
+        }
+        bool done = RunSliced(cursor, nodes.size(), [&](size_t first, size_t last) {
+            size_t& j = tree.shiftedAt;
+            for (size_t m = first; m < last; ++m) {
+                while (j < nodes.size() && nodes[j] + unit < nodes[m]) tree.merged.push_back(nodes[j++] + unit);
+                if (j < nodes.size() && nodes[j] + unit == nodes[m]) ++j;
+                tree.merged.push_back(nodes[m]);
+            }
+        });
+        if (!done) return 0;
+        for (size_t j = tree.shiftedAt; j < nodes.size(); ++j) tree.merged.push_back(nodes[j] + unit);
+        tree.nodes.swap(tree.merged);
+        cursor.enter(cursor.stage + 1);
+    }
+
+    if (cursor.stage == Values) {
+        if (cursor.next == 0) tree.values.resize(tree.nodes.size());
+        bool done = RunSliced(cursor, tree.nodes.size(), [&](size_t first, size_t last) {
+            ForEachOctreeChunk(first, last, [&](size_t, size_t begin, size_t end, unsigned worker) {
+                thread_local std::vector<double> xs, ys, zs;
+                ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+                xs.resize(end - begin);
+                ys.resize(end - begin);
+                zs.resize(end - begin);
+                for (size_t m = begin; m < end; ++m) {
+                    size_t p[3];
+                    OctreeUnpack(tree.nodes[m], p);
+                    xs[m - begin] = rangeMin + cubeStep * (double)p[0];
+                    ys[m - begin] = rangeMin + cubeStep * (double)p[1];
+                    zs[m - begin] = rangeMin + cubeStep * (double)p[2];
+                }
+                local.evalPoints(xs.data(), ys.data(), zs.data(), tree.values.data() + begin, end - begin);
+                for (size_t m = begin; m < end; ++m) tree.values[m] -= iso;
+            });
+        });
+        if (!done) return 0;
+        if (BuildCancelled()) return 0;
+        tree.edges.clear();
+        // In a build slice the outputs are reserved for their upper bound, so
+        // appending to them never copies them in the middle of a frame.
+        if (SliceActive()) {
+            tree.edges.reserve(tree.nodes.size() * 3);
+            mesh.vertices.reserve(tree.nodes.size() * 3);
+            mesh.indices.reserve(tree.cubes.size() * 15);
+        }
+        cursor.enter(Edges);
+    }
+
+    // One vertex per crossed lattice edge, keyed by its lower node and axis.
+    if (cursor.stage == Edges) {
+        bool done = RunSliced(cursor, tree.nodes.size(), [&](size_t first, size_t last) {
+            std::atomic<size_t> refined(0);
+            size_t chunks = ForEachOctreeChunk(first, last, [&](size_t c, size_t begin, size_t end, unsigned worker) {
+                ExprEvaluator& local = worker == 0 ? eval : *g_workerEvaluators[worker - 1];
+                size_t evaluations = 0;
+                chunkKeys[c].clear();
+                chunkVertices[c].clear();
+                OctreeCursor neighbours[3];
+                for (OctreeCursor& neighbour : neighbours) neighbour.reset(tree.nodes);
+                for (size_t m = begin; m < end; ++m) {
+                    double v0 = tree.values[m];
+                    if (!std::isfinite(v0)) continue;
+                    for (int a = 0; a < 3; ++a) {
+                        size_t other = neighbours[a].seek(tree.nodes[m] + ((uint64_t)1 << (20 * a)));
+                        if (other == SIZE_MAX) continue;
+                        double v1 = tree.values[other];
+                        if (!std::isfinite(v1) || (v0 < 0.0) == (v1 < 0.0)) continue;
+                        size_t q[3];
+                        OctreeUnpack(tree.nodes[m], q);
+                        double p[3];
+                        for (int b = 0; b < 3; ++b) p[b] = rangeMin + cubeStep * (double)q[b];
+                        p[a] += cubeStep * RefineEdgeRoot(local, p, a, cubeStep, v0, v1, iso, refinement, evaluations);
+                        chunkKeys[c].push_back(tree.nodes[m] << 2 | (uint64_t)a);
+                        chunkVertices[c].push_back(ImplicitVertex(p, rangeMin, rangeMax));
                     }
-                    if (inLine) glEnd();
-                    glEndList();
-                    g_cacheValid = true;
-                    return;
                 }
-                else if (rightVar == 'z' && leftVar == 'x') {
-                    for (int i = 0; i <= numPoints; ++i) {
-                        double z = rangeMin + (rangeMax - rangeMin) * (i / (double)numPoints);
-                        double x = eval.evalRightSide(0.0, 0.0, z);
-                        if (IsVertexValid((float)x, 0.0f, (float)z, rangeMinF, rangeMaxF)) {
-                            if (!inLine) { glBegin(GL_LINE_STRIP); inLine = true; }
-                            float colorT = (float)i / numPoints;
-                            glColor3f(1.0f - colorT * 0.5f, 0.5f + colorT * 0.3f, 0.2f + colorT * 0.6f);
-                            glVertex3f((float)x, 0.0f, (float)z);
-                        } else {
-                            if (inLine) { glEnd(); inLine = false; }
-                        }
+                refined += evaluations;
+            });
+            for (size_t c = 0; c < chunks; ++c) {
+                tree.edges.insert(tree.edges.end(), chunkKeys[c].begin(), chunkKeys[c].end());
+                mesh.vertices.insert(mesh.vertices.end(), chunkVertices[c].begin(), chunkVertices[c].end());
+            }
+            tree.refined += refined;
+        });
+        if (!done) return 0;
+        cursor.enter(Cubes);
+    }
+
+    if (cursor.stage == Cubes) {
+        const CubeCase* cases = CubeCases();
+        bool done = RunSliced(cursor, tree.cubes.size(), [&](size_t first, size_t last) {
+            size_t chunks = ForEachOctreeChunk(first, last, [&](size_t c, size_t begin, size_t end, unsigned) {
+                std::vector<uint64_t>& out = chunkKeys[c];
+                out.clear();
+                OctreeCursor corners[8];
+                OctreeCursor edges[12];
+                for (OctreeCursor& corner : corners) corner.reset(tree.nodes);
+                for (OctreeCursor& edge : edges) edge.reset(tree.edges);
+                for (size_t m = begin; m < end; ++m) {
+                    uint64_t keys[8];
+                    int mask = 0;
+                    bool finite = true;
+                    for (int k = 0; k < 8; ++k) {
+                        keys[k] = tree.cubes[m] + OctreeKey(k & 1, k >> 1 & 1, k >> 2 & 1);
+                        double v = tree.values[corners[k].seek(keys[k])];
+                        finite = finite && std::isfinite(v);
+                        if (v < 0.0) mask |= 1 << k;
+                    }
+                    if (!finite) continue;
+                    const CubeCase& cube = cases[mask];
+                    for (int t = 0; t < cube.count; ++t) {
+                        int edge = cube.edges[t];
+                        int c0, c1;
+                        CubeEdgeCorners(edge, c0, c1);
+                        out.push_back(edges[edge].seek(keys[c0] << 2 | (uint64_t)(edge / 4)));
                     }
-                    if (inLine) glEnd();
-                    glEndList();
-                    g_cacheValid = true;
+                }
+            });
+            for (size_t c = 0; c < chunks; ++c) {
+                for (uint64_t index : chunkKeys[c]) mesh.indices.push_back((uint32_t)index);
+            }
+        });
+        if (!done) return 0;
+        cursor.enter(Normals);
+    }
+    if (!ComputeNormalsSliced(mesh, cursor, Normals, tree.normals)) return 0;
+    cursor.finish();
+    return tree.nodes.size() + tree.refined;
+}
+
+// Chained equalities such as a = b = c compile to a sum of squares, which
+// touches zero on the intersection curve but never crosses it, so the
+// meshers find no surface. Those formulas are drawn as the grid points where
+// the sum is close to zero instead.
+size_t BuildNearZeroPoints(ExprEvaluator& eval, double rangeMin, double rangeMax, double step, SurfaceMesh& mesh) {
+    mesh.reset(MeshPrimitive::Points, 4.0f);
+    const double tolerance = step * 0.5;
+    const double rangeSize = rangeMax - rangeMin;
+    double sampleStep = step * 0.5;
+    const int maxSteps = 60;
+    if (rangeSize / sampleStep > maxSteps) sampleStep = rangeSize / maxSteps;
+    const size_t n = (size_t)std::floor(rangeSize / sampleStep + 1e-9) + 1;
+
+    std::vector<double> xs(n * n), ys(n * n), zs(n * n), values(n * n);
+    size_t evaluations = 0;
+    for (size_t k = 0; k < n; ++k) {
+        double z = rangeMin + sampleStep * k;
+        for (size_t j = 0; j < n; ++j) {
+            for (size_t i = 0; i < n; ++i) {
+                xs[j * n + i] = rangeMin + sampleStep * i;
+                ys[j * n + i] = rangeMin + sampleStep * j;
+                zs[j * n + i] = z;
+            }
+        }
+        eval.evalPoints(xs.data(), ys.data(), zs.data(), values.data(), values.size());
+        evaluations += values.size();
+        for (size_t q = 0; q < values.size(); ++q) {
+            if (!(std::fabs(values[q]) < tolerance)) continue;
+            float colorT = (float)((xs[q] - rangeMin) / rangeSize);
+            mesh.indices.push_back((uint32_t)mesh.vertices.size());
+            mesh.vertices.push_back({ (float)xs[q], (float)ys[q], (float)z,
+                                      1.0f - colorT * 0.3f, 0.7f, 0.3f + colorT * 0.4f, 1.0f, 0, 0, 127, 0 });
+        }
+    }
+    return evaluations;
+}
+
+void BuildImplicitMesh(ExprEvaluator& eval, double rangeMin, double rangeMax, double step, double iso, int refinement,
+                       ImplicitMesher mesher, SurfaceMesh& mesh) {
+    std::string formula = eval.originalFormula;
+    std::string cleanFormula = formula;
+    cleanFormula.erase(std::remove_if(cleanFormula.begin(), cleanFormula.end(), ::isspace), cleanFormula.end());
+
+    std::string lowerFormula = cleanFormula;
+    std::transform(lowerFormula.begin(), lowerFormula.end(), lowerFormula.begin(), ::tolower);
+
+    if (std::count(lowerFormula.begin(), lowerFormula.end(), '=') > 1) {
+        g_buildEvaluations = BuildNearZeroPoints(eval, rangeMin, rangeMax, step, mesh);
+        return;
+    }
+
+    size_t eqPos = lowerFormula.find('=');
+    if (eqPos != std::string::npos && eqPos > 0 && eqPos < lowerFormula.length() - 1) {
+        std::string left = lowerFormula.substr(0, eqPos);
+        std::string right = lowerFormula.substr(eqPos + 1);
+        left.erase(std::remove_if(left.begin(), left.end(), ::isspace), left.end());
+        right.erase(std::remove_if(right.begin(), right.end(), ::isspace), right.end());
+
+        if (left.length() == 1 && (left[0] == 'x' || left[0] == 'y' || left[0] == 'z')) {
+            char leftVar = left[0];
+            bool hasX = right.find('x') != std::string::npos;
+            bool hasY = right.find('y') != std::string::npos;
+            bool hasZ = right.find('z') != std::string::npos;
+            int varCount = (hasX ? 1 : 0) + (hasY ? 1 : 0) + (hasZ ? 1 : 0);
+            float rangeMinF = (float)rangeMin;
+            float rangeMaxF = (float)rangeMax;
+
+            if (varCount == 2 && eval.hasRightSideExpression) {
+                char var1 = '?', var2 = '?';
+                if (hasX && leftVar != 'x') { var1 = 'x'; }
+                if (hasY && leftVar != 'y') { if (var1 == '?') var1 = 'y'; else var2 = 'y'; }
+                if (hasZ && leftVar != 'z') { if (var1 == '?') var1 = 'z'; else var2 = 'z'; }
+
+                if (var2 != '?') {
+                    int uAxis = var1 - 'x';
+                    int vAxis = var2 - 'x';
+                    size_t nu = (size_t)std::ceil((rangeMax - rangeMin) / step - 1e-9) + 1;
+                    size_t nv = GridCount(rangeMin, rangeMax, step);
+                    std::vector<double> heights(nu * nv);
+                    SampleRightSideGridParallel(eval, uAxis, vAxis, rangeMin, nu, rangeMin, nv, step, heights.data());
+                    BuildHeightMesh(heights.data(), nu, nv, 0, rangeMin, rangeMin, step, uAxis, vAxis, nullptr,
+                                    rangeMinF, rangeMaxF, mesh);
                     return;
                 }
-                else if (rightVar == 'z' && leftVar == 'y') {
+            }
+            else if (varCount == 1 && eval.hasRightSideExpression) {
+                int numPoints = 400;
+
+                char rightVar = '?';
+                if (hasX && leftVar != 'x') rightVar = 'x';
+                else if (hasY && leftVar != 'y') rightVar = 'y';
+                else if (hasZ && leftVar != 'z') rightVar = 'z';
+
+                if (rightVar != '?') {
+                    int inAxis = rightVar - 'x';
+                    int outAxis = leftVar - 'x';
+                    mesh.reset(MeshPrimitive::Lines, 3.0f);
+                    bool inLine = false;
                     for (int i = 0; i <= numPoints; ++i) {
-                        double z = rangeMin + (rangeMax - rangeMin) * (i / (double)numPoints);
-                        double y = eval.evalRightSide(0.0, 0.0, z);
-                        if (IsVertexValid(0.0f, (float)y, (float)z, rangeMinF, rangeMaxF)) {
-                            if (!inLine) { glBegin(GL_LINE_STRIP); inLine = true; }
+                        double p[3] = { 0.0, 0.0, 0.0 };
+                        p[inAxis] = rangeMin + (rangeMax - rangeMin) * (i / (double)numPoints);
+                        p[outAxis] = eval.evalRightSide(p[0], p[1], p[2]);
+                        bool valid = IsVertexValid((float)p[0], (float)p[1], (float)p[2], rangeMinF, rangeMaxF);
+                        if (valid) {
                             float colorT = (float)i / numPoints;
-                            glColor3f(1.0f - colorT * 0.5f, 0.5f + colorT * 0.3f, 0.2f + colorT * 0.6f);
-                            glVertex3f(0.0f, (float)y, (float)z);
-                        } else {
-                            if (inLine) { glEnd(); inLine = false; }
+                            mesh.addLineVertex((float)p[0], (float)p[1], (float)p[2],
+                                               1.0f - colorT * 0.5f, 0.5f + colorT * 0.3f, 0.2f + colorT * 0.6f, inLine);
                         }
+                        inLine = valid;
                     }
-                    if (inLine) glEnd();
-                    glEndList();
-                    g_cacheValid = true;
                     return;
                 }
             }
             else if (varCount == 0 && eval.hasRightSideExpression) {
-                float rangeMinF = (float)rangeMin;
-                float rangeMaxF = (float)rangeMax;
                 double constVal = eval.evalRightSide(0.0, 0.0, 0.0);
-                
+                mesh.reset(MeshPrimitive::Triangles, 1.0f);
+
                 if (std::isfinite(constVal) && constVal >= rangeMin && constVal <= rangeMax) {
-                    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-                    glColor4f(0.8f, 0.6f, 0.2f, 0.7f);
-                    
-                    if (leftVar == 'x') {
-                        glBegin(GL_QUADS);
-                        glVertex3f((float)constVal, rangeMinF, rangeMinF);
-                        glVertex3f((float)constVal, rangeMaxF, rangeMinF);
-                        glVertex3f((float)constVal, rangeMaxF, rangeMaxF);
-                        glVertex3f((float)constVal, rangeMinF, rangeMaxF);
-                        glEnd();
-                    }
-                    else if (leftVar == 'y') {
-                        glBegin(GL_QUADS);
-                        glVertex3f(rangeMinF, (float)constVal, rangeMinF);
-                        glVertex3f(rangeMaxF, (float)constVal, rangeMinF);
-                        glVertex3f(rangeMaxF, (float)constVal, rangeMaxF);
-                        glVertex3f(rangeMinF, (float)constVal, rangeMaxF);
-                        glEnd();
-                    }
-                    else if (leftVar == 'z') {
-                        glBegin(GL_QUADS);
-                        glVertex3f(rangeMinF, rangeMinF, (float)constVal);
-                        glVertex3f(rangeMaxF, rangeMinF, (float)constVal);
-                        glVertex3f(rangeMaxF, rangeMaxF, (float)constVal);
-                        glVertex3f(rangeMinF, rangeMaxF, (float)constVal);
-                        glEnd();
+                    int axis = leftVar - 'x';
+                    int uAxis = (axis + 1) % 3;
+                    int vAxis = (axis + 2) % 3;
+                    const float corners[4][2] = {
+                        { rangeMinF, rangeMinF }, { rangeMaxF, rangeMinF }, { rangeMaxF, rangeMaxF }, { rangeMinF, rangeMaxF }
+                    };
+                    for (const auto& c : corners) {
+                        float p[3];
+                        p[axis] = (float)constVal;
+                        p[uAxis] = c[0];
+                        p[vAxis] = c[1];
+                        mesh.vertices.push_back({ p[0], p[1], p[2], 0.8f, 0.6f, 0.2f, 0.7f, 0, 0, 127, 0 });
                     }
+                    const uint32_t quad[6] = { 0, 1, 2, 0, 2, 3 };
+                    mesh.indices.assign(quad, quad + 6);
+                    ComputeTriangleNormals(mesh);
                 }
-                glEndList();
-                g_cacheValid = true;
                 return;
             }
         }
     }
 
-    const double tolerance = step * 0.5;
-    double sampleStep = step * 0.5;
-    
-    double rangeSize = rangeMax - rangeMin;
-    int maxSteps = 60;
-    if (rangeSize / sampleStep > maxSteps) {
-        sampleStep = rangeSize / maxSteps;
-    }
-
-    glPointSize(4.0f);
-    glBegin(GL_POINTS);
-    for (double x = rangeMin; x <= rangeMax; x += sampleStep) {
-        for (double y = rangeMin; y <= rangeMax; y += sampleStep) {
-            for (double z = rangeMin; z <= rangeMax; z += sampleStep) {
-                double value = eval.evalImplicit(x, y, z);
-                if (fabs(value) < tolerance) {
-                    float colorT = (float)((x - rangeMin) / rangeSize);
-                    glColor3f(1.0f - colorT * 0.3f, 0.7f, 0.3f + colorT * 0.4f);
-                    glVertex3f((float)x, (float)y, (float)z);
+    if (mesher == ImplicitMesher::Octree) {
+        // Without an interval bound there is nothing to refine with; the
+        // lattice is used instead.
+        g_buildEvaluations = BuildImplicitOctree(eval, rangeMin, rangeMax, step * 0.5, iso, refinement, mesh);
+        if (g_buildEvaluations != SIZE_MAX) return;
+        mesher = ImplicitMesher::Cubes;
+    }
+    g_buildEvaluations = BuildImplicitSurface(eval, rangeMin, rangeMax, step * 0.5, iso, refinement, mesher, mesh);
+}
+
+void BuildParametricLineMesh(ExprEvaluator& eval, double rangeMin, double rangeMax, SurfaceMesh& mesh) {
+    mesh.reset(MeshPrimitive::Lines, 3.0f);
+    int numPoints = 400;
+    float rangeMinF = (float)rangeMin;
+    float rangeMaxF = (float)rangeMax;
+
+    char paramVar = 0;
+    std::string singleVars;
+    if (!eval.allVarsEqual && eval.hasRightSideExpression) {
+        size_t p1 = eval.rightSideFormula.find('|');
+        if (p1 != std::string::npos) {
+            size_t p2 = eval.rightSideFormula.find('|', p1 + 1);
+            if (p2 != std::string::npos) {
+                paramVar = eval.rightSideFormula[p1 + 1];
+                singleVars = eval.rightSideFormula.substr(p2 + 1);
+            }
+        }
+    }
+
+    for (int i = 0; i <= numPoints; ++i) {
+        double t = rangeMin + (rangeMax - rangeMin) * (i / (double)numPoints);
+        float px, py, pz;
+        if (eval.allVarsEqual) {
+            px = py = pz = (float)t;
+        } else if (paramVar != 0) {
+            double xv = (paramVar == 'x') ? t : 0;
+            double yv = (paramVar == 'y') ? t : 0;
+            double zv = (paramVar == 'z') ? t : 0;
+            double exprVal = eval.evalRightSide(xv, yv, zv);
+
+            px = (singleVars.find('x') != std::string::npos) ? (float)exprVal : (paramVar == 'x' ? (float)t : (float)exprVal);
+            py = (singleVars.find('y') != std::string::npos) ? (float)exprVal : (paramVar == 'y' ? (float)t : (float)exprVal);
+            pz = (singleVars.find('z') != std::string::npos) ? (float)exprVal : (paramVar == 'z' ? (float)t : (float)exprVal);
+        } else {
+            px = py = pz = (float)t;
+        }
+        if (px >= rangeMinF - 5 && px <= rangeMaxF + 5 &&
+            py >= rangeMinF - 5 && py <= rangeMaxF + 5 &&
+            pz >= rangeMinF - 5 && pz <= rangeMaxF + 5) {
+            float colorT = (float)i / numPoints;
+            mesh.addLineVertex(px, py, pz, 1.0f - colorT * 0.5f, 0.6f + colorT * 0.2f, 0.2f + colorT * 0.5f, true);
+        }
+    }
+}
+
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#define GL_STATIC_DRAW 0x88E4
+#endif
+
+// Buffer object entry points. opengl32 only exports GL 1.1, so these are
+// fetched from the context; without them meshes draw from client arrays.
+struct GLBufferApi {
+    typedef void (APIENTRY* GenBuffersProc)(GLsizei n, GLuint* buffers);
+    typedef void (APIENTRY* DeleteBuffersProc)(GLsizei n, const GLuint* buffers);
+    typedef void (APIENTRY* BindBufferProc)(GLenum target, GLuint buffer);
+    typedef void (APIENTRY* BufferDataProc)(GLenum target, ptrdiff_t size, const void* data, GLenum usage);
+
+    GenBuffersProc GenBuffers = nullptr;
+    DeleteBuffersProc DeleteBuffers = nullptr;
+    BindBufferProc BindBuffer = nullptr;
+    BufferDataProc BufferData = nullptr;
+
+    void load() {
+        GenBuffers = (GenBuffersProc)glfwGetProcAddress("glGenBuffers");
+        DeleteBuffers = (DeleteBuffersProc)glfwGetProcAddress("glDeleteBuffers");
+        BindBuffer = (BindBufferProc)glfwGetProcAddress("glBindBuffer");
+        BufferData = (BufferDataProc)glfwGetProcAddress("glBufferData");
+    }
+
+    bool available() const { return GenBuffers && DeleteBuffers && BindBuffer && BufferData; }
+};
+
+GLBufferApi g_glBuffers;
+
+struct GpuMesh {
+    GLuint vertexBuffer = 0;
+    GLuint indexBuffer = 0;
+    GLsizei indexCount = 0;
+};
+
+GpuMesh g_gpuMesh;
+
+void UploadMesh(const SurfaceMesh& mesh, GpuMesh& gpu) {
+    gpu.indexCount = (GLsizei)mesh.indices.size();
+    if (!g_glBuffers.available()) return;
+    if (gpu.vertexBuffer == 0) g_glBuffers.GenBuffers(1, &gpu.vertexBuffer);
+    if (gpu.indexBuffer == 0) g_glBuffers.GenBuffers(1, &gpu.indexBuffer);
+    g_glBuffers.BindBuffer(GL_ARRAY_BUFFER, gpu.vertexBuffer);
+    g_glBuffers.BufferData(GL_ARRAY_BUFFER, (ptrdiff_t)(mesh.vertices.size() * sizeof(CachedVertex)),
+                           mesh.vertices.empty() ? nullptr : mesh.vertices.data(), GL_STATIC_DRAW);
+    g_glBuffers.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.indexBuffer);
+    g_glBuffers.BufferData(GL_ELEMENT_ARRAY_BUFFER, (ptrdiff_t)(mesh.indices.size() * sizeof(uint32_t)),
+                           mesh.indices.empty() ? nullptr : mesh.indices.data(), GL_STATIC_DRAW);
+    g_glBuffers.BindBuffer(GL_ARRAY_BUFFER, 0);
+    g_glBuffers.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void ReleaseMesh(GpuMesh& gpu) {
+    if (g_glBuffers.available()) {
+        if (gpu.vertexBuffer != 0) g_glBuffers.DeleteBuffers(1, &gpu.vertexBuffer);
+        if (gpu.indexBuffer != 0) g_glBuffers.DeleteBuffers(1, &gpu.indexBuffer);
+    }
+    gpu = GpuMesh();
+}
+
+void DrawMesh(const SurfaceMesh& mesh, const GpuMesh& gpu) {
+    if (gpu.indexCount == 0) return;
+    GLenum mode = GL_TRIANGLES;
+    bool lit = false;
+    if (mesh.primitive == MeshPrimitive::Lines) {
+        mode = GL_LINES;
+        glLineWidth(mesh.size);
+    } else if (mesh.primitive == MeshPrimitive::Points) {
+        mode = GL_POINTS;
+        glPointSize(mesh.size);
+    } else {
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        lit = g_lighting;
+    }
+
+    const char* vertexBase = (const char*)mesh.vertices.data();
+    const void* indexBase = mesh.indices.data();
+    if (gpu.vertexBuffer != 0) {
+        g_glBuffers.BindBuffer(GL_ARRAY_BUFFER, gpu.vertexBuffer);
+        g_glBuffers.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.indexBuffer);
+        vertexBase = nullptr;
+        indexBase = nullptr;
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(CachedVertex), vertexBase + offsetof(CachedVertex, x));
+    glColorPointer(4, GL_FLOAT, sizeof(CachedVertex), vertexBase + offsetof(CachedVertex, r));
+    if (lit) {
+        glEnable(GL_LIGHTING);
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glNormalPointer(GL_BYTE, sizeof(CachedVertex), vertexBase + offsetof(CachedVertex, nx));
+    }
+    glDrawElements(mode, gpu.indexCount, GL_UNSIGNED_INT, indexBase);
+    if (lit) {
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisable(GL_LIGHTING);
+    }
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (gpu.vertexBuffer != 0) {
+        g_glBuffers.BindBuffer(GL_ARRAY_BUFFER, 0);
+        g_glBuffers.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+// Frustum planes and depth row of the current projection * modelview, read
+// back once the camera is set, in the same coordinates the meshes use.
+struct TerrainView {
+    double planes[6][4];
+    double depth[4];
+    double pixelScale = 0.0;
+
+    bool boxVisible(const double lo[3], const double hi[3]) const {
+        for (const auto& p : planes) {
+            double d = p[3];
+            for (int a = 0; a < 3; ++a) d += p[a] * (p[a] >= 0.0 ? hi[a] : lo[a]);
+            if (d < 0.0) return false;
+        }
+        return true;
+    }
+
+    double nearestDepth(const double lo[3], const double hi[3]) const {
+        double w = depth[3];
+        for (int a = 0; a < 3; ++a) w += depth[a] * (depth[a] >= 0.0 ? lo[a] : hi[a]);
+        return w;
+    }
+};
+
+TerrainView CaptureTerrainView(int viewportHeight) {
+    double proj[16], model[16], clip[16];
+    glGetDoublev(GL_PROJECTION_MATRIX, proj);
+    glGetDoublev(GL_MODELVIEW_MATRIX, model);
+    for (int col = 0; col < 4; ++col) {
+        for (int row = 0; row < 4; ++row) {
+            double sum = 0.0;
+            for (int k = 0; k < 4; ++k) sum += proj[k * 4 + row] * model[col * 4 + k];
+            clip[col * 4 + row] = sum;
+        }
+    }
+    TerrainView view;
+    for (int k = 0; k < 4; ++k) {
+        double w = clip[k * 4 + 3];
+        view.depth[k] = w;
+        for (int axis = 0; axis < 3; ++axis) {
+            view.planes[axis * 2][k] = w + clip[k * 4 + axis];
+            view.planes[axis * 2 + 1][k] = w - clip[k * 4 + axis];
+        }
+    }
+    view.pixelScale = proj[5] * (double)viewportHeight * 0.5;
+    return view;
+}
+
+// Render-side tile cache. Tiles keep their GPU buffers until evicted, least
+// recently drawn first, once more than kMaxTerrainTiles are resident.
+const size_t kMaxTerrainTiles = 384;
+const double kTerrainNearDepth = 0.1;
+
+struct TerrainTile {
+    SurfaceMesh mesh;
+    GpuMesh gpu;
+    size_t vertexCount = 0;
+    float zMin = 0.0f;
+    float zMax = 0.0f;
+    uint64_t lastUsed = 0;
+    uint64_t generation = 0;
+};
+
+struct TerrainCache {
+    TerrainLayout layout;
+    uint64_t generation = 0;
+    std::unordered_map<TileKey, TerrainTile, TileKeyHash> tiles;
+    std::vector<TileKey> selected;
+    std::vector<TileKey> drawList;
+    uint64_t frame = 0;
+    size_t drawnVertices = 0;
+    size_t evaluations = 0;
+};
+
+TerrainCache g_terrain;
+
+void ResetTerrain() {
+    for (auto& entry : g_terrain.tiles) ReleaseMesh(entry.second.gpu);
+    g_terrain.tiles.clear();
+    g_terrain.selected.clear();
+    g_terrain.drawList.clear();
+    g_terrain.drawnVertices = 0;
+    g_terrain.evaluations = 0;
+    g_terrain.layout = TerrainLayout(g_range_min, g_range_max, g_step);
+}
+
+// Called when the formula or its variables change. Tiles of the old generation
+// stay drawable until their replacements arrive, so dragging a slider never
+// blanks the terrain. A new range or step moves the tile grid itself, so the
+// cache is reset instead.
+void RetireTerrain() {
+    TerrainLayout layout(g_range_min, g_range_max, g_step);
+    const TerrainLayout& old = g_terrain.layout;
+    if (layout.origin != old.origin || layout.span != old.span || layout.maxLevel != old.maxLevel) {
+        ResetTerrain();
+        return;
+    }
+    ++g_terrain.generation;
+    g_terrain.evaluations = 0;
+}
+
+// Height range of a tile, or of its closest sampled ancestor.
+bool TerrainHeightBounds(TileKey key, float& zMin, float& zMax) {
+    for (;;) {
+        auto it = g_terrain.tiles.find(key);
+        if (it != g_terrain.tiles.end()) {
+            zMin = it->second.zMin;
+            zMax = it->second.zMax;
+            return zMin <= zMax;
+        }
+        if (key.level == 0) return false;
+        key = key.parent();
+    }
+}
+
+// Picks the tiles to draw: starting from the root, the visible tile whose
+// sample spacing projects to the most pixels is split until every tile is
+// within maxPixelError or half the cache budget is in use. Tiles outside the
+// frustum are dropped without being sampled. The result is ordered largest
+// error first, which is also the order missing tiles are built in.
+void SelectTerrainTiles(const TerrainView& view, double rangeMin, double rangeMax, double maxPixelError,
+                        std::vector<TileKey>& out) {
+    const TerrainLayout& layout = g_terrain.layout;
+    struct Candidate {
+        double error;
+        TileKey key;
+        bool operator<(const Candidate& other) const { return error < other.error; }
+    };
+    std::priority_queue<Candidate> open;
+
+    auto consider = [&](const TileKey& key) {
+        double size = layout.tileSize(key.level);
+        double lo[3] = { layout.origin + size * (double)key.ix, layout.origin + size * (double)key.iy, rangeMin };
+        double hi[3] = { lo[0] + size, lo[1] + size, rangeMax };
+        if (!view.boxVisible(lo, hi)) return;
+        float zMin, zMax;
+        if (TerrainHeightBounds(key, zMin, zMax)) {
+            lo[2] = std::max(rangeMin, (double)zMin);
+            hi[2] = std::min(rangeMax, (double)zMax);
+        }
+        double error = 0.0;
+        if (key.level < layout.maxLevel) {
+            double w = view.nearestDepth(lo, hi);
+            error = w > kTerrainNearDepth ? layout.spacing(key.level) * view.pixelScale / w : HUGE_VAL;
+        }
+        open.push({ error, key });
+    };
+
+    out.clear();
+    if (!(layout.span > 0.0)) return;
+    consider(TileKey());
+    while (!open.empty()) {
+        Candidate c = open.top();
+        if (c.error <= maxPixelError || open.size() + 3 > kMaxTerrainTiles / 2) break;
+        open.pop();
+        for (int k = 0; k < 4; ++k) consider(c.key.child(k));
+    }
+    while (!open.empty()) {
+        out.push_back(open.top().key);
+        open.pop();
+    }
+}
+
+void SubmitTerrainRequests(std::vector<TileKey>& missing, std::vector<TerrainTileMesh>& built);
+
+// Once per frame: selects tiles for the view, swaps the missing and stale ones
+// to the build thread for finished ones, and lists what to draw. A stale tile
+// is drawn until it is rebuilt; a tile that is not built yet is covered by its
+// closest cached ancestor.
+void UpdateTerrain(const TerrainView& view) {
+    TerrainCache& t = g_terrain;
+    ++t.frame;
+    SelectTerrainTiles(view, g_range_min, g_range_max, g_tilePixelError, t.selected);
+
+    std::vector<TileKey> missing;
+    for (const auto& key : t.selected) {
+        auto it = t.tiles.find(key);
+        if (it == t.tiles.end() || it->second.generation != t.generation) missing.push_back(key);
+    }
+    std::vector<TerrainTileMesh> built;
+    SubmitTerrainRequests(missing, built);
+    for (auto& b : built) {
+        TerrainTile& tile = t.tiles[b.key];
+        tile.mesh = std::move(b.mesh);
+        tile.vertexCount = tile.mesh.vertices.size();
+        tile.zMin = b.zMin;
+        tile.zMax = b.zMax;
+        tile.generation = t.generation;
+        UploadMesh(tile.mesh, tile.gpu);
+        if (tile.gpu.vertexBuffer != 0) {
+            std::vector<CachedVertex>().swap(tile.mesh.vertices);
+            std::vector<uint32_t>().swap(tile.mesh.indices);
+        }
+        t.evaluations += (kTileCells + 1) * (kTileCells + 1);
+    }
+
+    t.drawList.clear();
+    t.drawnVertices = 0;
+    for (TileKey key : t.selected) {
+        auto it = t.tiles.find(key);
+        while (it == t.tiles.end() && key.level > 0) {
+            key = key.parent();
+            it = t.tiles.find(key);
+        }
+        if (it == t.tiles.end() || it->second.lastUsed == t.frame) continue;
+        it->second.lastUsed = t.frame;
+        t.drawList.push_back(key);
+        t.drawnVertices += it->second.vertexCount;
+    }
+
+    if (t.tiles.size() <= kMaxTerrainTiles) return;
+    std::vector<std::pair<uint64_t, TileKey>> idle;
+    for (const auto& entry : t.tiles) {
+        if (entry.second.lastUsed != t.frame) idle.emplace_back(entry.second.lastUsed, entry.first);
+    }
+    std::sort(idle.begin(), idle.end(), [](const std::pair<uint64_t, TileKey>& a, const std::pair<uint64_t, TileKey>& b) {
+        return a.first < b.first;
+    });
+    for (size_t k = 0; k < idle.size() && t.tiles.size() > kMaxTerrainTiles; ++k) {
+        auto it = t.tiles.find(idle[k].second);
+        ReleaseMesh(it->second.gpu);
+        t.tiles.erase(it);
+    }
+}
+
+void DrawTerrain() {
+    for (const auto& key : g_terrain.drawList) {
+        const TerrainTile& tile = g_terrain.tiles[key];
+        DrawMesh(tile.mesh, tile.gpu);
+    }
+}
+
+// Everything a build needs, copied from the UI state when it is requested,
+// so the build thread never reads globals the UI keeps editing.
+struct BuildRequest {
+    uint64_t generation = 0;
+    bool parametric = false;
+    std::string formula;
+    std::string paramX, paramY, paramZ;
+    double rangeMin = 0.0;
+    double rangeMax = 0.0;
+    double step = 0.0;
+    double tMin = 0.0;
+    double tMax = 0.0;
+    EvalBackend backend = EvalBackend::Bytecode;
+    SurfaceTessellation tessellation = SurfaceTessellation::Uniform;
+    ImplicitMesher implicitMesher = ImplicitMesher::Cubes;
+    double isoLevel = 0.0;
+    int edgeRefinement = 0;
+    double tolerance = 0.0;
+    std::vector<std::pair<std::string, double>> vars;
+};
+
+// Hand-off between the render thread and the build thread, guarded by
+// g_formula_mutex. The build thread swaps finished meshes into pending; the
+// render thread swaps pending into g_cachedMesh when it can take the lock
+// without waiting.
+struct MeshBuildQueue {
+    std::condition_variable wake;
+    bool hasRequest = false;
+    bool stopping = false;
+    BuildRequest request;
+    SurfaceMesh pending;
+    size_t pendingEvaluations = 0;
+    size_t pendingAllocations = 0;
+    bool pendingTerrain = false;
+    bool pendingReady = false;
+    std::vector<std::string> messages;
+    std::vector<TileKey> tileRequests;
+    std::vector<TerrainTileMesh> builtTiles;
+};
+
+MeshBuildQueue g_buildQueue;
+
+void RequestBuild() {
+    BuildRequest request;
+    request.generation = g_latestGeneration.load() + 1;
+    request.parametric = g_isParametric;
+    request.formula = g_formula;
+    request.paramX = g_paramX;
+    request.paramY = g_paramY;
+    request.paramZ = g_paramZ;
+    request.rangeMin = g_range_min;
+    request.rangeMax = g_range_max;
+    request.step = g_step;
+    request.tMin = g_range_min;
+    request.tMax = g_range_max;
+    request.backend = g_backend;
+    request.tessellation = g_tessellation;
+    request.implicitMesher = g_implicitMesher;
+    request.isoLevel = g_isoLevel;
+    request.edgeRefinement = g_edgeRefinement;
+    request.tolerance = g_adaptiveTolerance;
+    for (const auto& var : g_userVars) {
+        request.vars.emplace_back(var.name, var.value);
+        if (var.name == "t") {
+            request.tMin = var.minVal;
+            request.tMax = var.maxVal;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_formula_mutex);
+        g_buildQueue.request = std::move(request);
+        g_buildQueue.hasRequest = true;
+        g_buildQueue.tileRequests.clear();
+        g_buildQueue.builtTiles.clear();
+        g_latestGeneration.fetch_add(1);
+    }
+    g_buildQueue.wake.notify_one();
+}
+
+// terrain marks the empty mesh published for a tiled explicit surface, whose
+// geometry arrives as terrain tiles instead.
+void PublishMesh(SurfaceMesh& mesh, size_t evaluations, size_t allocations, bool terrain,
+                 std::vector<std::string>& messages) {
+    std::lock_guard<std::mutex> lock(g_formula_mutex);
+    for (auto& m : messages) g_buildQueue.messages.push_back(std::move(m));
+    messages.clear();
+    if (BuildCancelled()) return;
+    std::swap(g_buildQueue.pending, mesh);
+    g_buildQueue.pendingEvaluations = evaluations;
+    g_buildQueue.pendingAllocations = allocations;
+    g_buildQueue.pendingTerrain = terrain;
+    g_buildQueue.pendingReady = true;
+}
+
+// Takes the newest finished mesh, if any, without blocking the frame. A mesh
+// that is not terrain drops tiles kept from an earlier generation, which
+// would otherwise never be replaced.
+bool CollectBuiltMesh() {
+    std::unique_lock<std::mutex> lock(g_formula_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) return false;
+    for (auto& m : g_buildQueue.messages) g_consoleHistory.push_back(std::move(m));
+    g_buildQueue.messages.clear();
+    if (!g_buildQueue.pendingReady) return false;
+    std::swap(g_buildQueue.pending, g_cachedMesh);
+    g_cachedEvaluations = g_buildQueue.pendingEvaluations;
+    g_cachedAllocations = g_buildQueue.pendingAllocations;
+    g_buildQueue.pendingReady = false;
+    bool terrain = g_buildQueue.pendingTerrain;
+    lock.unlock();
+    if (!terrain) ResetTerrain();
+    return true;
+}
+
+// Replaces the build thread's tile list with this frame's missing tiles and
+// takes the tiles it has finished. Skipped for the frame if the lock is busy.
+void SubmitTerrainRequests(std::vector<TileKey>& missing, std::vector<TerrainTileMesh>& built) {
+    bool wake = false;
+    {
+        std::unique_lock<std::mutex> lock(g_formula_mutex, std::try_to_lock);
+        if (!lock.owns_lock()) return;
+        g_buildQueue.tileRequests.swap(missing);
+        built.swap(g_buildQueue.builtTiles);
+        wake = !g_buildQueue.tileRequests.empty();
+    }
+    if (wake) g_buildQueue.wake.notify_one();
+}
+
+// Pops the next wanted tile that is not already waiting to be collected.
+// Called with g_formula_mutex held.
+bool NextTerrainTile(TileKey& key) {
+    auto& wanted = g_buildQueue.tileRequests;
+    while (!wanted.empty()) {
+        key = wanted.front();
+        wanted.erase(wanted.begin());
+        bool pending = false;
+        for (const auto& built : g_buildQueue.builtTiles) pending = pending || built.key == key;
+        if (!pending) return true;
+    }
+    return false;
+}
+
+void PublishTile(TerrainTileMesh& tile) {
+    std::lock_guard<std::mutex> lock(g_formula_mutex);
+    if (BuildCancelled()) return;
+    auto& wanted = g_buildQueue.tileRequests;
+    wanted.erase(std::remove(wanted.begin(), wanted.end(), tile.key), wanted.end());
+    g_buildQueue.builtTiles.push_back(std::move(tile));
+}
+
+// Evaluators and compile state of one builder. The build thread owns one; in
+// sliced mode the render thread owns another.
+struct MeshBuilder {
+    ExprEvaluator evaluator;
+    ParametricEvaluator paramEval;
+    std::deque<std::pair<std::string, double>> vars;
+    bool hasCompiled = false;
+    std::string lastFormula;
+    std::string lastParamX, lastParamY, lastParamZ;
+    SurfaceMesh mesh;
+    std::vector<std::string> messages;
+    bool terrain = false;
+    TerrainLayout layout;
+    double clipMin = 0.0;
+    double clipMax = 0.0;
+    size_t allocationsAtStart = 0;
+
+    // Heap allocations made on this thread, and by pool workers for it, since
+    // the current request was taken on.
+    size_t allocations() const { return ThreadAllocationCount() - allocationsAtStart; }
+
+    // Takes on a request: updates variables and backend and recompiles when the
+    // formula changed. Returns false when nothing is left to build, after
+    // publishing an empty mesh for a failed compile or for tiled terrain.
+    bool begin(const BuildRequest& req) {
+        g_jobGeneration = req.generation;
+        allocationsAtStart = ThreadAllocationCount();
+        terrain = false;
+
+        for (const auto& v : req.vars) {
+            auto it = std::find_if(vars.begin(), vars.end(), [&](const std::pair<std::string, double>& s) { return s.first == v.first; });
+            if (it == vars.end()) {
+                vars.emplace_back(v.first, v.second);
+                evaluator.addUserVariable(v.first, vars.back().second);
+                paramEval.addUserVariable(v.first, vars.back().second);
+            } else {
+                it->second = v.second;
+            }
+        }
+        evaluator.setBackend(req.backend);
+        paramEval.setBackend(req.backend);
+
+        if (req.parametric) {
+            if (req.paramX != lastParamX || req.paramY != lastParamY || req.paramZ != lastParamZ) {
+                bool ok = paramEval.compile(req.paramX, req.paramY, req.paramZ);
+                if (!ok) {
+                    hasCompiled = false;
+                    messages.push_back("Error: Invalid parametric formula");
+                } else {
+                    lastParamX = req.paramX;
+                    lastParamY = req.paramY;
+                    lastParamZ = req.paramZ;
+                    hasCompiled = true;
+                }
+            } else {
+                hasCompiled = paramEval.compiled;
+            }
+        } else {
+            if (req.formula != lastFormula) {
+                bool ok = evaluator.compile(req.formula);
+                if (!ok) {
+                    hasCompiled = false;
+                    messages.push_back("Error: Invalid formula '" + req.formula + "'");
+                } else {
+                    lastFormula = req.formula;
+                    hasCompiled = true;
+                    messages.push_back("OK: " + req.formula);
+                    if (evaluator.backend == EvalBackend::Bytecode && !evaluator.usingBytecode()) {
+                        messages.push_back("Note: bytecode VM can't lower this formula, using exprtk");
+                    }
                 }
             }
         }
+
+        if (!hasCompiled) {
+            mesh.clear();
+            PublishMesh(mesh, 0, allocations(), false, messages);
+            return false;
+        }
+
+        if (!req.parametric && req.tessellation == SurfaceTessellation::Tiled &&
+            evaluator.eqType != EquationType::PARAMETRIC_LINE && evaluator.eqType != EquationType::IMPLICIT) {
+            terrain = true;
+            layout = TerrainLayout(req.rangeMin, req.rangeMax, req.step);
+            clipMin = req.rangeMin;
+            clipMax = req.rangeMax;
+            mesh.clear();
+            PublishMesh(mesh, 0, allocations(), true, messages);
+            return false;
+        }
+        return true;
+    }
+
+    // Explicit surfaces on the uniform grid are the builds sliced mode splits
+    // into row bands.
+    bool rowSliceable(const BuildRequest& req) const {
+        return !req.parametric && req.tessellation == SurfaceTessellation::Uniform &&
+               evaluator.eqType == EquationType::EXPLICIT_Z;
+    }
+
+    // Runs the builders, publishing every progressive pass. In a build slice
+    // the implicit and adaptive builders may pause; returns false then, and
+    // the next call carries on.
+    bool build(const BuildRequest& req) {
+        bool complete = false;
+        while (!complete && !BuildCancelled()) {
+            complete = true;
+            g_buildEvaluations = 0;
+            g_buildPaused = false;
+            if (req.parametric) {
+                BuildParametricMesh(paramEval, req.tMin, req.tMax, 2000, req.rangeMin, req.rangeMax, mesh);
+            } else if (evaluator.eqType == EquationType::PARAMETRIC_LINE) {
+                BuildParametricLineMesh(evaluator, req.rangeMin, req.rangeMax, mesh);
+            } else if (evaluator.eqType == EquationType::IMPLICIT) {
+                BuildImplicitMesh(evaluator, req.rangeMin, req.rangeMax, req.step, req.isoLevel, req.edgeRefinement,
+                                  req.implicitMesher, mesh);
+            } else {
+                complete = BuildSurfaceMesh(evaluator, req.rangeMin, req.rangeMax, req.step,
+                                            req.tessellation, req.tolerance, mesh);
+            }
+            if (g_buildPaused) return false;
+            PublishMesh(mesh, g_buildEvaluations, allocations(), false, messages);
+        }
+        return true;
     }
-    glEnd();
-    
-    glEndList();
-    g_cacheValid = true;
+};
+
+void MeshBuildThread() {
+    MeshBuilder builder;
+    for (;;) {
+        BuildRequest req;
+        TerrainTileMesh tile;
+        bool haveRequest = false;
+        bool haveTile = false;
+        {
+            std::unique_lock<std::mutex> lock(g_formula_mutex);
+            g_buildQueue.wake.wait(lock, [&] {
+                return g_buildQueue.stopping || g_buildQueue.hasRequest ||
+                       (builder.terrain && !g_buildQueue.tileRequests.empty());
+            });
+            if (g_buildQueue.stopping) return;
+            if (g_buildQueue.hasRequest) {
+                req = std::move(g_buildQueue.request);
+                g_buildQueue.hasRequest = false;
+                haveRequest = true;
+            } else {
+                haveTile = NextTerrainTile(tile.key);
+            }
+        }
+        if (!haveRequest) {
+            if (haveTile && BuildTerrainTile(builder.evaluator, builder.layout, builder.clipMin, builder.clipMax, tile)) {
+                PublishTile(tile);
+            }
+            continue;
+        }
+        if (builder.begin(req)) builder.build(req);
+    }
+}
+
+// Sliced mode runs builds on the render thread within a time budget per frame.
+// An explicit uniform surface is sampled a band of rows at a time through the
+// sample cache or the slider path, as the blocking builder samples it, and
+// each band is meshed by MeshHeightGrid straight into g_cachedMesh, so the
+// surface grows on screen. Implicit and adaptive builds pause at the slice
+// deadline and resume next frame; parametric meshes and curves, which are
+// small, are built in one go. Terrain tiles are built while budget remains.
+struct SlicedBuild {
+    MeshBuilder builder;
+    BuildRequest request;
+    bool hasRequest = false;
+    bool rowsActive = false;
+    bool building = false;
+    size_t allocationsAtPause = 0;
+    size_t nx = 0;
+    size_t ny = 0;
+    size_t nextRow = 0;
+    size_t meshedRows = 0;
+    HeightGridBudget refineBudget;
+    size_t sliceRows = 1;
+    bool cached = false;
+    CachedGridPlan plan;
+    size_t evaluations = 0;
+    size_t allocations = 0;
+    size_t uploadedVertices = 0;
+    std::vector<double> heights;
+    std::vector<double> band;
+    SurfaceMesh bandMesh;
+};
+
+// Created on first use: its evaluators must not be built during static
+// initialisation.
+std::unique_ptr<SlicedBuild> g_sliced;
+
+void StartRowSlices(SlicedBuild& s) {
+    const BuildRequest& req = s.request;
+    s.nx = (size_t)std::ceil((req.rangeMax - req.rangeMin) / req.step - 1e-9) + 1;
+    s.ny = GridCount(req.rangeMin, req.rangeMax, req.step);
+    s.nextRow = 0;
+    s.meshedRows = 0;
+    BeginRefineBudget(s.nx, s.ny, s.refineBudget);
+    s.sliceRows = 1;
+    s.evaluations = 0;
+    s.uploadedVertices = 0;
+    // Rows are added as they are sampled: filling a large grid at once would
+    // put all of its page faults into this frame.
+    s.heights.clear();
+    s.heights.reserve(s.nx * s.ny);
+    s.rowsActive = s.nx > 1 && s.ny > 1;
+    ExprEvaluator& eval = s.builder.evaluator;
+    s.cached = PlanCachedGrid(eval, req.rangeMin, req.step, s.nx, s.ny, s.plan);
+    if (!s.cached) BeginSurfaceGrid(eval, req.rangeMin, req.step, s.nx, s.ny);
+    {
+        std::lock_guard<std::mutex> lock(g_formula_mutex);
+        g_buildQueue.pendingReady = false;
+    }
+    g_cachedMesh.reset(MeshPrimitive::Triangles, 1.0f);
+    // Each band repeats the previous band's last row; the headroom keeps a
+    // reallocation of the whole mesh from landing in the middle of a frame.
+    g_cachedMesh.vertices.reserve(s.nx * s.ny + s.nx * s.ny / 4);
+    g_cachedMesh.indices.reserve((s.nx - 1) * (s.ny - 1) * 6 + s.nx * s.ny);
+    g_cachedEvaluations = 0;
+    g_cachedAllocations = 0;
+    ResetTerrain();
+}
+
+// Samples the next rowCount rows and meshes the cells below them. Meshing
+// stays two rows behind sampling, so every band sees one row of its
+// neighbours below and two above; the last band meshes the remaining cells.
+void BuildRowSlice(SlicedBuild& s, size_t rowCount) {
+    const BuildRequest& req = s.request;
+    ExprEvaluator& eval = s.builder.evaluator;
+    size_t r0 = s.nextRow;
+    size_t r1 = std::min(s.ny, r0 + rowCount);
+    s.heights.resize(r1 * s.nx);
+    double* rows = s.heights.data() + r0 * s.nx;
+    if (s.cached) {
+        s.evaluations += SampleCachedRows(eval, s.plan, r0, r1, rows);
+    } else {
+        SampleSurfaceRows(eval, r0, r1, rows);
+        s.evaluations += (r1 - r0) * s.nx;
+    }
+    s.nextRow = r1;
+
+    size_t c0 = s.meshedRows;
+    size_t c1 = r1 == s.ny ? s.ny - 1 : (r1 >= 3 ? r1 - 3 : 0);
+    if (c1 <= c0) return;
+    size_t first = c0 > 0 ? c0 - 1 : 0;
+    size_t last = std::min(s.ny, c1 + 3);
+    s.band.assign(s.heights.begin() + first * s.nx, s.heights.begin() + last * s.nx);
+    s.evaluations += MeshHeightGrid(eval, s.band, s.nx, last - first, first, c0 - first, c1 - first, req.rangeMin,
+                                    req.rangeMin, req.step, req.rangeMin, req.rangeMax, s.refineBudget, s.bandMesh);
+    g_cachedMesh.append(s.bandMesh);
+    s.meshedRows = c1;
+}
+
+// Does up to budgetMs of build work. Returns true when g_cachedMesh grew
+// enough to be worth uploading again; uploads back off geometrically, so the
+// total upload cost stays proportional to the final mesh.
+bool StepSlicedBuild(double budgetMs) {
+    if (!g_sliced) g_sliced.reset(new SlicedBuild());
+    SlicedBuild& s = *g_sliced;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsedMs = [&] {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    {
+        std::lock_guard<std::mutex> lock(g_formula_mutex);
+        if (g_buildQueue.hasRequest) {
+            s.request = std::move(g_buildQueue.request);
+            g_buildQueue.hasRequest = false;
+            s.hasRequest = true;
+        }
+    }
+    // Counted per step, so work the render loop does between frames stays out.
+    size_t allocationsBefore = ThreadAllocationCount();
+    if (s.building) s.builder.allocationsAtStart += allocationsBefore - s.allocationsAtPause;
+    g_sliceDeadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double, std::milli>(budgetMs));
+    if (s.hasRequest) {
+        s.hasRequest = false;
+        s.rowsActive = false;
+        s.building = false;
+        s.allocations = 0;
+        if (s.builder.begin(s.request)) {
+            for (auto& m : s.builder.messages) g_consoleHistory.push_back(std::move(m));
+            s.builder.messages.clear();
+            if (s.builder.rowSliceable(s.request)) {
+                StartRowSlices(s);
+            } else {
+                s.building = true;
+            }
+        }
+    }
+    if (s.building) {
+        s.building = !s.builder.build(s.request);
+        s.allocationsAtPause = ThreadAllocationCount();
+    }
+    g_sliceDeadline = std::chrono::steady_clock::time_point::max();
+
+    // One band per frame. Meshing a band has a cost per column, so bands are
+    // sized to fill the budget rather than cut into small pieces; the size
+    // adapts from the last band, at most doubling or halving at a time.
+    bool grew = false;
+    if (s.rowsActive) {
+        double before = elapsedMs();
+        size_t rows = s.sliceRows;
+        BuildRowSlice(s, rows);
+        double took = elapsedMs() - before;
+        double scale = took > 0.0 ? std::min(2.0, std::max(0.5, budgetMs / took)) : 2.0;
+        s.sliceRows = std::max<size_t>(1, (size_t)((double)rows * scale));
+        grew = true;
+        if (s.nextRow == s.ny) {
+            s.rowsActive = false;
+            StoreSampleGrid(s.builder.evaluator, s.request.rangeMin, s.request.rangeMin, s.request.step, s.nx, s.ny,
+                            s.heights);
+        }
+    }
+    if (s.rowsActive || grew) {
+        s.allocations += ThreadAllocationCount() - allocationsBefore;
+        g_cachedEvaluations = s.evaluations;
+        g_cachedAllocations = s.allocations;
+    }
+    bool upload = grew && (!s.rowsActive || g_cachedMesh.vertices.size() >= s.uploadedVertices + s.uploadedVertices / 4);
+    if (upload) s.uploadedVertices = g_cachedMesh.vertices.size();
+
+    while (s.builder.terrain && elapsedMs() < budgetMs) {
+        TerrainTileMesh tile;
+        {
+            std::lock_guard<std::mutex> lock(g_formula_mutex);
+            if (!NextTerrainTile(tile.key)) break;
+        }
+        if (BuildTerrainTile(s.builder.evaluator, s.builder.layout, s.builder.clipMin, s.builder.clipMax, tile)) {
+            PublishTile(tile);
+        }
+    }
+    return upload;
+}
+
+void StartMeshBuildThread(std::thread& builder) {
+    {
+        std::lock_guard<std::mutex> lock(g_formula_mutex);
+        g_buildQueue.stopping = false;
+    }
+    builder = std::thread(MeshBuildThread);
 }
 
-void DrawImplicit() {
-    if (g_displayList != 0) {
-        glCallList(g_displayList);
+void StopMeshBuildThread(std::thread& builder) {
+    {
+        std::lock_guard<std::mutex> lock(g_formula_mutex);
+        g_buildQueue.stopping = true;
+        g_latestGeneration.fetch_add(1);
     }
+    g_buildQueue.wake.notify_one();
+    builder.join();
 }
 
 void DrawAxes(float axisMax, float scale) {
@@ -1240,6 +4687,19 @@ void DrawUI() {
     snprintf(fpsText, sizeof(fpsText), "%.1f FPS (%.2f ms)", g_fps, g_frameTime * 1000.0);
     DrawText(windowWidth - 140, 20, fpsText);
 
+    char meshText[96];
+    if (g_tessellation == SurfaceTessellation::Tiled && !g_terrain.tiles.empty()) {
+        snprintf(meshText, sizeof(meshText), "%zu tiles (%zu cached), %zu vertices, %zu evaluations",
+                 g_terrain.drawList.size(), g_terrain.tiles.size(), g_terrain.drawnVertices, g_terrain.evaluations);
+    } else if (kCountAllocations) {
+        snprintf(meshText, sizeof(meshText), "%zu vertices, %zu evaluations, %zu allocations",
+                 g_cachedMesh.vertices.size(), g_cachedEvaluations, g_cachedAllocations);
+    } else {
+        snprintf(meshText, sizeof(meshText), "%zu vertices, %zu evaluations",
+                 g_cachedMesh.vertices.size(), g_cachedEvaluations);
+    }
+    DrawText(10, 36, meshText);
+
     glEnable(GL_DEPTH_TEST);
     glMatrixMode(GL_PROJECTION);
     glPopMatrix();
@@ -1258,10 +4718,27 @@ int Renderer() {
 
     glfwMakeContextCurrent(window);
     glfwSwapInterval(0);
+    g_glBuffers.load();
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
+    // Headlight: the position is given with an identity modelview, so the
+    // light stays fixed relative to the camera. Vertex colors drive the
+    // material and both faces are lit, since surfaces are seen from below too.
+    const GLfloat lightDir[4] = { 0.3f, 0.5f, 1.0f, 0.0f };
+    const GLfloat lightDiffuse[4] = { 0.8f, 0.8f, 0.8f, 1.0f };
+    const GLfloat lightAmbient[4] = { 0.35f, 0.35f, 0.35f, 1.0f };
+    glLoadIdentity();
+    glLightfv(GL_LIGHT0, GL_POSITION, lightDir);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, lightAmbient);
+    glEnable(GL_LIGHT0);
+    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+    glEnable(GL_COLOR_MATERIAL);
+    glShadeModel(GL_SMOOTH);
+
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
     gluPerspective(60.0, windowWidth / (double)windowHeight, 0.1, 1000.0);
@@ -1276,16 +4753,10 @@ int Renderer() {
     glfwSetKeyCallback(window, key_callback);
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
 
-    ExprEvaluator evaluator;
-    g_evaluator = &evaluator;
-    ParametricEvaluator paramEval;
-    g_paramEvaluator = &paramEval;
-    bool hasCompiled = false;
-    std::string lastFormula;
-    std::string lastParamX, lastParamY, lastParamZ;
-
-    hasCompiled = evaluator.compile(g_formula);
-    if (!hasCompiled) std::cerr << "Initial compile failed for: " << g_formula << std::endl;
+    std::thread builder;
+    if (g_buildMode == BuildMode::Thread) StartMeshBuildThread(builder);
+    RequestBuild();
+    ResetTerrain();
     g_formula_dirty = false;
 
     g_consoleHistory.push_back("3D Formula Grapher - Type 'help' for commands");
@@ -1310,43 +4781,21 @@ int Renderer() {
 
         glfwGetWindowSize(window, &windowWidth, &windowHeight);
 
+        bool threaded = g_buildMode == BuildMode::Thread;
+        if (threaded != builder.joinable()) {
+            if (threaded) StartMeshBuildThread(builder);
+            else StopMeshBuildThread(builder);
+        }
         if (g_formula_dirty) {
-            for (auto& var : g_userVars) {
-                evaluator.addUserVariable(var.name, var.value);
-                paramEval.addUserVariable(var.name, var.value);
-            }
-            
-            g_cacheValid = false;
-            
-            if (g_isParametric) {
-                if (g_paramX != lastParamX || g_paramY != lastParamY || g_paramZ != lastParamZ) {
-                    bool ok = paramEval.compile(g_paramX, g_paramY, g_paramZ);
-                    if (!ok) {
-                        hasCompiled = false;
-                        g_consoleHistory.push_back("Error: Invalid parametric formula");
-                    } else {
-                        lastParamX = g_paramX;
-                        lastParamY = g_paramY;
-                        lastParamZ = g_paramZ;
-                        hasCompiled = true;
-                    }
-                } else {
-                    hasCompiled = paramEval.compiled;
-                }
-            } else {
-                if (g_formula != lastFormula) {
-                    bool ok = evaluator.compile(g_formula);
-                    if (!ok) {
-                        hasCompiled = false;
-                        g_consoleHistory.push_back("Error: Invalid formula '" + g_formula + "'");
-                    } else {
-                        lastFormula = g_formula;
-                        hasCompiled = true;
-                        g_consoleHistory.push_back("OK: " + g_formula);
-                    }
-                }
-            }
             g_formula_dirty = false;
+            RequestBuild();
+            RetireTerrain();
+        }
+        if (!threaded && StepSlicedBuild(g_sliceBudgetMs)) {
+            UploadMesh(g_cachedMesh, g_gpuMesh);
+        }
+        if (CollectBuiltMesh()) {
+            UploadMesh(g_cachedMesh, g_gpuMesh);
         }
 
         glViewport(0, 0, windowWidth, windowHeight);
@@ -1366,6 +4815,11 @@ int Renderer() {
         float camZ = cam.distance * cos(radPitch) * sin(radYaw);
         gluLookAt(camX, camY, camZ, 0, 0, 0, 0, 1, 0);
 
+        bool terrainMode = g_tessellation == SurfaceTessellation::Tiled && !g_isParametric;
+        if (terrainMode) {
+            UpdateTerrain(CaptureTerrainView(windowHeight));
+        }
+
         float axisMax = std::max((float)fabs(g_range_min), (float)fabs(g_range_max));
         if (axisMax < 1.0f) axisMax = 1.0f;
         DrawAxes(axisMax, cam.scale);
@@ -1394,80 +4848,9 @@ int Renderer() {
         glEnable(GL_CLIP_PLANE4);
         glEnable(GL_CLIP_PLANE5);
 
-        if (hasCompiled) {
-            if (!g_cacheValid) {
-                if (g_isParametric) {
-                    double tMin = g_range_min;
-                    double tMax = g_range_max;
-                    for (auto& var : g_userVars) {
-                        if (var.name == "t") {
-                            tMin = var.minVal;
-                            tMax = var.maxVal;
-                            break;
-                        }
-                    }
-                    BuildParametricDisplayList(paramEval, tMin, tMax, 2000);
-                } else if (evaluator.eqType == EquationType::PARAMETRIC_LINE) {
-                    if (g_displayList != 0) glDeleteLists(g_displayList, 1);
-                    g_displayList = glGenLists(1);
-                    glNewList(g_displayList, GL_COMPILE);
-                    glLineWidth(3.0f);
-                    glBegin(GL_LINE_STRIP);
-                    int numPoints = 400;
-                    float rangeMinF = (float)g_range_min;
-                    float rangeMaxF = (float)g_range_max;
-                    
-                    char paramVar = 0;
-                    std::string singleVars;
-                    if (!evaluator.allVarsEqual && evaluator.hasRightSideExpression) {
-                        size_t p1 = evaluator.rightSideFormula.find('|');
-                        if (p1 != std::string::npos) {
-                            size_t p2 = evaluator.rightSideFormula.find('|', p1 + 1);
-                            if (p2 != std::string::npos) {
-                                paramVar = evaluator.rightSideFormula[p1 + 1];
-                                singleVars = evaluator.rightSideFormula.substr(p2 + 1);
-                            }
-                        }
-                    }
-                    
-                    for (int i = 0; i <= numPoints; ++i) {
-                        double t = g_range_min + (g_range_max - g_range_min) * (i / (double)numPoints);
-                        float px, py, pz;
-                        if (evaluator.allVarsEqual) {
-                            px = py = pz = (float)t;
-                        } else if (paramVar != 0) {
-                            double xv = (paramVar == 'x') ? t : 0;
-                            double yv = (paramVar == 'y') ? t : 0;
-                            double zv = (paramVar == 'z') ? t : 0;
-                            double exprVal = evaluator.evalRightSide(xv, yv, zv);
-                            
-                            px = (singleVars.find('x') != std::string::npos) ? (float)exprVal : (paramVar == 'x' ? (float)t : (float)exprVal);
-                            py = (singleVars.find('y') != std::string::npos) ? (float)exprVal : (paramVar == 'y' ? (float)t : (float)exprVal);
-                            pz = (singleVars.find('z') != std::string::npos) ? (float)exprVal : (paramVar == 'z' ? (float)t : (float)exprVal);
-                        } else {
-                            px = py = pz = (float)t;
-                        }
-                        if (px >= rangeMinF - 5 && px <= rangeMaxF + 5 &&
-                            py >= rangeMinF - 5 && py <= rangeMaxF + 5 &&
-                            pz >= rangeMinF - 5 && pz <= rangeMaxF + 5) {
-                            float colorT = (float)i / numPoints;
-                            glColor3f(1.0f - colorT * 0.5f, 0.6f + colorT * 0.2f, 0.2f + colorT * 0.5f);
-                            glVertex3f(px, py, pz);
-                        }
-                    }
-                    glEnd();
-                    glEndList();
-                    g_cacheValid = true;
-                } else if (evaluator.eqType == EquationType::IMPLICIT) {
-                    BuildImplicitDisplayList(evaluator, g_range_min, g_range_max, g_step);
-                } else {
-                    BuildSurfaceDisplayList(evaluator, g_range_min, g_range_max, g_step);
-                }
-            }
-            
-            if (g_displayList != 0) {
-                glCallList(g_displayList);
-            }
+        DrawMesh(g_cachedMesh, g_gpuMesh);
+        if (terrainMode) {
+            DrawTerrain();
         }
 
         glDisable(GL_CLIP_PLANE0);
@@ -1483,12 +4866,9 @@ int Renderer() {
         glfwPollEvents();
     }
 
-    if (g_displayList != 0) {
-        glDeleteLists(g_displayList, 1);
-        g_displayList = 0;
-    }
-    g_evaluator = nullptr;
-    g_paramEvaluator = nullptr;
+    if (builder.joinable()) StopMeshBuildThread(builder);
+    ReleaseMesh(g_gpuMesh);
+    ResetTerrain();
     glfwTerminate();
     return 0;
 }
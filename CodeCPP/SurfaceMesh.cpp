@@ -0,0 +1,145 @@
+#include "SurfaceMesh.h"
+
+namespace {
+
+const uint32_t kNoVertex = 0xffffffffu;
+
+void TriangulateHeights(const double* heights, size_t nu, size_t nv, size_t firstRow, double uMin, double vMin,
+                        double step, int uAxis, int vAxis, const char* breaks, float rangeMin, float rangeMax,
+                        std::vector<uint32_t>& remap, SurfaceMesh& mesh) {
+    int hAxis = 3 - uAxis - vAxis;
+    remap.assign(nu * nv, kNoVertex);
+
+    auto slope = [&](size_t n, size_t k, size_t count, size_t stride) -> double {
+        bool lo = k > 0 && std::isfinite(heights[n - stride]);
+        bool hi = k + 1 < count && std::isfinite(heights[n + stride]);
+        if (lo && hi) return (heights[n + stride] - heights[n - stride]) / (2.0 * step);
+        if (hi) return (heights[n + stride] - heights[n]) / step;
+        if (lo) return (heights[n] - heights[n - stride]) / step;
+        return 0.0;
+    };
+
+    auto vertexAt = [&](size_t i, size_t j) -> uint32_t {
+        size_t n = j * nu + i;
+        if (remap[n] != kNoVertex) return remap[n];
+        float p[3];
+        p[uAxis] = (float)(uMin + step * (double)i);
+        p[vAxis] = (float)(vMin + step * (double)(firstRow + j));
+        p[hAxis] = (float)heights[n];
+        if (!IsVertexValid(p[0], p[1], p[2], rangeMin, rangeMax)) return kNoVertex;
+        CachedVertex v;
+        v.x = p[0];
+        v.y = p[1];
+        v.z = p[2];
+        HeightColor(heights[n], v.r, v.g, v.b);
+        v.a = 1.0f;
+        double normal[3];
+        normal[uAxis] = -slope(n, i, nu, 1);
+        normal[vAxis] = -slope(n, j, nv, nu);
+        normal[hAxis] = 1.0;
+        PackNormal(normal[0], normal[1], normal[2], v);
+        remap[n] = (uint32_t)mesh.vertices.size();
+        mesh.vertices.push_back(v);
+        return remap[n];
+    };
+
+    for (size_t j = 0; j + 1 < nv; ++j) {
+        for (size_t i = 0; i + 1 < nu; ++i) {
+            if (breaks && breaks[j * (nu - 1) + i]) continue;
+            uint32_t a = vertexAt(i, j);
+            uint32_t b = vertexAt(i + 1, j);
+            uint32_t c = vertexAt(i, j + 1);
+            uint32_t d = vertexAt(i + 1, j + 1);
+            if (a == kNoVertex || b == kNoVertex || c == kNoVertex || d == kNoVertex) continue;
+            mesh.indices.push_back(a);
+            mesh.indices.push_back(b);
+            mesh.indices.push_back(c);
+            mesh.indices.push_back(c);
+            mesh.indices.push_back(b);
+            mesh.indices.push_back(d);
+        }
+    }
+}
+
+}
+
+void BuildHeightMesh(const double* heights, size_t nu, size_t nv, size_t firstRow, double uMin, double vMin,
+                     double step, int uAxis, int vAxis, const char* breaks, float rangeMin, float rangeMax,
+                     SurfaceMesh& mesh) {
+    mesh.reset(MeshPrimitive::Triangles, 1.0f);
+    if (nu < 2 || nv < 2) return;
+    mesh.vertices.reserve(nu * nv);
+    mesh.indices.reserve((nu - 1) * (nv - 1) * 6);
+    TriangulateHeights(heights, nu, nv, firstRow, uMin, vMin, step, uAxis, vAxis, breaks, rangeMin, rangeMax,
+                       mesh.remap, mesh);
+}
+
+void AppendHeightPatch(const double* heights, size_t nu, size_t nv, double uMin, double vMin, double step,
+                       int uAxis, int vAxis, const char* breaks, float rangeMin, float rangeMax, SurfaceMesh& mesh) {
+    if (nu < 2 || nv < 2) return;
+    thread_local std::vector<uint32_t> remap;
+    TriangulateHeights(heights, nu, nv, 0, uMin, vMin, step, uAxis, vAxis, breaks, rangeMin, rangeMax, remap, mesh);
+}
+
+void AddHeightMeshSkirt(size_t nu, size_t nv, int hAxis, float depth, SurfaceMesh& mesh) {
+    if (nu < 2 || nv < 2 || mesh.remap.size() != nu * nv) return;
+
+    auto lowered = [&](uint32_t v) -> uint32_t {
+        CachedVertex copy = mesh.vertices[v];
+        float& h = hAxis == 0 ? copy.x : (hAxis == 1 ? copy.y : copy.z);
+        h -= depth;
+        mesh.vertices.push_back(copy);
+        return (uint32_t)mesh.vertices.size() - 1;
+    };
+    auto edge = [&](size_t n0, size_t n1) {
+        uint32_t a = mesh.remap[n0];
+        uint32_t b = mesh.remap[n1];
+        if (a == kNoVertex || b == kNoVertex) return;
+        uint32_t la = lowered(a);
+        uint32_t lb = lowered(b);
+        mesh.indices.push_back(a);
+        mesh.indices.push_back(la);
+        mesh.indices.push_back(b);
+        mesh.indices.push_back(b);
+        mesh.indices.push_back(la);
+        mesh.indices.push_back(lb);
+    };
+
+    for (size_t i = 0; i + 1 < nu; ++i) {
+        edge(i, i + 1);
+        edge((nv - 1) * nu + i, (nv - 1) * nu + i + 1);
+    }
+    for (size_t j = 0; j + 1 < nv; ++j) {
+        edge(j * nu, (j + 1) * nu);
+        edge(j * nu + nu - 1, (j + 1) * nu + nu - 1);
+    }
+}
+
+void AccumulateTriangleNormals(const SurfaceMesh& mesh, size_t first, size_t last, std::vector<double>& sum) {
+    for (size_t k = first * 3; k < last * 3; k += 3) {
+        const uint32_t t[3] = { mesh.indices[k], mesh.indices[k + 1], mesh.indices[k + 2] };
+        const CachedVertex& a = mesh.vertices[t[0]];
+        const CachedVertex& b = mesh.vertices[t[1]];
+        const CachedVertex& c = mesh.vertices[t[2]];
+        double e1[3] = { b.x - a.x, b.y - a.y, b.z - a.z };
+        double e2[3] = { c.x - a.x, c.y - a.y, c.z - a.z };
+        double n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+        for (uint32_t v : t) {
+            sum[v * 3] += n[0];
+            sum[v * 3 + 1] += n[1];
+            sum[v * 3 + 2] += n[2];
+        }
+    }
+}
+
+void PackVertexNormals(const std::vector<double>& sum, size_t first, size_t last, SurfaceMesh& mesh) {
+    for (size_t v = first; v < last; ++v) {
+        PackNormal(sum[v * 3], sum[v * 3 + 1], sum[v * 3 + 2], mesh.vertices[v]);
+    }
+}
+
+void ComputeTriangleNormals(SurfaceMesh& mesh) {
+    std::vector<double> sum(mesh.vertices.size() * 3, 0.0);
+    AccumulateTriangleNormals(mesh, 0, mesh.indices.size() / 3, sum);
+    PackVertexNormals(sum, 0, mesh.vertices.size(), mesh);
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Normals are stored as signed bytes scaled by 127, which is plenty for
+// lighting and keeps the vertex at 32 bytes.
+struct CachedVertex {
+    float x, y, z;
+    float r, g, b, a;
+    int8_t nx, ny, nz, pad;
+};
+
+enum class MeshPrimitive {
+    Triangles,
+    Lines,
+    Points
+};
+
+// Shared-vertex mesh drawn with one indexed call. Indices form triangles,
+// line segments or points depending on primitive; size is the line width or
+// point size.
+struct SurfaceMesh {
+    MeshPrimitive primitive = MeshPrimitive::Triangles;
+    float size = 1.0f;
+    std::vector<CachedVertex> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> remap;
+
+    void clear() {
+        vertices.clear();
+        indices.clear();
+    }
+
+    void reset(MeshPrimitive p, float s) {
+        clear();
+        primitive = p;
+        size = s;
+    }
+
+    // Appends another mesh of the same primitive, offsetting its indices.
+    void append(const SurfaceMesh& other) {
+        uint32_t base = (uint32_t)vertices.size();
+        vertices.insert(vertices.end(), other.vertices.begin(), other.vertices.end());
+        for (uint32_t i : other.indices) indices.push_back(base + i);
+    }
+
+    // Adds a vertex to a line mesh, joined to the previous vertex when connect is set.
+    void addLineVertex(float x, float y, float z, float r, float g, float b, bool connect) {
+        uint32_t n = (uint32_t)vertices.size();
+        if (connect && n > 0) {
+            indices.push_back(n - 1);
+            indices.push_back(n);
+        }
+        vertices.push_back({ x, y, z, r, g, b, 1.0f, 0, 0, 127, 0 });
+    }
+};
+
+inline bool IsInRange(float val, float rangeMin, float rangeMax) {
+    const float MARGIN = 5.0f;
+    return val >= rangeMin - MARGIN && val <= rangeMax + MARGIN && std::isfinite(val);
+}
+
+inline bool IsVertexValid(float x, float y, float z, float rangeMin, float rangeMax) {
+    return IsInRange(x, rangeMin, rangeMax) &&
+           IsInRange(y, rangeMin, rangeMax) &&
+           IsInRange(z, rangeMin, rangeMax);
+}
+
+inline void HeightColor(double h, float& r, float& g, float& b) {
+    r = 0.2f + (float)((h + 5.0) / 20.0);
+    g = 0.4f;
+    b = 0.7f - (float)((h + 5.0) / 40.0);
+}
+
+inline void PackNormal(double x, double y, double z, CachedVertex& v) {
+    double len2 = x * x + y * y + z * z;
+    if (!(len2 > 0.0) || !std::isfinite(len2)) {
+        x = 0.0;
+        y = 0.0;
+        z = 1.0;
+        len2 = 1.0;
+    }
+    double scale = 127.0 / std::sqrt(len2);
+    v.nx = (int8_t)(x * scale + (x < 0.0 ? -0.5 : 0.5));
+    v.ny = (int8_t)(y * scale + (y < 0.0 ? -0.5 : 0.5));
+    v.nz = (int8_t)(z * scale + (z < 0.0 ? -0.5 : 0.5));
+    v.pad = 0;
+}
+
+// Triangulates an nu x nv grid of heights stored at heights[j * nu + i].
+// Grid point (i, j) sits at uMin + step * i on uAxis and vMin + step *
+// (firstRow + j) on vAxis (0 = x, 1 = y, 2 = z), so a band of a larger grid
+// places its rows exactly where the whole grid would; its height goes to the
+// remaining axis. Each
+// grid point becomes at most one vertex. A cell is emitted as two triangles
+// when its four corners are valid and breaks[j * (nu - 1) + i], if given, is clear.
+// Normals come from central differences of neighbouring heights, so they
+// cost no extra evaluations.
+void BuildHeightMesh(const double* heights, size_t nu, size_t nv, size_t firstRow, double uMin, double vMin,
+                     double step, int uAxis, int vAxis, const char* breaks, float rangeMin, float rangeMax,
+                     SurfaceMesh& mesh);
+
+// Triangulates a height grid as BuildHeightMesh does, but appends it to the
+// mesh with its own vertices. mesh.remap keeps describing the main grid, so
+// skirts still work. Used for cells resampled on a finer lattice.
+void AppendHeightPatch(const double* heights, size_t nu, size_t nv, double uMin, double vMin, double step,
+                       int uAxis, int vAxis, const char* breaks, float rangeMin, float rangeMax, SurfaceMesh& mesh);
+
+// Hangs a strip of the given depth below every boundary edge of a mesh just
+// built by BuildHeightMesh (mesh.remap must still describe the nu x nv grid).
+// The strip is pushed along -hAxis and hides cracks where meshes of different
+// resolution meet.
+void AddHeightMeshSkirt(size_t nu, size_t nv, int hAxis, float depth, SurfaceMesh& mesh);
+
+// Sets each vertex normal of a triangle mesh to the area-weighted sum of the
+// faces around it, for meshes without a regular grid to difference.
+void ComputeTriangleNormals(SurfaceMesh& mesh);
+
+// ComputeTriangleNormals in parts, for builders that spread it over several
+// calls: the faces of triangles [first, last) are added to sum, which holds
+// three zeroed entries per vertex, then vertices [first, last) are packed.
+void AccumulateTriangleNormals(const SurfaceMesh& mesh, size_t first, size_t last, std::vector<double>& sum);
+void PackVertexNormals(const std::vector<double>& sum, size_t first, size_t last, SurfaceMesh& mesh);
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "AllocationCounter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class WorkerPool {
+public:
+    typedef void (*TaskFn)(void* context, size_t begin, size_t end, unsigned worker);
+
+    static WorkerPool& Instance() {
+        static WorkerPool pool;
+        return pool;
+    }
+
+    unsigned workerCount() const { return (unsigned)threads.size() + 1; }
+
+    void run(size_t count, size_t grain, TaskFn fn, void* context) {
+        if (count == 0) return;
+        if (grain == 0) grain = 1;
+        std::lock_guard<std::mutex> dispatch(dispatchMutex);
+        if (threads.empty() || count <= grain) {
+            fn(context, 0, count, 0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobFn = fn;
+            jobContext = context;
+            jobCount = count;
+            jobGrain = grain;
+            nextIndex.store(0);
+            jobAllocations.store(0);
+            pending = (unsigned)threads.size();
+            ++generation;
+        }
+        wake.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+        // Workers allocate on the caller's behalf, so their count is the caller's.
+        AddThreadAllocations(jobAllocations.load());
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+private:
+    WorkerPool() {
+        unsigned hw = std::thread::hardware_concurrency();
+        if (hw == 0) hw = 1;
+        for (unsigned i = 1; i < hw; ++i) {
+            threads.emplace_back(&WorkerPool::threadMain, this, i);
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    void work(unsigned worker) {
+        for (;;) {
+            size_t begin = nextIndex.fetch_add(jobGrain);
+            if (begin >= jobCount) break;
+            jobFn(jobContext, begin, std::min(begin + jobGrain, jobCount), worker);
+        }
+    }
+
+    void threadMain(unsigned worker) {
+        unsigned long long seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            lock.unlock();
+            size_t allocations = ThreadAllocationCount();
+            work(worker);
+            jobAllocations.fetch_add(ThreadAllocationCount() - allocations);
+            lock.lock();
+            if (--pending == 0) done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex dispatchMutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping = false;
+    unsigned long long generation = 0;
+    unsigned pending = 0;
+    TaskFn jobFn = nullptr;
+    void* jobContext = nullptr;
+    size_t jobCount = 0;
+    size_t jobGrain = 1;
+    std::atomic<size_t> nextIndex{0};
+    std::atomic<size_t> jobAllocations{0};
+};
+
+template <typename F>
+void ParallelFor(size_t count, size_t grain, F&& body) {
+    typedef typename std::remove_reference<F>::type Body;
+    struct Thunk {
+        static void call(void* context, size_t begin, size_t end, unsigned worker) {
+            (*static_cast<Body*>(context))(begin, end, worker);
+        }
+    };
+    WorkerPool::Instance().run(count, grain, &Thunk::call, (void*)&body);
+}
@@ -94,6 +94,7 @@
 *            This File Has Been modified by strozz1432             *
 *                                                                  *
 ********************************************************************
+*/
 
 
 